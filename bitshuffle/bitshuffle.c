@@ -9,13 +9,33 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200112L // posix_memalign
+
 #include "bitshuffle.h"
 #include "iochain.h"
 #include "lz4.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
+#if defined(__GNUC__) && !defined(__clang__) \
+    && (defined(__x86_64__) || defined(__i386__))
+// Compile the kernels of every instruction set, each section for its own
+// target, and pick the best one the CPU supports at runtime.
+#define BSHUF_RUNTIME_DISPATCH
+#define USESSE2
+#define USEAVX2
+#define USEAVX512BW
+#else
+
+#if defined(__AVX512BW__) && defined(__AVX2__) && defined (__SSE2__)
+#define USEAVX512BW
+#endif
 
 #if defined(__AVX2__) && defined (__SSE2__)
 #define USEAVX2
@@ -25,6 +45,8 @@
 #define USESSE2
 #endif
 
+#endif // BSHUF_RUNTIME_DISPATCH
+
 
 // Conditional includes for SSE2 and AVX2.
 #ifdef USEAVX2
@@ -38,8 +60,6 @@
 #define BSHUF_MIN_RECOMMEND_BLOCK 128
 #define BSHUF_BLOCKED_MULT 8    // Block sizes must be multiple of this.
 #define BSHUF_TARGET_BLOCK_SIZE_B 8192
-// Use fast decompression instead of safe decompression for LZ4.
-#define BSHUF_LZ4_DECOMPRESS_FAST
 
 
 // Macros.
@@ -48,27 +68,18 @@
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 #define CHECK_ERR(count) if (count < 0) { return count; }
 #define CHECK_ERR_FREE(count, buf) if (count < 0) { free(buf); return count; }
-#define CHECK_ERR_FREE_LZ(count, buf) if (count < 0) {                      \
-    free(buf); return count - 1000; }
+#define CHECK_ERR_LZ(count) if (count < 0) { return count - 1000; }
 
 
-/* ---- Functions indicating compile time instruction set. ---- */
+/* ---- Functions indicating the instruction set in use. ---- */
 
 int bshuf_using_SSE2(void) {
-#ifdef USESSE2
-    return 1;
-#else
-    return 0;
-#endif
+    return bshuf_isa() >= BSHUF_ISA_SSE2;
 }
 
 
 int bshuf_using_AVX2(void) {
-#ifdef USEAVX2
-    return 1;
-#else
-    return 0;
-#endif
+    return bshuf_isa() >= BSHUF_ISA_AVX2;
 }
 
 
@@ -230,23 +241,18 @@ int64_t bshuf_trans_bitrow_eight(void* in, void* out, const size_t size,
 
 /* Transpose bits within elements. */
 int64_t bshuf_trans_bit_elem_scal(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_elem_scal(in, out, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bit_byte_scal(out, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bitrow_eight(tmp_buf, out, size, elem_size);
 
-    free(tmp_buf);
-
     return count;
 }
 
@@ -305,21 +311,16 @@ int64_t bshuf_shuffle_bit_eightelem_scal(void* in, void* out,
 
 /* Untranspose bits within elements. */
 int64_t bshuf_untrans_bit_elem_scal(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_bitrow_scal(in, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count =  bshuf_shuffle_bit_eightelem_scal(tmp_buf, out, size, elem_size);
 
-    free(tmp_buf);
-
     return count;
 }
 
@@ -335,6 +336,11 @@ int64_t bshuf_untrans_bit_elem_scal(void* in, void* out, const size_t size,
 
 #ifdef USESSE2
 
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+
 /* Transpose bytes within elements for 16 bit elements. */
 int64_t bshuf_trans_byte_elem_SSE_16(void* in, void* out, const size_t size) {
 
@@ -577,23 +583,18 @@ int64_t bshuf_trans_bit_byte_SSE(void* in, void* out, const size_t size,
 
 /* Transpose bits within elements. */
 int64_t bshuf_trans_bit_elem_SSE(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_elem_SSE(in, out, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bit_byte_SSE(out, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bitrow_eight(tmp_buf, out, size, elem_size);
 
-    free(tmp_buf);
-
     return count;
 }
 
@@ -744,35 +745,34 @@ int64_t bshuf_shuffle_bit_eightelem_SSE(void* in, void* out, const size_t size,
 
 /* Untranspose bits within elements. */
 int64_t bshuf_untrans_bit_elem_SSE(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_bitrow_SSE(in, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count =  bshuf_shuffle_bit_eightelem_SSE(tmp_buf, out, size, elem_size);
 
-    free(tmp_buf);
-
     return count;
 }
 
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC pop_options
+#endif
+
 #else // #ifdef USESSE2
 
 
 int64_t bshuf_untrans_bit_elem_SSE(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
     return -11;
 }
 
 
 int64_t bshuf_trans_bit_elem_SSE(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
     return -11;
 }
 
@@ -832,6 +832,11 @@ int64_t bshuf_shuffle_bit_eightelem_SSE(void* in, void* out, const size_t size,
 
 #ifdef USEAVX2
 
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
 /* Transpose bits within bytes. */
 int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
          const size_t elem_size) {
@@ -865,23 +870,18 @@ int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
 
 /* Transpose bits within elements. */
 int64_t bshuf_trans_bit_elem_AVX(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_elem_SSE(in, out, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bit_byte_AVX(out, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count = bshuf_trans_bitrow_eight(tmp_buf, out, size, elem_size);
 
-    free(tmp_buf);
-
     return count;
 }
 
@@ -1021,24 +1021,23 @@ int64_t bshuf_shuffle_bit_eightelem_AVX(void* in, void* out, const size_t size,
 
 /* Untranspose bits within elements. */
 int64_t bshuf_untrans_bit_elem_AVX(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
 
     int64_t count;
 
     CHECK_MULT_EIGHT(size);
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
-
     count = bshuf_trans_byte_bitrow_AVX(in, tmp_buf, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    CHECK_ERR(count);
     count =  bshuf_shuffle_bit_eightelem_AVX(tmp_buf, out, size, elem_size);
-
-    free(tmp_buf);
     return count;
 }
 
 
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC pop_options
+#endif
+
 #else // #ifdef USEAVX2
 
 int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
@@ -1048,7 +1047,7 @@ int64_t bshuf_trans_bit_byte_AVX(void* in, void* out, const size_t size,
 
 
 int64_t bshuf_trans_bit_elem_AVX(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
     return -12;
 }
 
@@ -1066,56 +1065,557 @@ int64_t bshuf_shuffle_bit_eightelem_AVX(void* in, void* out, const size_t size,
 
 
 int64_t bshuf_untrans_bit_elem_AVX(void* in, void* out, const size_t size,
-         const size_t elem_size) {
+         const size_t elem_size, void* tmp_buf) {
     return -12;
 }
 
 #endif // #ifdef USEAVX2
 
 
-/* ---- Drivers selecting best instruction set at compile time. ---- */
+/* ---- Code that requires AVX-512BW. Intel Skylake-SP (2017), AMD Zen 4 and
+ * later. ----
+ *
+ * Only the direction used for decompression is implemented; compression
+ * uses the AVX2 kernels on these processors.
+ *
+ */
 
-int64_t bshuf_trans_bit_elem(void* in, void* out, const size_t size, 
-        const size_t elem_size) {
+#ifdef USEAVX512BW
 
-    int64_t count;
-#ifdef USEAVX2
-    count = bshuf_trans_bit_elem_AVX(in, out, size, elem_size);
-#elif defined(USESSE2)
-    count = bshuf_trans_bit_elem_SSE(in, out, size, elem_size);
-#else
-    count = bshuf_trans_bit_elem_scal(in, out, size, elem_size);
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
 #endif
+
+/* For data organized into a row for each bit (8 * elem_size rows), transpose
+ * the bytes. Same unpacking as the SSE2 version, in the four 128 bit lanes
+ * at once. */
+int64_t bshuf_trans_byte_bitrow_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size) {
+
+    size_t ii, jj, kk, ll;
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+
+    CHECK_MULT_EIGHT(size);
+
+    size_t nrows = 8 * elem_size;
+    size_t nbyte_row = size / 8;
+
+    __m512i r[8], t[8];
+    uint64_t q[8] __attribute__((aligned(64)));
+
+    for (ii = 0; ii + 7 < nrows; ii += 8) {
+        for (jj = 0; jj + 63 < nbyte_row; jj += 64) {
+            for (kk = 0; kk < 8; kk++) {
+                r[kk] = _mm512_loadu_si512(&in_b[(ii + kk) * nbyte_row + jj]);
+            }
+
+            for (kk = 0; kk < 4; kk++) {
+                t[kk] = _mm512_unpacklo_epi8(r[kk * 2], r[kk * 2 + 1]);
+                t[kk + 4] = _mm512_unpackhi_epi8(r[kk * 2], r[kk * 2 + 1]);
+            }
+
+            for (kk = 0; kk < 2; kk++) {
+                r[kk * 4 + 0] = _mm512_unpacklo_epi16(t[kk * 4 + 0],
+                        t[kk * 4 + 1]);
+                r[kk * 4 + 1] = _mm512_unpacklo_epi16(t[kk * 4 + 2],
+                        t[kk * 4 + 3]);
+                r[kk * 4 + 2] = _mm512_unpackhi_epi16(t[kk * 4 + 0],
+                        t[kk * 4 + 1]);
+                r[kk * 4 + 3] = _mm512_unpackhi_epi16(t[kk * 4 + 2],
+                        t[kk * 4 + 3]);
+            }
+
+            for (kk = 0; kk < 4; kk++) {
+                t[kk * 2] = _mm512_unpacklo_epi32(r[kk * 2], r[kk * 2 + 1]);
+                t[kk * 2 + 1] = _mm512_unpackhi_epi32(r[kk * 2],
+                        r[kk * 2 + 1]);
+            }
+
+            // Lane ll of t[kk] holds the 8 bytes of column
+            // jj + 16 * ll + 2 * kk, then those of the next column.
+            for (kk = 0; kk < 8; kk++) {
+                _mm512_store_si512(q, t[kk]);
+                for (ll = 0; ll < 4; ll++) {
+                    size_t col = jj + 16 * ll + 2 * kk;
+                    memcpy(&out_b[col * nrows + ii], &q[2 * ll], 8);
+                    memcpy(&out_b[(col + 1) * nrows + ii], &q[2 * ll + 1], 8);
+                }
+            }
+        }
+        for (jj = nbyte_row - nbyte_row % 64; jj < nbyte_row; jj ++) {
+            for (kk = 0; kk < 8; kk++) {
+                out_b[jj * nrows + ii + kk] = in_b[(ii + kk) * nbyte_row + jj];
+            }
+        }
+    }
+    return size * elem_size;
+}
+
+
+/* Shuffle bits within the bytes of eight element blocks.
+ *
+ * For elements of 1, 2 and 4 bytes, the eight bit transposes of 64 bytes are
+ * done in parallel in the 64 bit lanes, then the bytes of each block are
+ * interleaved back into elements with byte and word permutations. Wider
+ * elements go through the mask registers like the AVX2 version. */
+int64_t bshuf_shuffle_bit_eightelem_AVX512(void* in, void* out,
+        const size_t size, const size_t elem_size) {
+
+    CHECK_MULT_EIGHT(size);
+
+    char* in_b = (char*) in;
+    char* out_b = (char*) out;
+
+    size_t ii, jj, kk;
+    size_t nbyte = elem_size * size;
+
+    if (elem_size % 8 == 0) {
+        __m512i zmm;
+        for (jj = 0; jj + 63 < 8 * elem_size; jj += 64) {
+            for (ii = 0; ii + 8 * elem_size - 1 < nbyte;
+                    ii += 8 * elem_size) {
+                zmm = _mm512_loadu_si512(&in_b[ii + jj]);
+                for (kk = 0; kk < 8; kk++) {
+                    uint64_t bt = _mm512_movepi8_mask(zmm);
+                    zmm = _mm512_slli_epi16(zmm, 1);
+                    size_t ind = (ii + jj / 8 + (7 - kk) * elem_size);
+                    memcpy(&out_b[ind], &bt, 8);
+                }
+            }
+        }
+        return size * elem_size;
+    }
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) {
+        return bshuf_shuffle_bit_eightelem_AVX(in, out, size, elem_size);
+    }
+
+    const __m512i mask7 = _mm512_set1_epi64(0x00AA00AA00AA00AALL);
+    const __m512i mask14 = _mm512_set1_epi64(0x0000CCCC0000CCCCLL);
+    const __m512i mask28 = _mm512_set1_epi64(0x00000000F0F0F0F0LL);
+    // Byte kk of the two transposed blocks of a lane next to each other
+    const __m512i interleave_bytes = _mm512_broadcast_i32x4(_mm_setr_epi8(
+            0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15));
+    // Then the words of the two lanes of each 256 bit half
+    const __m512i interleave_words = _mm512_set_epi16(
+            31, 23, 30, 22, 29, 21, 28, 20, 27, 19, 26, 18, 25, 17, 24, 16,
+            15, 7, 14, 6, 13, 5, 12, 4, 11, 3, 10, 2, 9, 1, 8, 0);
+    __m512i x, t;
+
+    for (ii = 0; ii + 63 < nbyte; ii += 64) {
+        x = _mm512_loadu_si512(&in_b[ii]);
+        // TRANS_BIT_8X8 in every 64 bit lane; 0x96 is a ^ b ^ c
+        t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 7)),
+                mask7);
+        x = _mm512_ternarylogic_epi64(x, t, _mm512_slli_epi64(t, 7), 0x96);
+        t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 14)),
+                mask14);
+        x = _mm512_ternarylogic_epi64(x, t, _mm512_slli_epi64(t, 14), 0x96);
+        t = _mm512_and_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 28)),
+                mask28);
+        x = _mm512_ternarylogic_epi64(x, t, _mm512_slli_epi64(t, 28), 0x96);
+
+        if (elem_size > 1) x = _mm512_shuffle_epi8(x, interleave_bytes);
+        if (elem_size > 2) x = _mm512_permutexvar_epi16(interleave_words, x);
+        _mm512_storeu_si512(&out_b[ii], x);
+    }
+    if (ii < nbyte) {
+        bshuf_shuffle_bit_eightelem_scal(&in_b[ii], &out_b[ii],
+                (nbyte - ii) / elem_size, elem_size);
+    }
+    return size * elem_size;
+}
+
+
+/* Untranspose bits within elements. */
+int64_t bshuf_untrans_bit_elem_AVX512(void* in, void* out, const size_t size,
+         const size_t elem_size, void* tmp_buf) {
+
+    int64_t count;
+
+    CHECK_MULT_EIGHT(size);
+
+    count = bshuf_trans_byte_bitrow_AVX512(in, tmp_buf, size, elem_size);
+    CHECK_ERR(count);
+    count =  bshuf_shuffle_bit_eightelem_AVX512(tmp_buf, out, size,
+            elem_size);
     return count;
 }
 
+#ifdef BSHUF_RUNTIME_DISPATCH
+#pragma GCC pop_options
+#endif
 
-int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size, 
+#endif // #ifdef USEAVX512BW
+
+
+/* ---- Scratch memory ----
+ *
+ * The block functions used to malloc and free their temporaries for every
+ * block, thousands of times per frame, contending in the allocator once
+ * several threads decode at the same time. Each thread now keeps one
+ * scratch buffer, sized for the default block on first use and reused for
+ * every block and frame after that. It is freed when the thread exits.
+ */
+
+#define SCRATCH_ALIGN 64
+
+/* The scratch of a block holds three cache line aligned regions: the
+ * block bitshuffled, the temporary of the bit transpose and the LZ4
+ * compressed block. */
+static size_t scratch_region_size(const size_t nbytes) {
+    return (nbytes + SCRATCH_ALIGN - 1) & ~(size_t) (SCRATCH_ALIGN - 1);
+}
+
+
+static size_t block_scratch_size(const size_t block_size,
         const size_t elem_size) {
+    size_t nbytes = block_size * elem_size;
+    return 2 * scratch_region_size(nbytes)
+        + scratch_region_size(LZ4_compressBound(nbytes));
+}
 
-    int64_t count;
-#ifdef USEAVX2
-    count = bshuf_untrans_bit_elem_AVX(in, out, size, elem_size);
-#elif defined(USESSE2)
-    count = bshuf_untrans_bit_elem_SSE(in, out, size, elem_size);
+
+typedef struct {
+    void* buf;
+    size_t size;
+    int nthreads;   // see bshuf_set_threads, 0 if not set
+} bshuf_arena;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_free(void* arg) {
+    bshuf_arena* arena = (bshuf_arena*) arg;
+    free(arena->buf);
+    free(arena);
+}
+
+
+static void arena_init(void) {
+    pthread_key_create(&arena_key, arena_free);
+}
+
+
+/* The calling thread's arena, NULL if out of memory. */
+static bshuf_arena* thread_arena(void) {
+    pthread_once(&arena_once, arena_init);
+    bshuf_arena* arena = (bshuf_arena*) pthread_getspecific(arena_key);
+    if (arena == NULL) {
+        arena = (bshuf_arena*) calloc(1, sizeof(bshuf_arena));
+        if (arena == NULL) return NULL;
+        pthread_setspecific(arena_key, arena);
+    }
+    return arena;
+}
+
+
+/* At least size bytes of scratch for the calling thread, NULL if out of
+ * memory. */
+static void* thread_scratch(const size_t size) {
+    bshuf_arena* arena = thread_arena();
+    if (arena == NULL) return NULL;
+    if (arena->size < size) {
+        // The default block is the same number of bytes for any elem_size.
+        size_t want = MAX(size,
+                block_scratch_size(bshuf_default_block_size(1), 1));
+        void* buf;
+        if (posix_memalign(&buf, SCRATCH_ALIGN, want) != 0) return NULL;
+        free(arena->buf);
+        arena->buf = buf;
+        arena->size = want;
+    }
+    return arena->buf;
+}
+
+
+/* ---- Threads per call ----
+ *
+ * The blocks of one call are spread over an OpenMP team. Callers that
+ * already process several buffers at once, one per thread, must keep
+ * those teams from multiplying; how many threads each call gets is
+ * therefore set per calling thread instead of through the OpenMP
+ * defaults, which also apply to every other parallel region.
+ */
+
+void bshuf_set_threads(int nthreads) {
+    bshuf_arena* arena = thread_arena();
+    if (arena != NULL) arena->nthreads = MAX(nthreads, 0);
+}
+
+
+int bshuf_threads(void) {
+#ifdef _OPENMP
+    bshuf_arena* arena = thread_arena();
+    if (arena != NULL && arena->nthreads > 0) return arena->nthreads;
+    return omp_get_max_threads();
 #else
-    count = bshuf_untrans_bit_elem_scal(in, out, size, elem_size);
+    return 1;
 #endif
-    return count;
+}
+
+
+/* ---- Drivers selecting the best instruction set at runtime. ----
+ *
+ * The kernels are resolved once, from cpuid where every instruction set is
+ * compiled in (BSHUF_RUNTIME_DISPATCH), else from the compiler flags.
+ */
+
+typedef int64_t (*bshufBitElemFunDef)(void* in, void* out, const size_t size,
+        const size_t elem_size, void* tmp_buf);
+
+// The two passes of an untranspose, for the widening decoders.
+typedef int64_t (*bshufUntransPassFunDef)(void* in, void* out,
+        const size_t size, const size_t elem_size);
+
+static int kernels_isa = BSHUF_ISA_SCALAR;
+static bshufBitElemFunDef trans_bit_elem_fun = &bshuf_trans_bit_elem_scal;
+static bshufBitElemFunDef untrans_bit_elem_fun = &bshuf_untrans_bit_elem_scal;
+static bshufUntransPassFunDef trans_byte_bitrow_fun =
+    &bshuf_trans_byte_bitrow_scal;
+static bshufUntransPassFunDef shuffle_bit_eightelem_fun =
+    &bshuf_shuffle_bit_eightelem_scal;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+
+int bshuf_isa_supported(int isa) {
+    switch (isa) {
+    case BSHUF_ISA_SCALAR:
+        return 1;
+#ifdef BSHUF_RUNTIME_DISPATCH
+    case BSHUF_ISA_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case BSHUF_ISA_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    case BSHUF_ISA_AVX512BW:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512bw");
+#else
+#ifdef USESSE2
+    case BSHUF_ISA_SSE2:
+        return 1;
+#endif
+#ifdef USEAVX2
+    case BSHUF_ISA_AVX2:
+        return 1;
+#endif
+#ifdef USEAVX512BW
+    case BSHUF_ISA_AVX512BW:
+        return 1;
+#endif
+#endif
+    }
+    return 0;
+}
+
+
+static void set_kernels(int isa) {
+    switch (isa) {
+#ifdef USEAVX512BW
+    case BSHUF_ISA_AVX512BW:
+        trans_bit_elem_fun = &bshuf_trans_bit_elem_AVX;
+        untrans_bit_elem_fun = &bshuf_untrans_bit_elem_AVX512;
+        trans_byte_bitrow_fun = &bshuf_trans_byte_bitrow_AVX512;
+        shuffle_bit_eightelem_fun = &bshuf_shuffle_bit_eightelem_AVX512;
+        break;
+#endif
+#ifdef USEAVX2
+    case BSHUF_ISA_AVX2:
+        trans_bit_elem_fun = &bshuf_trans_bit_elem_AVX;
+        untrans_bit_elem_fun = &bshuf_untrans_bit_elem_AVX;
+        trans_byte_bitrow_fun = &bshuf_trans_byte_bitrow_AVX;
+        shuffle_bit_eightelem_fun = &bshuf_shuffle_bit_eightelem_AVX;
+        break;
+#endif
+#ifdef USESSE2
+    case BSHUF_ISA_SSE2:
+        trans_bit_elem_fun = &bshuf_trans_bit_elem_SSE;
+        untrans_bit_elem_fun = &bshuf_untrans_bit_elem_SSE;
+        trans_byte_bitrow_fun = &bshuf_trans_byte_bitrow_SSE;
+        shuffle_bit_eightelem_fun = &bshuf_shuffle_bit_eightelem_SSE;
+        break;
+#endif
+    default:
+        isa = BSHUF_ISA_SCALAR;
+        trans_bit_elem_fun = &bshuf_trans_bit_elem_scal;
+        untrans_bit_elem_fun = &bshuf_untrans_bit_elem_scal;
+        trans_byte_bitrow_fun = &bshuf_trans_byte_bitrow_scal;
+        shuffle_bit_eightelem_fun = &bshuf_shuffle_bit_eightelem_scal;
+    }
+    kernels_isa = isa;
+}
+
+
+static void kernels_init(void) {
+    int isa = BSHUF_ISA_AVX512BW;
+    while (isa > BSHUF_ISA_SCALAR && !bshuf_isa_supported(isa)) isa--;
+    set_kernels(isa);
+}
+
+
+int bshuf_isa(void) {
+    pthread_once(&kernels_once, kernels_init);
+    return kernels_isa;
+}
+
+
+int bshuf_set_isa(int isa) {
+    pthread_once(&kernels_once, kernels_init);
+    if (!bshuf_isa_supported(isa)) return -1;
+    set_kernels(isa);
+    return 0;
+}
+
+
+const char* bshuf_isa_name(int isa) {
+    switch (isa) {
+    case BSHUF_ISA_SCALAR: return "scalar";
+    case BSHUF_ISA_SSE2: return "SSE2";
+    case BSHUF_ISA_AVX2: return "AVX2";
+    case BSHUF_ISA_AVX512BW: return "AVX-512BW";
+    }
+    return "unknown";
+}
+
+
+/* tmp_buf must hold size * elem_size bytes. If NULL, the thread's scratch
+ * is used. */
+int64_t bshuf_trans_bit_elem_buf(void* in, void* out, const size_t size,
+        const size_t elem_size, void* tmp_buf) {
+
+    pthread_once(&kernels_once, kernels_init);
+    if (tmp_buf == NULL) tmp_buf = thread_scratch(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+    return trans_bit_elem_fun(in, out, size, elem_size, tmp_buf);
+}
+
+
+int64_t bshuf_untrans_bit_elem_buf(void* in, void* out, const size_t size,
+        const size_t elem_size, void* tmp_buf) {
+
+    pthread_once(&kernels_once, kernels_init);
+    if (tmp_buf == NULL) tmp_buf = thread_scratch(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+    return untrans_bit_elem_fun(in, out, size, elem_size, tmp_buf);
+}
+
+
+/* ---- Untranspose into 32 bit signed pixels ----
+ *
+ * Detector frames of 8 and 16 bit pixels are wanted as int32, with the
+ * error value (saturated pixels) replaced by -1. Rather than untransposing
+ * a whole block and widening it in a second pass, the last pass of the
+ * untranspose runs on BSHUF_WIDEN_CHUNK elements at a time, which are
+ * widened while they are in L1.
+ */
+
+#define BSHUF_WIDEN_CHUNK 512
+
+/* Written without branches, in groups of a fixed 16 elements, so that
+ * compilers vectorize the loops even at -O2. */
+#define WIDEN_I32(type_t)                                                  \
+    do {                                                                    \
+        const type_t* in_t = (const type_t*) in;                            \
+        uint32_t err = error_val < 0 ? 0 : (uint32_t) error_val;            \
+        uint32_t replace = error_val < 0 ? 0 : UINT32_MAX;                  \
+        for (ii = 0; ii + 16 <= size; ii += 16) {                           \
+            for (kk = 0; kk < 16; kk++) {                                   \
+                uint32_t v = in_t[ii + kk];                                 \
+                out[ii + kk] = (int32_t)                                    \
+                    (v | (replace & -(uint32_t) (v == err)));               \
+            }                                                               \
+        }                                                                   \
+        for (; ii < size; ii++) {                                           \
+            uint32_t v = in_t[ii];                                          \
+            out[ii] = (int32_t) (v | (replace & -(uint32_t) (v == err)));   \
+        }                                                                   \
+    } while (0)
+
+static void widen_i32(const void* in, int32_t* out, const size_t size,
+        const size_t elem_size, const int64_t error_val) {
+    size_t ii, kk;
+    switch (elem_size) {
+    case 1: WIDEN_I32(uint8_t); break;
+    case 2: WIDEN_I32(uint16_t); break;
+    case 4: WIDEN_I32(uint32_t); break;
+    }
+}
+
+#undef WIDEN_I32
+
+
+/* tmp_buf must hold size * elem_size bytes. If NULL, the thread's scratch
+ * is used. */
+int64_t bshuf_untrans_bit_elem_i32_buf(void* in, int32_t* out,
+        const size_t size, const size_t elem_size, const int64_t error_val,
+        void* tmp_buf) {
+
+    size_t ii;
+    int64_t count;
+    uint64_t chunk[BSHUF_WIDEN_CHUNK * 4 / sizeof(uint64_t)];
+
+    CHECK_MULT_EIGHT(size);
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) return -1;
+    pthread_once(&kernels_once, kernels_init);
+    if (tmp_buf == NULL) tmp_buf = thread_scratch(size * elem_size);
+    if (tmp_buf == NULL) return -1;
+
+    count = trans_byte_bitrow_fun(in, tmp_buf, size, elem_size);
+    CHECK_ERR(count);
+    // Groups of 8 elements untranspose independently of each other.
+    for (ii = 0; ii < size; ii += BSHUF_WIDEN_CHUNK) {
+        size_t n = MIN(BSHUF_WIDEN_CHUNK, size - ii);
+        count = shuffle_bit_eightelem_fun((char*) tmp_buf + ii * elem_size,
+                chunk, n, elem_size);
+        CHECK_ERR(count);
+        widen_i32(chunk, out + ii, n, elem_size, error_val);
+    }
+    return size * elem_size;
+}
+
+
+int64_t bshuf_trans_bit_elem(void* in, void* out, const size_t size, 
+        const size_t elem_size) {
+    return bshuf_trans_bit_elem_buf(in, out, size, elem_size, NULL);
+}
+
+
+int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size, 
+        const size_t elem_size) {
+    return bshuf_untrans_bit_elem_buf(in, out, size, elem_size, NULL);
 }
 
 
 /* ---- Wrappers for implementing blocking ---- */
 
-/* Function definition for worker functions that process a single block. */
+/* Output of the unshuffling block functions: as stored when NULL, else
+ * int32 pixels with error_val (unless negative) replaced by -1. */
+typedef struct {
+    int64_t error_val;
+} bshuf_widen;
+
+
+/* Function definition for worker functions that process a single block.
+ * scratch holds block_scratch_size() bytes, or is NULL if it could not be
+ * allocated: the function must then still advance the chain and fail.
+ * in_end, if not NULL, is the end of the input: blocks of variable length
+ * must not read past it. */
 typedef int64_t (*bshufBlockFunDef)(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size);
+        const size_t size, const size_t elem_size, void* scratch,
+        const char* in_end, const bshuf_widen* widen);
 
 
 /* Wrap a function for processing a single block to process an entire buffer in
- * parallel. */
+ * parallel on bshuf_threads() threads, every thread with its own scratch.
+ * With the caller's scratch, the blocks are processed one after another in
+ * the calling thread. */
 int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
-        const size_t size, const size_t elem_size, size_t block_size) {
+        const size_t size, const size_t elem_size, size_t block_size,
+        void* scratch, size_t scratch_size, const char* in_end,
+        const bshuf_widen* widen) {
 
     size_t ii;
     ioc_chain C;
@@ -1128,18 +1628,36 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
         block_size = bshuf_default_block_size(elem_size);
     }
     if (block_size < 0 || block_size % BSHUF_BLOCKED_MULT) return -81;
-
-    #pragma omp parallel for private(count) reduction(+ : cum_count)
-    for (ii = 0; ii < size / block_size; ii ++) {
-        count = fun(&C, block_size, elem_size);
-        if (count < 0) err = count;
-        cum_count += count;
+    size_t scratch_needed = block_scratch_size(block_size, elem_size);
+    if (scratch != NULL && scratch_size < scratch_needed) return -1;
+
+    if (scratch != NULL) {
+        for (ii = 0; ii < size / block_size; ii ++) {
+            count = fun(&C, block_size, elem_size, scratch, in_end, widen);
+            if (count < 0) err = count;
+            cum_count += count;
+        }
+    } else {
+        int nthreads = bshuf_threads();
+        (void) nthreads;
+#ifdef _OPENMP
+        #pragma omp parallel for num_threads(nthreads) if (nthreads > 1) \
+            private(count) reduction(+ : cum_count)
+#endif
+        for (ii = 0; ii < size / block_size; ii ++) {
+            count = fun(&C, block_size, elem_size,
+                    thread_scratch(scratch_needed), in_end, widen);
+            if (count < 0) err = count;
+            cum_count += count;
+        }
     }
 
     last_block_size = size % block_size;
     last_block_size = last_block_size - last_block_size % BSHUF_BLOCKED_MULT;
     if (last_block_size) {
-        count = fun(&C, last_block_size, elem_size);
+        count = fun(&C, last_block_size, elem_size,
+                scratch != NULL ? scratch : thread_scratch(scratch_needed),
+                in_end, widen);
         if (count < 0) err = count;
         cum_count += count;
     }
@@ -1150,10 +1668,21 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
     size_t this_iter;
     char *last_in = (char *) ioc_get_in(&C, &this_iter);
     ioc_set_next_in(&C, &this_iter, (void *) (last_in + leftover_bytes));
+    if (in_end != NULL && leftover_bytes > (size_t) (in_end - last_in)) {
+        ioc_destroy(&C);
+        return -91;
+    }
     char *last_out = (char *) ioc_get_out(&C, &this_iter);
-    ioc_set_next_out(&C, &this_iter, (void *) (last_out + leftover_bytes));
-
-    memcpy(last_out, last_in, leftover_bytes);
+    if (widen != NULL) {
+        ioc_set_next_out(&C, &this_iter, (void *) (last_out
+                    + size % BSHUF_BLOCKED_MULT * sizeof(int32_t)));
+        widen_i32(last_in, (int32_t*) last_out, size % BSHUF_BLOCKED_MULT,
+                elem_size, widen->error_val);
+    } else {
+        ioc_set_next_out(&C, &this_iter,
+                (void *) (last_out + leftover_bytes));
+        memcpy(last_out, last_in, leftover_bytes);
+    }
 
     ioc_destroy(&C);
 
@@ -1163,7 +1692,8 @@ int64_t bshuf_blocked_wrap_fun(bshufBlockFunDef fun, void* in, void* out,
 
 /* Bitshuffle a single block. */
 int64_t bshuf_bitshuffle_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, void* scratch,
+        const char* in_end, const bshuf_widen* widen) {
 
     size_t this_iter;
     void *in = ioc_get_in(C_ptr, &this_iter);
@@ -1173,15 +1703,19 @@ int64_t bshuf_bitshuffle_block(ioc_chain *C_ptr,
     ioc_set_next_out(C_ptr, &this_iter,
             (void *) ((char *) out + size * elem_size));
 
-    int64_t count = bshuf_trans_bit_elem(in, out, size, elem_size);
+    if (scratch == NULL) return -1;
+    int64_t count = bshuf_trans_bit_elem_buf(in, out, size, elem_size,
+            scratch);
     return count;
 }
 
 
 /* Bitunshuffle a single block. */
 int64_t bshuf_bitunshuffle_block(ioc_chain* C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, void* scratch,
+        const char* in_end, const bshuf_widen* widen) {
 
+    size_t out_elem_size = widen != NULL ? sizeof(int32_t) : elem_size;
 
     size_t this_iter;
     void *in = ioc_get_in(C_ptr, &this_iter);
@@ -1189,9 +1723,17 @@ int64_t bshuf_bitunshuffle_block(ioc_chain* C_ptr,
             (void*) ((char*) in + size * elem_size));
     void *out = ioc_get_out(C_ptr, &this_iter);
     ioc_set_next_out(C_ptr, &this_iter,
-            (void *) ((char *) out + size * elem_size));
+            (void *) ((char *) out + size * out_elem_size));
 
-    int64_t count = bshuf_untrans_bit_elem(in, out, size, elem_size);
+    if (scratch == NULL) return -1;
+    int64_t count;
+    if (widen != NULL) {
+        count = bshuf_untrans_bit_elem_i32_buf(in, (int32_t*) out, size,
+                elem_size, widen->error_val, scratch);
+    } else {
+        count = bshuf_untrans_bit_elem_buf(in, out, size, elem_size,
+                scratch);
+    }
     return count;
 }
 
@@ -1248,87 +1790,99 @@ uint32_t bshuf_read_uint32_BE(void* buf) {
 
 /* Bitshuffle and compress a single block. */
 int64_t bshuf_compress_lz4_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, void* scratch,
+        const char* in_end, const bshuf_widen* widen) {
 
     int64_t nbytes, count;
-
-    void* tmp_buf_bshuf = malloc(size * elem_size);
-    if (tmp_buf_bshuf == NULL) return -1;
-
-    void* tmp_buf_lz4 = malloc(LZ4_compressBound(size * elem_size));
-    if (tmp_buf_lz4 == NULL){
-        free(tmp_buf_bshuf);
-        return -1;
-    }
+    size_t region = scratch_region_size(size * elem_size);
+    void* tmp_buf_bshuf = scratch;
+    void* tmp_buf_trans = (char*) scratch + region;
+    void* tmp_buf_lz4 = (char*) scratch + 2 * region;
 
     size_t this_iter;
 
     void *in = ioc_get_in(C_ptr, &this_iter);
     ioc_set_next_in(C_ptr, &this_iter, (void*) ((char*) in + size * elem_size));
 
-    count = bshuf_trans_bit_elem(in, tmp_buf_bshuf, size, elem_size);
-    if (count < 0) {
-        free(tmp_buf_lz4);
-        free(tmp_buf_bshuf);
-        return count;
+    if (scratch == NULL) {
+        void *out = ioc_get_out(C_ptr, &this_iter);
+        ioc_set_next_out(C_ptr, &this_iter, out);
+        return -1;
+    }
+
+    count = bshuf_trans_bit_elem_buf(in, tmp_buf_bshuf, size, elem_size,
+            tmp_buf_trans);
+    nbytes = 0;
+    if (count >= 0) {
+        nbytes = LZ4_compress(tmp_buf_bshuf, tmp_buf_lz4, size * elem_size);
     }
-    nbytes = LZ4_compress(tmp_buf_bshuf, tmp_buf_lz4, size * elem_size);
-    free(tmp_buf_bshuf);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf_lz4);
 
     void *out = ioc_get_out(C_ptr, &this_iter);
+    if (count < 0 || nbytes < 0) {
+        // Let the following blocks go on; the whole call fails anyway.
+        ioc_set_next_out(C_ptr, &this_iter, out);
+        CHECK_ERR(count);
+        CHECK_ERR_LZ(nbytes);
+    }
     ioc_set_next_out(C_ptr, &this_iter, (void *) ((char *) out + nbytes + 4));
 
     bshuf_write_uint32_BE(out, nbytes);
     memcpy((char *) out + 4, tmp_buf_lz4, nbytes);
 
-    free(tmp_buf_lz4);
-
     return nbytes + 4;
 }
 
 
 /* Decompress and bitunshuffle a single block. */
 int64_t bshuf_decompress_lz4_block(ioc_chain *C_ptr,
-        const size_t size, const size_t elem_size) {
+        const size_t size, const size_t elem_size, void* scratch,
+        const char* in_end, const bshuf_widen* widen) {
 
     int64_t nbytes, count;
+    size_t out_elem_size = widen != NULL ? sizeof(int32_t) : elem_size;
 
     size_t this_iter;
     void *in = ioc_get_in(C_ptr, &this_iter);
-    int32_t nbytes_from_header = bshuf_read_uint32_BE(in);
-    ioc_set_next_in(C_ptr, &this_iter,
-            (void*) ((char*) in + nbytes_from_header + 4));
+    // The length header and the compressed block must both be within the
+    // input. A block that is not leaves the chain where it is, so that all
+    // the following blocks fail as well instead of reading on.
+    size_t in_left = in_end != NULL ? (size_t) (in_end - (char*) in)
+        : SIZE_MAX;
+    uint32_t nbytes_from_header = 0;
+    int truncated = in_left < 4;
+    if (!truncated) {
+        nbytes_from_header = bshuf_read_uint32_BE(in);
+        truncated = nbytes_from_header > in_left - 4
+            || nbytes_from_header > INT32_MAX;
+    }
+    ioc_set_next_in(C_ptr, &this_iter, truncated ? in
+            : (void*) ((char*) in + nbytes_from_header + 4));
 
     void *out = ioc_get_out(C_ptr, &this_iter);
     ioc_set_next_out(C_ptr, &this_iter,
-            (void *) ((char *) out + size * elem_size));
+            (void *) ((char *) out + size * out_elem_size));
 
-    void* tmp_buf = malloc(size * elem_size);
-    if (tmp_buf == NULL) return -1;
+    if (scratch == NULL) return -1;
+    if (truncated) return -91;
+    void* tmp_buf = scratch;
+    void* tmp_buf_trans = (char*) scratch
+        + scratch_region_size(size * elem_size);
 
-#ifdef BSHUF_LZ4_DECOMPRESS_FAST
-    nbytes = LZ4_decompress_fast((char*) in + 4, tmp_buf, size * elem_size);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf);
-    if (nbytes != nbytes_from_header) {
-        free(tmp_buf);
-        return -91;
-    }
-#else
     nbytes = LZ4_decompress_safe((char*) in + 4, tmp_buf, nbytes_from_header,
                                  size * elem_size);
-    CHECK_ERR_FREE_LZ(nbytes, tmp_buf);
-    if (nbytes != size * elem_size) {
-        free(tmp_buf);
-        return -91;
-    }
+    CHECK_ERR_LZ(nbytes);
+    if (nbytes != size * elem_size) return -91;
     nbytes = nbytes_from_header;
-#endif
-    count = bshuf_untrans_bit_elem(tmp_buf, out, size, elem_size);
-    CHECK_ERR_FREE(count, tmp_buf);
+    if (widen != NULL) {
+        count = bshuf_untrans_bit_elem_i32_buf(tmp_buf, (int32_t*) out, size,
+                elem_size, widen->error_val, tmp_buf_trans);
+    } else {
+        count = bshuf_untrans_bit_elem_buf(tmp_buf, out, size, elem_size,
+                tmp_buf_trans);
+    }
+    CHECK_ERR(count);
     nbytes += 4;
 
-    free(tmp_buf);
     return nbytes;
 }
 
@@ -1372,11 +1926,19 @@ size_t bshuf_compress_lz4_bound(const size_t size,
 }
 
 
+size_t bshuf_scratch_size(const size_t elem_size, size_t block_size) {
+    if (block_size == 0) {
+        block_size = bshuf_default_block_size(elem_size);
+    }
+    return block_scratch_size(block_size, elem_size);
+}
+
+
 int64_t bshuf_bitshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, NULL, 0, NULL, NULL);
 }
 
 
@@ -1384,21 +1946,74 @@ int64_t bshuf_bitunshuffle(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
 
     return bshuf_blocked_wrap_fun(&bshuf_bitunshuffle_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, NULL, 0, NULL, NULL);
 }
 
 
 int64_t bshuf_compress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
     return bshuf_blocked_wrap_fun(&bshuf_compress_lz4_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, NULL, 0, NULL, NULL);
 }
 
 
 int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size) {
     return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
-            elem_size, block_size);
+            elem_size, block_size, NULL, 0, NULL, NULL);
+}
+
+
+int64_t bshuf_compress_lz4_scratch(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, void* scratch,
+        size_t scratch_size) {
+    if (scratch == NULL) return -1;
+    return bshuf_blocked_wrap_fun(&bshuf_compress_lz4_block, in, out, size,
+            elem_size, block_size, scratch, scratch_size, NULL, NULL);
+}
+
+
+int64_t bshuf_decompress_lz4_scratch(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, void* scratch,
+        size_t scratch_size) {
+    if (scratch == NULL) return -1;
+    return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
+            elem_size, block_size, scratch, scratch_size, NULL, NULL);
+}
+
+
+int64_t bshuf_bitunshuffle_i32(void* in, int32_t* out, const size_t size,
+        const size_t elem_size, size_t block_size, int64_t error_val) {
+    bshuf_widen widen = {error_val};
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) return -1;
+    return bshuf_blocked_wrap_fun(&bshuf_bitunshuffle_block, in, out, size,
+            elem_size, block_size, NULL, 0, NULL, &widen);
+}
+
+
+int64_t bshuf_decompress_lz4_i32(void* in, int32_t* out, const size_t size,
+        const size_t elem_size, size_t block_size, int64_t error_val) {
+    bshuf_widen widen = {error_val};
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) return -1;
+    return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
+            elem_size, block_size, NULL, 0, NULL, &widen);
+}
+
+
+int64_t bshuf_decompress_lz4_bounded(void* in, size_t in_size, void* out,
+        const size_t size, const size_t elem_size, size_t block_size) {
+    return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
+            elem_size, block_size, NULL, 0, (char*) in + in_size, NULL);
+}
+
+
+int64_t bshuf_decompress_lz4_i32_bounded(void* in, size_t in_size,
+        int32_t* out, const size_t size, const size_t elem_size,
+        size_t block_size, int64_t error_val) {
+    bshuf_widen widen = {error_val};
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) return -1;
+    return bshuf_blocked_wrap_fun(&bshuf_decompress_lz4_block, in, out, size,
+            elem_size, block_size, NULL, 0, (char*) in + in_size, &widen);
 }
 
 
@@ -1409,7 +2024,9 @@ int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
 #undef CHECK_MULT_EIGHT
 #undef CHECK_ERR
 #undef CHECK_ERR_FREE
-#undef CHECK_ERR_FREE_LZ
+#undef CHECK_ERR_LZ
 
 #undef USESSE2
 #undef USEAVX2
+#undef USEAVX512BW
+#undef BSHUF_RUNTIME_DISPATCH
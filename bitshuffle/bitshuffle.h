@@ -46,7 +46,9 @@ extern "C" {
 
 /* --- bshuf_using_SSE2 ----
  *
- * Whether routines where compiled with the SSE2 instruction set.
+ * Whether routines use the SSE2 instruction set. With GCC on x86, the
+ * kernels of every instruction set are compiled in and the best one the
+ * CPU supports is chosen at runtime (see bshuf_isa).
  *
  * Returns
  * -------
@@ -58,7 +60,7 @@ int bshuf_using_SSE2(void);
 
 /* ---- bshuf_using_AVX2 ----
  *
- * Whether routines where compiled with the AVX2 instruction set.
+ * Whether routines use the AVX2 instruction set.
  *
  * Returns
  * -------
@@ -68,6 +70,34 @@ int bshuf_using_SSE2(void);
 int bshuf_using_AVX2(void);
 
 
+/* ---- bshuf_isa ----
+ *
+ * Instruction set of the bit transpose kernels in use. It is the best one
+ * supported by both the build and the CPU, unless changed with
+ * bshuf_set_isa. AVX-512BW kernels exist for the untranspose only;
+ * bitshuffling then uses AVX2.
+ *
+ * bshuf_set_isa selects another supported instruction set, for benchmarks
+ * and tests. It must not be called while other threads (un)shuffle.
+ *
+ * Returns
+ * -------
+ *  bshuf_isa: one of BSHUF_ISA_*.
+ *  bshuf_isa_supported: 1 if isa can be used, 0 otherwise.
+ *  bshuf_set_isa: 0, or -1 if isa is not supported.
+ *
+ */
+#define BSHUF_ISA_SCALAR   0
+#define BSHUF_ISA_SSE2     1
+#define BSHUF_ISA_AVX2     2
+#define BSHUF_ISA_AVX512BW 3
+
+int bshuf_isa(void);
+int bshuf_isa_supported(int isa);
+int bshuf_set_isa(int isa);
+const char* bshuf_isa_name(int isa);
+
+
 /* ---- bshuf_default_block_size ----
  *
  * The default block size as function of element size.
@@ -199,10 +229,10 @@ int64_t bshuf_compress_lz4(void* in, void* out, const size_t size, const size_t
  * To properly unshuffle bitshuffled data, *size*, *elem_size* and *block_size*
  * must patch the parameters used to compress the data.
  *
- * NOT TO BE USED WITH UNTRUSTED DATA: This routine uses the function
- * LZ4_decompress_fast from LZ4, which does not protect against maliciously
- * formed datasets. By modifying the compressed data, this function could be
- * coerced into leaving the boundaries of the input buffer.
+ * NOT TO BE USED WITH UNTRUSTED DATA: each block is decoded with
+ * LZ4_decompress_safe, but the length of the input is only known from the
+ * headers of the blocks. A truncated buffer is read past its end; use
+ * bshuf_decompress_lz4_bounded when its size is known.
  *
  * Parameters
  * ----------
@@ -221,6 +251,143 @@ int64_t bshuf_compress_lz4(void* in, void* out, const size_t size, const size_t
 int64_t bshuf_decompress_lz4(void* in, void* out, const size_t size,
         const size_t elem_size, size_t block_size);
 
+/* ---- bshuf_bitunshuffle_i32, bshuf_decompress_lz4_i32 ----
+ *
+ * As bshuf_bitunshuffle and bshuf_decompress_lz4 for unsigned 8, 16 or 32
+ * bit elements, but writing them out widened to 32 bit signed integers.
+ * Each block is widened as it is untransposed, while it is still in
+ * cache, so there is no second pass over the data and no buffer of the
+ * elements as stored.
+ *
+ * Parameters
+ * ----------
+ *  out : output buffer, must be of size * 4 bytes
+ *  error_val : elements equal to it are written as -1. Pass a negative
+ *  value to keep every element as it is.
+ *
+ * Returns
+ * -------
+ *  as bshuf_bitunshuffle and bshuf_decompress_lz4, -1 if elem_size is not
+ *  1, 2 or 4.
+ *
+ */
+int64_t bshuf_bitunshuffle_i32(void* in, int32_t* out, const size_t size,
+        const size_t elem_size, size_t block_size, int64_t error_val);
+
+int64_t bshuf_decompress_lz4_i32(void* in, int32_t* out, const size_t size,
+        const size_t elem_size, size_t block_size, int64_t error_val);
+
+
+/* ---- bshuf_decompress_lz4_bounded, bshuf_decompress_lz4_i32_bounded ----
+ *
+ * As bshuf_decompress_lz4 and bshuf_decompress_lz4_i32 for input of
+ * in_size bytes, e.g. a chunk read from a file. Nothing past it is read: a
+ * block header or block that does not fit fails the call.
+ *
+ * Returns
+ * -------
+ *  as bshuf_decompress_lz4, -91 if the input is truncated or corrupt.
+ *
+ */
+int64_t bshuf_decompress_lz4_bounded(void* in, size_t in_size, void* out,
+        const size_t size, const size_t elem_size, size_t block_size);
+
+int64_t bshuf_decompress_lz4_i32_bounded(void* in, size_t in_size,
+        int32_t* out, const size_t size, const size_t elem_size,
+        size_t block_size, int64_t error_val);
+
+
+/* ---- bshuf_set_threads, bshuf_threads ----
+ *
+ * Number of threads that share the blocks of each call made from the
+ * calling thread. 0, the default, leaves it to OpenMP
+ * (omp_get_max_threads). Applications that (de)compress several buffers
+ * at once, one per thread, should set how the cores are split between
+ * buffers and blocks, e.g. 1 for each of as many threads as cores. The
+ * *_scratch functions always use the calling thread only.
+ *
+ * Returns
+ * -------
+ *  bshuf_threads: threads the next call from this thread will use, 1 if
+ *  the library was built without OpenMP.
+ *
+ */
+void bshuf_set_threads(int nthreads);
+int bshuf_threads(void);
+
+
+/* ---- bshuf_scratch_size ----
+ *
+ * Bytes of working memory needed by the *_scratch functions below.
+ *
+ * Without them, every thread keeps a scratch buffer of its own, allocated
+ * the first time it (de)compresses and reused for all later blocks and
+ * frames. Callers that manage their own memory, one buffer per thread,
+ * can pass it in instead. Blocks are then processed one after another in
+ * the calling thread.
+ *
+ * Parameters
+ * ----------
+ *  elem_size : element size of typed data
+ *  block_size : as passed to the *_scratch function, 0 for the default.
+ *
+ * Returns
+ * -------
+ *  Scratch size in bytes.
+ *
+ */
+size_t bshuf_scratch_size(const size_t elem_size, size_t block_size);
+
+
+/* ---- bshuf_compress_lz4_scratch, bshuf_decompress_lz4_scratch ----
+ *
+ * As bshuf_compress_lz4 and bshuf_decompress_lz4, with working memory of
+ * the caller. scratch must hold scratch_size >= bshuf_scratch_size()
+ * bytes; it must not be used by another thread at the same time.
+ *
+ */
+int64_t bshuf_compress_lz4_scratch(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, void* scratch,
+        size_t scratch_size);
+
+int64_t bshuf_decompress_lz4_scratch(void* in, void* out, const size_t size,
+        const size_t elem_size, size_t block_size, void* scratch,
+        size_t scratch_size);
+
+
+/* ---- bshuf_untrans_bit_elem ----
+ *
+ * Undo the bit transpose of a whole buffer, as one block: the last stage
+ * of bshuf_bitunshuffle, for callers that split the work into blocks
+ * themselves.
+ *
+ * Parameters
+ * ----------
+ *  in : input buffer, must be of size * elem_size bytes
+ *  out : output buffer, must be of size * elem_size bytes
+ *  size : number of elements, a multiple of 8
+ *  elem_size : element size of typed data
+ *
+ * Returns
+ * -------
+ *  number of bytes processed, negative error-code if failed.
+ *
+ */
+int64_t bshuf_untrans_bit_elem(void* in, void* out, const size_t size,
+        const size_t elem_size);
+
+
+/* ---- bshuf_write_uint64_BE, bshuf_read_uint64_BE, ... ----
+ *
+ * Big endian integers of the compressed format: the headers of the HDF5
+ * filter and of each LZ4 block.
+ *
+ */
+void bshuf_write_uint64_BE(void* buf, uint64_t num);
+uint64_t bshuf_read_uint64_BE(void* buf);
+void bshuf_write_uint32_BE(void* buf, uint32_t num);
+uint32_t bshuf_read_uint32_BE(void* buf);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
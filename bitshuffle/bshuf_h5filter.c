@@ -18,13 +18,6 @@
     H5Epush1(__FILE__, func, __LINE__, H5E_PLINE, minor, str)
 
 
-// Prototypes from bitshuffle.c
-void bshuf_write_uint64_BE(void* buf, uint64_t num);
-uint64_t bshuf_read_uint64_BE(void* buf);
-void bshuf_write_uint32_BE(void* buf, uint32_t num);
-uint32_t bshuf_read_uint32_BE(void* buf);
-
-
 // Only called on compresion, not on reverse.
 herr_t bshuf_h5_set_local(hid_t dcpl, hid_t type, hid_t space){
 
@@ -91,57 +84,138 @@ herr_t bshuf_h5_set_local(hid_t dcpl, hid_t type, hid_t space){
 }
 
 
+// Element size, block size (0: default) and whether LZ4 compression is
+// applied, from the filter's cd_values. Returns -1 if they are invalid.
+static int bshuf_h5_params(size_t cd_nelmts, const unsigned int cd_values[],
+        size_t* elem_size, size_t* block_size, int* lz4) {
+
+    if (cd_nelmts < 3 || cd_values[2] == 0) return -1;
+    *elem_size = cd_values[2];
+    // User specified block size.
+    *block_size = (cd_nelmts > 3) ? cd_values[3] : 0;
+    // Compression in addition to bitshuffle.
+    *lz4 = cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4;
+    return 0;
+}
+
+
+uint64_t bshuf_h5_decompressed_size(size_t cd_nelmts,
+        const unsigned int cd_values[], const void* in, size_t nbytes) {
+
+    size_t elem_size, block_size;
+    int lz4;
+
+    if (bshuf_h5_params(cd_nelmts, cd_values, &elem_size, &block_size,
+                &lz4) < 0) return 0;
+    if (!lz4) return nbytes;
+    // First eight bytes is the number of bytes in the output buffer,
+    // big endian.
+    if (nbytes < 12) return 0;
+    return bshuf_read_uint64_BE((void*) in);
+}
+
+
+// Decode into out as stored, or widened to int32 if widen is set.
+static int64_t bshuf_h5_decode(size_t cd_nelmts,
+        const unsigned int cd_values[], const void* in, size_t nbytes,
+        void* out, size_t out_size, int widen, int64_t error_val) {
+
+    size_t elem_size, block_size, size;
+    uint64_t nbytes_uncomp;
+    int lz4;
+    int64_t err;
+
+    if (bshuf_h5_params(cd_nelmts, cd_values, &elem_size, &block_size,
+                &lz4) < 0) return -1;
+    nbytes_uncomp = bshuf_h5_decompressed_size(cd_nelmts, cd_values, in,
+            nbytes);
+    // TODO, remove this restriction by memcopying the extra.
+    if (nbytes_uncomp == 0 || nbytes_uncomp % elem_size) return -1;
+    size = nbytes_uncomp / elem_size;
+    if ((widen ? size * sizeof(int32_t) : nbytes_uncomp) > out_size) return -1;
+
+    if (lz4) {
+        // Override the block size with the one read from the header.
+        block_size = bshuf_read_uint32_BE((char*) in + 8) / elem_size;
+        if (block_size == 0) return -1;
+        // Skip over the header.
+        if (widen) {
+            err = bshuf_decompress_lz4_i32_bounded((char*) in + 12,
+                    nbytes - 12, out, size, elem_size, block_size,
+                    error_val);
+        } else {
+            err = bshuf_decompress_lz4_bounded((char*) in + 12, nbytes - 12,
+                    out, size, elem_size, block_size);
+        }
+    } else if (widen) {
+        err = bshuf_bitunshuffle_i32((void*) in, out, size, elem_size,
+                block_size, error_val);
+    } else {
+        err = bshuf_bitunshuffle((void*) in, out, size, elem_size,
+                block_size);
+    }
+    if (err < 0) return err;
+    return nbytes_uncomp;
+}
+
+
+int64_t bshuf_h5_decompress(size_t cd_nelmts, const unsigned int cd_values[],
+        const void* in, size_t nbytes, void* out, size_t out_size) {
+
+    return bshuf_h5_decode(cd_nelmts, cd_values, in, nbytes, out, out_size,
+            0, -1);
+}
+
+
+int64_t bshuf_h5_decompress_i32(size_t cd_nelmts,
+        const unsigned int cd_values[], const void* in, size_t nbytes,
+        int32_t* out, size_t out_size, int64_t error_val) {
+
+    int64_t ret = bshuf_h5_decode(cd_nelmts, cd_values, in, nbytes, out,
+            out_size * sizeof(int32_t), 1, error_val);
+    if (ret < 0) return ret;
+    return ret / cd_values[2];
+}
+
+
 size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
            const unsigned int cd_values[], size_t nbytes,
            size_t *buf_size, void **buf) {
 
     size_t size, elem_size;
-    int err;
+    int64_t err;
+    int lz4;
     char msg[80];
     size_t block_size = 0;
-    size_t buf_size_out, nbytes_uncomp, nbytes_out;
+    size_t buf_size_out, nbytes_out;
     char* in_buf = *buf;
 
-    if (cd_nelmts < 3) {
+    if (bshuf_h5_params(cd_nelmts, cd_values, &elem_size, &block_size,
+                &lz4) < 0) {
         PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, 
                 "Not enough parameters.");
         return 0;
     }
-    elem_size = cd_values[2];
 
-    // User specified block size.
-    if (cd_nelmts > 3) block_size = cd_values[3];
-
-    if (block_size == 0) block_size = bshuf_default_block_size(elem_size);
-
-    // Compression in addition to bitshiffle.
-    if (cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4) {
-        if (flags & H5Z_FLAG_REVERSE) {
-            // First eight bytes is the number of bytes in the output buffer,
-            // little endian.
-            nbytes_uncomp = bshuf_read_uint64_BE(in_buf);
-            // Override the block size with the one read from the header.
-            block_size = bshuf_read_uint32_BE((char*) in_buf + 8) / elem_size;
-            // Skip over the header.
-            in_buf += 12;
-            buf_size_out = nbytes_uncomp;
-        } else {
-            nbytes_uncomp = nbytes;
-            buf_size_out = bshuf_compress_lz4_bound(nbytes_uncomp / elem_size, 
-                    elem_size, block_size) + 12;
-        }
+    if (flags & H5Z_FLAG_REVERSE) {
+        buf_size_out = bshuf_h5_decompressed_size(cd_nelmts, cd_values,
+                in_buf, nbytes);
+    } else if (lz4) {
+        if (block_size == 0) block_size = bshuf_default_block_size(elem_size);
+        buf_size_out = bshuf_compress_lz4_bound(nbytes / elem_size, 
+                elem_size, block_size) + 12;
     } else {
-        nbytes_uncomp = nbytes;
         buf_size_out = nbytes;
     }
 
     // TODO, remove this restriction by memcopying the extra.
-    if (nbytes_uncomp % elem_size) {
+    if ((!(flags & H5Z_FLAG_REVERSE) && nbytes % elem_size)
+            || buf_size_out % elem_size) {
         PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, 
                 "Non integer number of elements.");
         return 0;
     }
-    size = nbytes_uncomp / elem_size;
+    size = nbytes / elem_size;
 
     void* out_buf;
     out_buf = malloc(buf_size_out);
@@ -151,34 +225,34 @@ size_t bshuf_h5_filter(unsigned int flags, size_t cd_nelmts,
         return 0;
     }
 
-    if (cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4) {
-        if (flags & H5Z_FLAG_REVERSE) {
-            // Bit unshuffle/decompress.
-            err = bshuf_decompress_lz4(in_buf, out_buf, size, elem_size, block_size);
-            nbytes_out = nbytes_uncomp;
-        } else {
-            // Bit shuffle/compress.
-            // Write the header, described in
-            // http://www.hdfgroup.org/services/filters/HDF5_LZ4.pdf.
-            // Techincally we should be using signed integers instead of
-            // unsigned ones, however for valid inputs (positive numbers) these
-            // have the same representation.
-            bshuf_write_uint64_BE(out_buf, nbytes_uncomp);
-            bshuf_write_uint32_BE((char*) out_buf + 8, block_size * elem_size);
-            err = bshuf_compress_lz4(in_buf, (char*) out_buf + 12, size,
-                    elem_size, block_size); nbytes_out = err + 12; } } else {
-                if (flags & H5Z_FLAG_REVERSE) {
-            // Bit unshuffle.
-            err = bshuf_bitunshuffle(in_buf, out_buf, size, elem_size,
-                    block_size); } else {
-            // Bit shuffle.
-            err = bshuf_bitshuffle(in_buf, out_buf, size, elem_size,
-                    block_size); } nbytes_out = nbytes; }
-    //printf("nb_in %d, nb_uncomp %d, nb_out %d, buf_out %d, block %d\n",
-    //nbytes, nbytes_uncomp, nbytes_out, buf_size_out, block_size);
+    if (flags & H5Z_FLAG_REVERSE) {
+        // Bit unshuffle/decompress, as any other reader would.
+        err = bshuf_h5_decompress(cd_nelmts, cd_values, in_buf, nbytes,
+                out_buf, buf_size_out);
+        nbytes_out = buf_size_out;
+    } else if (lz4) {
+        // Bit shuffle/compress.
+        // Write the header, described in
+        // http://www.hdfgroup.org/services/filters/HDF5_LZ4.pdf.
+        // Techincally we should be using signed integers instead of
+        // unsigned ones, however for valid inputs (positive numbers) these
+        // have the same representation.
+        bshuf_write_uint64_BE(out_buf, nbytes);
+        bshuf_write_uint32_BE((char*) out_buf + 8, block_size * elem_size);
+        err = bshuf_compress_lz4(in_buf, (char*) out_buf + 12, size,
+                elem_size, block_size);
+        nbytes_out = err + 12;
+    } else {
+        // Bit shuffle.
+        err = bshuf_bitshuffle(in_buf, out_buf, size, elem_size,
+                block_size);
+        nbytes_out = nbytes;
+    }
+    //printf("nb_in %d, nb_out %d, buf_out %d, block %d\n",
+    //nbytes, nbytes_out, buf_size_out, block_size);
 
     if (err < 0) {
-        sprintf(msg, "Error in bitshuffle with error code %d.", err);
+        sprintf(msg, "Error in bitshuffle with error code %d.", (int) err);
         PUSH_ERR("bshuf_h5_filter", H5E_CALLBACK, msg);
         free(out_buf);
         return 0;
@@ -56,4 +56,52 @@ extern H5Z_class_t bshuf_H5Filter[1];
 int bshuf_register_h5filter(void);
 
 
+/* ---- bshuf_h5_decompressed_size, bshuf_h5_decompress ----
+ *
+ * Decode a chunk written by the bitshuffle filter straight into the
+ * caller's buffer, e.g. a chunk fetched with H5Dread_chunk, without
+ * going through the filter pipeline. They do not call HDF5, so any number
+ * of threads can decode at once, and nothing is allocated once each
+ * thread has its bitshuffle scratch (see bshuf_scratch_size).
+ *
+ * Parameters
+ * ----------
+ *  cd_nelmts, cd_values : the filter's client data, as from
+ *      H5Pget_filter_by_id2: version, element size, block size and
+ *      compression.
+ *  in, nbytes : the chunk as stored.
+ *  out, out_size : destination of at least bshuf_h5_decompressed_size()
+ *      bytes.
+ *
+ * Returns
+ * -------
+ *  bshuf_h5_decompressed_size: bytes of decoded data, 0 if cd_values or
+ *      the chunk header are invalid.
+ *  bshuf_h5_decompress: bytes written, -1 if the parameters are invalid
+ *      or out is too small, or a bitshuffle error code (negative).
+ *
+ */
+uint64_t bshuf_h5_decompressed_size(size_t cd_nelmts,
+        const unsigned int cd_values[], const void* in, size_t nbytes);
+
+int64_t bshuf_h5_decompress(size_t cd_nelmts, const unsigned int cd_values[],
+        const void* in, size_t nbytes, void* out, size_t out_size);
+
+
+/* ---- bshuf_h5_decompress_i32 ----
+ *
+ * As bshuf_h5_decompress for 8, 16 or 32 bit unsigned data, written out as
+ * 32 bit signed integers (see bshuf_bitunshuffle_i32): out holds out_size
+ * elements and those equal to error_val, unless it is negative, become -1.
+ *
+ * Returns
+ * -------
+ *  number of elements written, negative as bshuf_h5_decompress.
+ *
+ */
+int64_t bshuf_h5_decompress_i32(size_t cd_nelmts,
+        const unsigned int cd_values[], const void* in, size_t nbytes,
+        int32_t* out, size_t out_size, int64_t error_val);
+
+
 #endif // BSHUF_H5FILTER_H
@@ -0,0 +1,258 @@
+/*
+ Inspect and extract tar archives written by eiger2cbf-omp -T
+
+ To build:
+
+ gcc -std=gnu99 -o cbf-archive -g -O3 cbf-archive.c
+
+ Usage:
+  cbf-archive stat archive.tar              number of members, sizes, index check
+  cbf-archive list archive.tar              name, data offset and size of each member
+  cbf-archive extract archive.tar [name...] write members (all by default) to files
+  cbf-archive cat archive.tar name          write one member to stdout
+
+ The sidecar index (archive.tar.idx) is used when present; otherwise the
+ tar headers are scanned. stat always scans and compares the two.
+ As with tar, members with absolute names or ".." in their path are not
+ extracted.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The longest name a ustar header holds: 155 prefix, '/', 100 name
+#define MAX_NAME 256
+
+struct Member {
+  char name[MAX_NAME + 1];
+  unsigned long long offset, size;
+};
+
+struct Members {
+  struct Member *m;
+  size_t n, capacity;
+};
+
+// Returns 0, or -1 if the name is too long for a tar member.
+int add_member(struct Members *list, const char *name, unsigned long long offset, unsigned long long size) {
+  size_t len = strlen(name);
+  if (len > MAX_NAME) return -1;
+  if (list->n == list->capacity) {
+    list->capacity = list->capacity ? 2 * list->capacity : 1024;
+    list->m = (struct Member *)realloc(list->m, sizeof(struct Member) * list->capacity);
+    if (list->m == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  struct Member *m = &list->m[list->n++];
+  memcpy(m->name, name, len + 1);
+  m->offset = offset;
+  m->size = size;
+  return 0;
+}
+
+// Read the members from the tar headers. Returns 0 or -1 on a malformed archive.
+int scan_archive(int fd, struct Members *list) {
+  unsigned char header[512];
+  unsigned long long offset = 0;
+
+  while (pread(fd, header, 512, offset) == 512) {
+    if (header[0] == '\0') return 0; // end of archive
+
+    unsigned int sum = 0, stored;
+    for (int i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    char field[13] = {};
+    memcpy(field, header + 148, 8);
+    if (sscanf(field, "%o", &stored) != 1 || stored != sum) {
+      fprintf(stderr, "bad header checksum at offset %llu\n", offset);
+      return -1;
+    }
+    memset(field, 0, sizeof(field));
+    memcpy(field, header + 124, 12);
+    unsigned long long size = strtoull(field, NULL, 8);
+
+    char name[MAX_NAME + 1] = {};
+    if (header[345] != '\0') {
+      snprintf(name, sizeof(name), "%.155s/%.100s", (char *)header + 345, (char *)header);
+    } else {
+      snprintf(name, sizeof(name), "%.100s", (char *)header);
+    }
+    if (header[156] == '0' || header[156] == '\0') add_member(list, name, offset + 512, size);
+    offset += 512 + (size + 511) / 512 * 512;
+  }
+  fprintf(stderr, "archive ends without an end marker at offset %llu\n", offset);
+  return -1;
+}
+
+// Read the sidecar index. Returns 0, -1 if there is none or -2 if it is malformed.
+int read_index(const char *archive, struct Members *list) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.idx", archive);
+  FILE *fh = fopen(path, "r");
+  if (fh == NULL) return -1;
+
+  char line[4096], name[4096];
+  unsigned long long offset, size;
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%4095s %llu %llu", name, &offset, &size) == 3 && add_member(list, name, offset, size) < 0) {
+      fprintf(stderr, "%s: member name longer than %d characters: %.64s...\n", path, MAX_NAME, name);
+      fclose(fh);
+      return -2;
+    }
+  }
+  fclose(fh);
+  return 0;
+}
+
+int compare_members(const void *a, const void *b) {
+  return strcmp(((const struct Member *)a)->name, ((const struct Member *)b)->name);
+}
+
+int copy_member(int fd, const struct Member *m, int out) {
+  char buf[1 << 16];
+  unsigned long long done = 0;
+
+  while (done < m->size) {
+    size_t chunk = (m->size - done < sizeof(buf)) ? m->size - done : sizeof(buf);
+    ssize_t n = pread(fd, buf, chunk, m->offset + done);
+    if (n <= 0) return -1;
+    if (write(out, buf, n) != n) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+// Member names must stay below the current directory.
+int safe_name(const char *name) {
+  if (name[0] == '\0' || name[0] == '/') return 0;
+  for (const char *p = name; p != NULL; p = strchr(p, '/')) {
+    if (*p == '/') p++;
+    if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+  }
+  return 1;
+}
+
+int extract_member(int fd, const struct Member *m) {
+  if (!safe_name(m->name)) {
+    fprintf(stderr, "not extracting %s: absolute name or \"..\" in the path\n", m->name);
+    return -1;
+  }
+
+  // Create the directories in the member name
+  char dir[MAX_NAME + 1];
+  snprintf(dir, sizeof(dir), "%s", m->name);
+  for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(dir, 0755);
+    *p = '/';
+  }
+
+  int out = open(m->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0 || copy_member(fd, m, out) < 0) {
+    fprintf(stderr, "failed to extract %s: %s\n", m->name, strerror(errno));
+    if (out >= 0) close(out);
+    return -1;
+  }
+  return close(out);
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s stat|list|extract|cat archive.tar [name...]\n", argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) usage(argv[0]);
+  const char *command = argv[1], *archive = argv[2];
+
+  int fd = open(archive, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open %s: %s\n", archive, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct Members list = {}, scanned = {};
+  int index = (strcmp(command, "stat") == 0) ? -1 : read_index(archive, &list);
+  if (index == -2) return EXIT_FAILURE;
+  if (index < 0) {
+    list.n = 0;
+    if (scan_archive(fd, &list) < 0) return EXIT_FAILURE;
+  }
+  qsort(list.m, list.n, sizeof(struct Member), compare_members);
+
+  if (strcmp(command, "stat") == 0) {
+    unsigned long long total = 0, smallest = ~0ULL, largest = 0;
+    for (size_t i = 0; i < list.n; i++) {
+      total += list.m[i].size;
+      if (list.m[i].size < smallest) smallest = list.m[i].size;
+      if (list.m[i].size > largest) largest = list.m[i].size;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    printf("%s: %zu members, %llu bytes of data in %lld bytes\n", archive, list.n, total, (long long)st.st_size);
+    if (list.n > 0) {
+      printf(" member size: min %llu, mean %llu, max %llu\n", smallest, total / list.n, largest);
+      printf(" first %s, last %s\n", list.m[0].name, list.m[list.n - 1].name);
+    }
+
+    index = read_index(archive, &scanned);
+    if (index == -2) return EXIT_FAILURE;
+    if (index < 0) {
+      printf(" no index\n");
+    } else {
+      qsort(scanned.m, scanned.n, sizeof(struct Member), compare_members);
+      int ok = scanned.n == list.n;
+      for (size_t i = 0; ok && i < list.n; i++) {
+        ok = strcmp(scanned.m[i].name, list.m[i].name) == 0 &&
+             scanned.m[i].offset == list.m[i].offset && scanned.m[i].size == list.m[i].size;
+      }
+      printf(" index: %zu entries, %s\n", scanned.n, ok ? "consistent with the archive" : "DOES NOT MATCH the archive");
+      if (!ok) return EXIT_FAILURE;
+    }
+  } else if (strcmp(command, "list") == 0) {
+    for (size_t i = 0; i < list.n; i++) {
+      printf("%s %llu %llu\n", list.m[i].name, list.m[i].offset, list.m[i].size);
+    }
+  } else if (strcmp(command, "extract") == 0 || strcmp(command, "cat") == 0) {
+    int cat = strcmp(command, "cat") == 0;
+    if (cat && argc != 4) usage(argv[0]);
+    int failed = 0;
+    for (size_t i = 0; i < list.n; i++) {
+      int wanted = (argc == 3);
+      for (int j = 3; j < argc && !wanted; j++) wanted = strcmp(argv[j], list.m[i].name) == 0;
+      if (!wanted) continue;
+      if (cat) {
+        failed |= copy_member(fd, &list.m[i], STDOUT_FILENO) < 0;
+        break;
+      }
+      failed |= extract_member(fd, &list.m[i]) < 0;
+    }
+    // Names asked for but not found
+    for (int j = 3; j < argc; j++) {
+      struct Member key;
+      if (strlen(argv[j]) > MAX_NAME) {
+        fprintf(stderr, "%.64s...: no such member\n", argv[j]);
+        failed = 1;
+        continue;
+      }
+      strcpy(key.name, argv[j]);
+      if (bsearch(&key, list.m, list.n, sizeof(struct Member), compare_members) == NULL) {
+        fprintf(stderr, "%s: no such member\n", argv[j]);
+        failed = 1;
+      }
+    }
+    if (failed) return EXIT_FAILURE;
+  } else {
+    usage(argv[0]);
+  }
+
+  close(fd);
+  return EXIT_SUCCESS;
+}
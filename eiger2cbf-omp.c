@@ -2,6 +2,17 @@
 EIGER HDF5 to CBF converter
  Written by Takanori Nakane
 
+ OpenMP/pipelined version: one thread owns all HDF5 access, workers decode,
+ mask and encode, and one thread writes the files. OMP_NUM_THREADS cores
+ are split between frames converted at once and bitshuffle blocks within
+ a frame (plan_threads, -j).
+ Bounded queues connect the stages; their occupancy is reported at the end.
+
+ CBF files are written by the built-in miniCBF writer (minicbf.c), which
+ writes the same bytes as CBFlib. -C writes them with CBFlib instead, and
+ -V compares every frame with CBFlib's; `make test-writer` runs -V on
+ synthetic datasets.
+
 To build:
 
 Linux
@@ -34,10 +45,13 @@ gcc -std=c99 -o eiger2cbf -g \
 
 */
 
+#define _GNU_SOURCE // open_memstream
+
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
 #include "getopt.h"
+#include "errno.h"
 #include "unistd.h"
 #include "omp.h"
 
@@ -46,6 +60,22 @@ gcc -std=c99 -o eiger2cbf -g \
 #include "hdf5.h"
 #include "hdf5_hl.h"
 #include "omp.h"
+#include "pthread.h"
+#include "bitshuffle.h"
+#include "file_writer.h"
+#include "frame_reader.h"
+#include "huge_pages.h"
+#include "minicbf.h"
+#include "pixel_convert.h"
+#include "ring.h"
+
+// Same "written by" line as CBFlib's, so that the native writer's files are
+// identical to the ones CBFlib writes.
+#ifdef CBF_API_VERSION
+#define MINICBF_WRITTEN_BY CBF_API_VERSION
+#else
+#define MINICBF_WRITTEN_BY "eiger2cbf native miniCBF writer"
+#endif
 
 extern const H5Z_class2_t H5Z_LZ4;
 extern const H5Z_class2_t bshuf_H5Filter;
@@ -72,13 +102,949 @@ const char *extractFilename(const char *path)
   }
 }
 
+/* One frame travelling through the pipeline */
+struct FrameJob
+{
+  int frame;
+  double osc_start;
+  char filename[4096];
+  char err_msg[4096];
+
+  // Filled by the read stage: either a compressed chunk or pixels as stored
+  chunk_format fmt;
+  void *chunk;
+  size_t chunk_size;
+  int64_t chunk_bytes;
+  void *raw;
+  size_t elem_size;
+
+  // Filled by the decode stage
+  char *cbf;
+  size_t cbf_size;
+  double mask_time; // seconds spent converting and masking pixels
+  bool mask_fills;  // widened while decoding: mask_time only filled the masked runs
+};
+
+/* Frame buffers of a decode worker, reused for every frame */
+struct Scratch
+{
+  huge_buffer raw;    // decoded pixels as stored
+  huge_buffer pixels; // converted and masked
+  void *tile_raw;     // fused path: one tile as stored (up to 32 bits)
+  int32_t *tile;      // fused path: one tile converted and masked
+  size_t tile_size;   // pixels tile_raw and tile hold
+  minicbf cbf;        // native writer, its buffer grows to the largest frame
+};
+
+// Grow the tile buffers of the fused path to n pixels. Returns 0 or -1.
+int scratch_tiles(struct Scratch *sc, size_t n)
+{
+  if (n <= sc->tile_size)
+    return 0;
+  free(sc->tile_raw);
+  free(sc->tile);
+  sc->tile_raw = malloc(sizeof(int32_t) * n);
+  sc->tile = (int32_t *)malloc(sizeof(int32_t) * n);
+  sc->tile_size = (sc->tile_raw != NULL && sc->tile != NULL) ? n : 0;
+  return (sc->tile_size == n) ? 0 : -1;
+}
+
+/* Shared by all stages of the pipeline */
+struct Pipeline
+{
+  int xpixels, ypixels;
+  const mask_runs *mask; // NULL if the master file has no pixel mask
+  unsigned int error_val;
+  const char *description, *detector_sn;
+  double thickness, pixelsize, count_time, frame_time, wavelength, distance, osc_width;
+  int countrate_cutoff, beamx, beamy;
+  bool debug;
+  bool fused;  // decode, mask and encode tile by tile with the native writer
+  bool cbflib; // write with CBFlib (-C) instead of the native writer
+  bool verify; // compare the native writer with CBFlib for every frame
+
+  // Rendered once per dataset
+  char header_head[4096], header_tail[256]; // SLS_1.0 header around the Start_angle value
+  minicbf_header cbf_header;
+
+  int nworkers, nwriters;
+  int block_threads; // bitshuffle threads inside each frame (see plan_threads)
+  ring decode_queue; // read -> decode
+  ring write_queue;  // decode -> write
+  file_writer *writers; // per writer thread, with the output statistics
+  struct Scratch *scratch; // per worker
+
+  // Seconds spent working (not waiting) in each stage
+  double busy_read;
+  double *busy_decode; // per worker
+  double *busy_mask;   // per worker, part of busy_decode spent converting and masking pixels
+  int *nmask_fills;    // per worker, frames for which that was only filling the masked runs
+  int nmismatch; // frames for which -V found a difference
+};
+
+struct WorkerArg
+{
+  struct Pipeline *pl;
+  int id;
+};
+
+void free_job(struct FrameJob *job)
+{
+  free(job->chunk);
+  free(job->raw);
+  free(job->cbf);
+  free(job);
+}
+
+// The SLS_1.0 header is the same for all frames but for Start_angle.
+// Render it once, in two parts around the angle.
+void render_header_template(struct Pipeline *pl)
+{
+  char header_format[] =
+      "\n"
+      "# Detector: %s, S/N %s\n"
+      "# Pixel_size %de-6 m x %de-6 m\n"
+      "# Silicon sensor, thickness %.6f m\n"
+      "# Exposure_time %f s\n"
+      "# Exposure_period %f s\n"
+      "# Count_cutoff %d counts\n"
+      "# Wavelength %f A\n"
+      "# Detector_distance %f m\n"
+      "# Beam_xy (%d, %d) pixels\n"
+      "# Start_angle ";
+
+  snprintf(pl->header_head, sizeof(pl->header_head), header_format,
+           pl->description, pl->detector_sn,
+           (int)(pl->pixelsize * 1E6), (int)(pl->pixelsize * 1E6),
+           pl->thickness,
+           pl->count_time, pl->frame_time, pl->countrate_cutoff, pl->wavelength, pl->distance,
+           pl->beamx, pl->beamy);
+  snprintf(pl->header_tail, sizeof(pl->header_tail),
+           " deg.\n"
+           "# Angle_increment %f deg.\n",
+           pl->osc_width);
+}
+
+// The SLS_1.0 header of a frame, for CBFlib. header_content must hold 4096 bytes.
+void render_header(struct Pipeline *pl, struct FrameJob *job, char *header_content)
+{
+  snprintf(header_content, 4096, "%s%f%s", pl->header_head, job->osc_start, pl->header_tail);
+}
+
+// Encode a frame with CBFlib into a malloc()ed buffer.
+int encode_cbflib(struct Pipeline *pl, char *header_content, signed int *buf_signed, char **buf, size_t *size)
+{
+  FILE *fh = open_memstream(buf, size);
+  if (fh == NULL)
+    return -1;
+
+  // create a CBF
+  cbf_handle cbf;
+  cbf_make_handle(&cbf);
+  cbf_new_datablock(cbf, "image_1");
+
+  // put a miniCBF header
+  cbf_new_category(cbf, "array_data");
+  cbf_new_column(cbf, "header_convention");
+  cbf_set_value(cbf, "SLS_1.0");
+  cbf_new_column(cbf, "header_contents");
+  cbf_set_value(cbf, header_content);
+
+  // put the image
+  cbf_new_category(cbf, "array_data");
+  cbf_new_column(cbf, "data");
+  cbf_set_integerarray_wdims_fs(cbf,
+                                CBF_BYTE_OFFSET,
+                                1, // binary id
+                                buf_signed,
+                                sizeof(int),
+                                1, // signed?
+                                (size_t)pl->xpixels * pl->ypixels,
+                                "little_endian",
+                                pl->xpixels,
+                                pl->ypixels,
+                                0,
+                                0); // padding
+  // readable = 0: CBFlib closes the stream, which finalizes *buf
+  cbf_write_file(cbf, fh, 0, CBF, MSG_DIGEST | MIME_HEADERS | PAD_4K, 0);
+  cbf_free_handle(cbf);
+  return 0;
+}
+
+// -V: encode the frame again with CBFlib and compare. The first lines
+// carry the CBFlib version, which is taken from cbf.h at build time and
+// may differ from the library's, so the comparison starts at the data block.
+void verify_frame(struct Pipeline *pl, struct FrameJob *job, char *header_content, signed int *buf_signed)
+{
+  char *ref = NULL;
+  size_t ref_size = 0;
+  if (encode_cbflib(pl, header_content, buf_signed, &ref, &ref_size) < 0)
+  {
+    fprintf(stderr, "WARNING: frame %d could not be encoded with CBFlib for verification.\n", job->frame);
+    __sync_fetch_and_add(&pl->nmismatch, 1);
+    return;
+  }
+
+  const char *native = job->cbf;
+  const char *a = memmem(native, job->cbf_size, "data_image_1", 12);
+  const char *b = memmem(ref, ref_size, "data_image_1", 12);
+  size_t na = (a != NULL) ? job->cbf_size - (a - native) : 0;
+  size_t nb = (b != NULL) ? ref_size - (b - ref) : 0;
+  if (a == NULL || b == NULL || na != nb || memcmp(a, b, na) != 0)
+  {
+    size_t at = 0;
+    while (a != NULL && b != NULL && at < na && at < nb && a[at] == b[at])
+      at++;
+    fprintf(stderr, "WARNING: frame %d differs from CBFlib output (%zu vs %zu bytes, first difference at byte %zu of the data block).\n",
+            job->frame, na, nb, at);
+    __sync_fetch_and_add(&pl->nmismatch, 1);
+  }
+  free(ref);
+}
+
+// Decode (if needed), apply the pixel mask and encode a frame into job->cbf.
+void convert_frame(struct Pipeline *pl, struct FrameJob *job, struct Scratch *sc)
+{
+  int xpixels = pl->xpixels, ypixels = pl->ypixels;
+  size_t npixels = (size_t)xpixels * ypixels;
+  const mask_runs *mask = pl->mask;
+  unsigned int error_val = pl->error_val;
+  char *err_msg = job->err_msg;
+
+  signed int *buf_signed = (signed int *)sc->pixels.ptr;
+  const void *raw = job->raw; // read by H5Dread
+  bool widened = false;
+  if (job->chunk_bytes >= 0)
+  {
+    // Decode in this thread. 8 and 16 bit bitshuffled pixels are widened
+    // as they are decoded, error_val becoming -1 if there is no mask; the
+    // others keep the stored pixel width.
+    job->elem_size = job->fmt.elem_size;
+    widened = chunk_decodes_i32(&job->fmt);
+    int64_t ret = widened
+      ? chunk_decode_i32(&job->fmt, job->chunk, job->chunk_bytes, buf_signed, npixels,
+                         mask ? -1 : (int64_t)error_val)
+      : chunk_decode(&job->fmt, job->chunk, job->chunk_bytes, sc->raw.ptr, sc->raw.size);
+    if (ret < 0)
+    {
+      sprintf(err_msg, "failed to decode chunk for frame=%d\n", job->frame);
+    }
+    raw = sc->raw.ptr;
+    free(job->chunk);
+    job->chunk = NULL;
+    if (strlen(err_msg) > 0)
+      return;
+  }
+
+  double t0 = ring_now();
+  job->mask_fills = widened;
+  if (widened)
+  {
+    if (mask)
+      mask_runs_apply(mask, buf_signed);
+  }
+  else
+  {
+    pixel_convert_fn convert = pixel_convert_select(job->elem_size, mask);
+    if (convert == NULL)
+    {
+      sprintf(err_msg, "unsupported pixel size %d for frame=%d\n", (int)job->elem_size, job->frame);
+      return;
+    }
+    convert(raw, buf_signed, npixels, 0, mask, error_val);
+  }
+  job->mask_time = ring_now() - t0;
+  free(job->raw);
+  job->raw = NULL;
+
+  char header_content[4096] = {};
+  if (pl->cbflib || pl->verify)
+    render_header(pl, job, header_content);
+
+  if (pl->cbflib)
+  {
+    if (encode_cbflib(pl, header_content, buf_signed, &job->cbf, &job->cbf_size) < 0)
+      sprintf(err_msg, "Failed to open a memory stream for frame=%d\n", job->frame);
+    return;
+  }
+
+  if (minicbf_begin(&sc->cbf, npixels) < 0 ||
+      minicbf_append(&sc->cbf, buf_signed, npixels) < 0 ||
+      minicbf_finish(&sc->cbf, &pl->cbf_header, job->osc_start, &job->cbf, &job->cbf_size) < 0)
+  {
+    sprintf(err_msg, "failed to encode frame=%d\n", job->frame);
+  }
+
+  if (pl->verify && strlen(err_msg) == 0)
+    verify_frame(pl, job, header_content, buf_signed);
+}
+
+// Same as convert_frame, but one tile at a time: a bitshuffle block is
+// decoded, masked and byte-offset encoded into the output while it is
+// still in cache. The CBF is assembled by the native writer.
+void convert_frame_fused(struct Pipeline *pl, struct FrameJob *job, struct Scratch *sc)
+{
+  int xpixels = pl->xpixels, ypixels = pl->ypixels;
+  size_t npixels = (size_t)xpixels * ypixels;
+  char *err_msg = job->err_msg;
+
+  // Chunks that are not bitshuffled and frames read through H5Dread are
+  // decoded in full first and then tiled.
+  const char *raw = (const char *)job->raw;
+  chunk_tiles tiles;
+  bool tiled = false;
+  size_t tile_size = 4096;
+  if (job->chunk_bytes >= 0)
+  {
+    job->elem_size = job->fmt.elem_size;
+    if (chunk_tiles_begin(&tiles, &job->fmt, job->chunk, job->chunk_bytes) == 0)
+    {
+      tiled = true;
+      tile_size = tiles.block_size;
+    }
+    else
+    {
+      chunk_tiles_end(&tiles);
+      raw = (const char *)sc->raw.ptr;
+      if (chunk_decode(&job->fmt, job->chunk, job->chunk_bytes, sc->raw.ptr, sc->raw.size) < 0)
+      {
+        sprintf(err_msg, "failed to decode chunk for frame=%d\n", job->frame);
+        return;
+      }
+    }
+  }
+  pixel_convert_fn convert = pixel_convert_select(job->elem_size, pl->mask);
+  if (convert == NULL)
+  {
+    sprintf(err_msg, "unsupported pixel size %d for frame=%d\n", (int)job->elem_size, job->frame);
+    if (tiled)
+      chunk_tiles_end(&tiles);
+    return;
+  }
+
+  minicbf *out = &sc->cbf;
+  void *tile_raw = NULL;
+  int32_t *tile = NULL;
+  if (scratch_tiles(sc, tile_size) == 0)
+  {
+    tile_raw = sc->tile_raw;
+    tile = sc->tile;
+  }
+  if (tile_raw == NULL || minicbf_begin(out, npixels) < 0)
+  {
+    sprintf(err_msg, "Failed to allocate image buffer.\n");
+  }
+
+  for (size_t first = 0; first < npixels && strlen(err_msg) == 0;)
+  {
+    const void *in;
+    size_t n;
+    if (tiled)
+    {
+      int64_t ret = chunk_tiles_next(&tiles, tile_raw);
+      if (ret <= 0)
+      {
+        sprintf(err_msg, "failed to decode chunk for frame=%d\n", job->frame);
+        break;
+      }
+      n = ret;
+      in = tile_raw;
+    }
+    else
+    {
+      n = (npixels - first < tile_size) ? npixels - first : tile_size;
+      in = raw + first * job->elem_size;
+    }
+    convert(in, tile, n, first, pl->mask, pl->error_val);
+    if (minicbf_append(out, tile, n) < 0)
+      sprintf(err_msg, "Failed to allocate image buffer.\n");
+    first += n;
+  }
+
+  if (strlen(err_msg) == 0)
+  {
+    if (minicbf_finish(out, &pl->cbf_header, job->osc_start, &job->cbf, &job->cbf_size) < 0)
+      sprintf(err_msg, "failed to encode frame=%d\n", job->frame);
+  }
+  if (tiled)
+    chunk_tiles_end(&tiles);
+  free(job->chunk);
+  job->chunk = NULL;
+  free(job->raw);
+  job->raw = NULL;
+}
+
+void *decode_stage(void *arg)
+{
+  struct WorkerArg *wa = (struct WorkerArg *)arg;
+  struct Pipeline *pl = wa->pl;
+  struct FrameJob *job;
+
+  // The split between frames and blocks was planned for all workers.
+  bshuf_set_threads(pl->block_threads);
+
+  while ((job = (struct FrameJob *)ring_pop(&pl->decode_queue)) != NULL)
+  {
+    double t0 = ring_now();
+    if (pl->fused)
+      convert_frame_fused(pl, job, &pl->scratch[wa->id]);
+    else
+      convert_frame(pl, job, &pl->scratch[wa->id]);
+    double t1 = ring_now();
+    pl->busy_decode[wa->id] += t1 - t0;
+    pl->busy_mask[wa->id] += job->mask_time;
+    if (job->mask_fills)
+      pl->nmask_fills[wa->id]++;
+    if (pl->debug)
+      fprintf(stderr, "frame %d converted in %.1f ms (pixel mask %.2f ms) by worker %d\n",
+              job->frame, (t1 - t0) * 1E3, job->mask_time * 1E3, wa->id);
+
+    if (strlen(job->err_msg) > 0)
+    {
+      fprintf(stderr, "--Error--: %s", job->err_msg);
+      free_job(job);
+      continue;
+    }
+    ring_push(&pl->write_queue, job);
+  }
+  return NULL;
+}
+
+// Writers take finished files from the queue, so that workers only wait
+// for the file system when the queue is full.
+void *write_stage(void *arg)
+{
+  struct WorkerArg *wa = (struct WorkerArg *)arg;
+  struct Pipeline *pl = wa->pl;
+  file_writer *w = &pl->writers[wa->id];
+  struct FrameJob *job;
+
+  while ((job = (struct FrameJob *)ring_pop(&pl->write_queue)) != NULL)
+  {
+    if (file_writer_write(w, job->filename, job->cbf, job->cbf_size) < 0)
+    {
+      fprintf(stderr, "--Error--: failed to write %s: %s\n", job->filename, strerror(errno));
+    }
+    free_job(job);
+  }
+  return NULL;
+}
+
+// Split ncores between frames decoded at once (decode workers) and
+// bitshuffle blocks inside a frame. Frames need no synchronisation, so
+// they come first: bulk conversion runs one frame per core. Cores left
+// over when there are fewer frames than cores, down to a single frame,
+// go inside the frames, as long as every thread gets MIN_BLOCKS_PER_THREAD
+// blocks to amortize starting the team. The fused path decodes block by
+// block in one thread, so it never splits a frame. block_threads > 0
+// (-j) forces the threads per frame.
+#define MIN_BLOCKS_PER_THREAD 32
+void plan_threads(int ncores, int nframes, size_t frame_bytes, bool split_frames, int block_threads,
+                  int *nworkers, int *nthreads)
+{
+  if (block_threads > 0)
+  {
+    *nthreads = split_frames ? block_threads : 1;
+    *nworkers = (ncores / *nthreads > 0) ? ncores / *nthreads : 1;
+    return;
+  }
+  *nworkers = (nframes < ncores) ? nframes : ncores;
+  if (*nworkers < 1)
+    *nworkers = 1;
+  int max_threads = frame_bytes / 8192 / MIN_BLOCKS_PER_THREAD; // 8 KB bitshuffle blocks
+  *nthreads = split_frames ? ncores / *nworkers : 1;
+  if (*nthreads > max_threads)
+    *nthreads = max_threads;
+  if (*nthreads < 1)
+    *nthreads = 1;
+}
+
+int frames_written(struct Pipeline *pl)
+{
+  int n = 0;
+  for (int i = 0; i < pl->nwriters; i++)
+    n += pl->writers[i].nfiles;
+  return n;
+}
+
+// Which stage is the bottleneck? The busiest one, with the queue in front
+// of it full and the queue behind it empty.
+void report_pipeline(struct Pipeline *pl, double wall)
+{
+  double busy_decode = 0, busy_mask = 0, busy_write = 0;
+  int nmask_fills = 0;
+  for (int i = 0; i < pl->nworkers; i++)
+  {
+    busy_decode += pl->busy_decode[i];
+    busy_mask += pl->busy_mask[i];
+    nmask_fills += pl->nmask_fills[i];
+  }
+  for (int i = 0; i < pl->nwriters; i++)
+    busy_write += pl->writers[i].busy;
+  int nwritten = frames_written(pl);
+
+  fprintf(stderr, "\nPipeline: %d frames written in %.2f s (%.1f frames/s)\n",
+          nwritten, wall, (wall > 0) ? nwritten / wall : 0);
+  if (wall <= 0)
+    return;
+  fprintf(stderr, " read   stage: busy %6.2f s (%3.0f%% of 1 thread)\n",
+          pl->busy_read, 100 * pl->busy_read / wall);
+  fprintf(stderr, " decode stage: busy %6.2f s (%3.0f%% of %d threads)\n",
+          busy_decode, 100 * busy_decode / wall / pl->nworkers, pl->nworkers);
+  fprintf(stderr, "  frames at once: %d, bitshuffle threads per frame: %d\n", pl->nworkers, pl->block_threads);
+  // With -c, 8 and 16 bit pixels are widened while they are decoded and
+  // only the masked runs are filled afterwards: no pixel_convert kernel runs.
+  if (nwritten > 0 && busy_mask > 0 && nmask_fills == 0)
+    fprintf(stderr, "  pixel mask: %.2f ms per frame (%s)\n", 1E3 * busy_mask / nwritten, pixel_convert_isa());
+  else if (nwritten > 0 && busy_mask > 0)
+    fprintf(stderr, "  pixel mask: %.2f ms per frame (%d frames widened while decoding, masked runs filled only)\n",
+            1E3 * busy_mask / nwritten, nmask_fills);
+  fprintf(stderr, "  frame buffers: %s\n", huge_pages_name(pl->scratch[0].pixels.kind));
+  fprintf(stderr, "  bitshuffle kernels: %s\n", bshuf_isa_name(bshuf_isa()));
+  fprintf(stderr, " write  stage: busy %6.2f s (%3.0f%% of %d threads)\n",
+          busy_write, 100 * busy_write / wall / pl->nwriters, pl->nwriters);
+  ring_report(&pl->decode_queue, "read->decode", stderr);
+  ring_report(&pl->write_queue, "decode->write", stderr);
+  if (pl->cbflib)
+    fprintf(stderr, " CBF writer: CBFlib\n");
+  else
+    fprintf(stderr, " CBF writer: native, byte offset encoder %s\n", cbf_byte_offset_isa());
+  if (pl->verify)
+    fprintf(stderr, " verification: %d of %d frames differ from CBFlib\n", pl->nmismatch, nwritten);
+  file_writer_report(pl->writers, pl->nwriters, wall, stderr);
+}
+
+// -B: throughput of the bitshuffle kernels of every instruction set this
+// CPU supports, on a synthetic frame of mostly small counts. Each result
+// is checked against the scalar kernels. The last two columns compare
+// decoding and then converting to int32 with widening during the decode.
+void bench_bitshuffle(void)
+{
+  const size_t npixels = 4 * 1024 * 1024;
+  const size_t elem_sizes[] = {2, 4};
+  const char *modes[] = {"unshuffle", "LZ4+unshuffle", "+convert", "LZ4 to int32"};
+
+  fprintf(stderr, "bitshuffle kernels, %zu pixels, default %s\n", npixels, bshuf_isa_name(bshuf_isa()));
+  fprintf(stderr, " %-10s %5s %14s %14s %14s %14s\n", "kernels", "bytes", modes[0], modes[1], modes[2], modes[3]);
+  int default_isa = bshuf_isa();
+  for (int e = 0; e < 2; e++)
+  {
+    size_t elem_size = elem_sizes[e], nbytes = npixels * elem_size;
+    uint32_t error_val = (elem_size == 4) ? UINT32_MAX : (1U << (8 * elem_size)) - 1;
+    char *frame = malloc(nbytes), *shuffled = malloc(nbytes), *out = malloc(nbytes);
+    char *compressed = malloc(bshuf_compress_lz4_bound(npixels, elem_size, 0));
+    int32_t *expected = malloc(npixels * sizeof(int32_t)), *out32 = malloc(npixels * sizeof(int32_t));
+    if (frame == NULL || shuffled == NULL || out == NULL || compressed == NULL || expected == NULL || out32 == NULL)
+    {
+      fprintf(stderr, "--Error--: failed to allocate benchmark buffers\n");
+      exit(EXIT_FAILURE);
+    }
+    unsigned int seed = 1;
+    for (size_t i = 0; i < npixels; i++)
+    {
+      unsigned int v = (rand_r(&seed) % 64 == 0) ? rand_r(&seed) % 1000 : rand_r(&seed) % 4;
+      if (rand_r(&seed) % 4096 == 0)
+        v = error_val; // saturated
+      memcpy(frame + i * elem_size, &v, elem_size); // little endian
+      expected[i] = (v == error_val) ? -1 : (int32_t)v;
+    }
+    bshuf_set_isa(BSHUF_ISA_SCALAR);
+    bshuf_bitshuffle(frame, shuffled, npixels, elem_size, 0);
+    int64_t ncompressed = bshuf_compress_lz4(frame, compressed, npixels, elem_size, 0);
+    pixel_convert_fn convert = pixel_convert_select(elem_size, NULL);
+
+    for (int isa = BSHUF_ISA_SCALAR; isa <= BSHUF_ISA_AVX512BW; isa++)
+    {
+      if (bshuf_set_isa(isa) < 0)
+        continue;
+      double rate[4];
+      for (int mode = 0; mode < 4; mode++)
+      {
+        int n = 0;
+        double t0 = ring_now(), t;
+        do
+        {
+          int64_t ret;
+          int ok;
+          if (mode < 2)
+          {
+            memset(out, 0xff, nbytes);
+            ret = mode ? bshuf_decompress_lz4(compressed, out, npixels, elem_size, 0)
+                       : bshuf_bitunshuffle(shuffled, out, npixels, elem_size, 0);
+            ok = ret >= 0 && memcmp(out, frame, nbytes) == 0;
+          }
+          else
+          {
+            memset(out32, 0x55, npixels * sizeof(int32_t));
+            if (mode == 2)
+            {
+              ret = bshuf_decompress_lz4(compressed, out, npixels, elem_size, 0);
+              convert(out, out32, npixels, 0, NULL, error_val);
+            }
+            else
+            {
+              ret = bshuf_decompress_lz4_i32(compressed, out32, npixels, elem_size, 0, error_val);
+            }
+            ok = ret >= 0 && memcmp(out32, expected, npixels * sizeof(int32_t)) == 0;
+          }
+          if (!ok)
+          {
+            fprintf(stderr, "--Error--: %s kernels decoded %zu-byte pixels wrongly (%s)\n",
+                    bshuf_isa_name(isa), elem_size, modes[mode]);
+            exit(EXIT_FAILURE);
+          }
+          n++;
+        } while ((t = ring_now() - t0) < 0.5);
+        rate[mode] = n * nbytes / t / 1E6;
+      }
+      fprintf(stderr, " %-10s %5zu %9.0f MB/s %9.0f MB/s %9.0f MB/s %9.0f MB/s\n",
+              bshuf_isa_name(isa), elem_size, rate[0], rate[1], rate[2], rate[3]);
+    }
+    if (ncompressed > 0)
+      fprintf(stderr, " (%zu-byte pixels compress to %.1f%%; rates are of decoded bytes as stored, including a memcmp)\n",
+              elem_size, 100.0 * ncompressed / nbytes);
+    free(frame);
+    free(shuffled);
+    free(out);
+    free(compressed);
+    free(expected);
+    free(out32);
+  }
+  bshuf_set_isa(default_isa);
+}
+
+struct ScratchArg
+{
+  const char *compressed;
+  size_t npixels, block_size;
+  bool per_block; // malloc and free the scratch for every block
+  int nframes;
+  int failed;
+};
+
+void *scratch_worker(void *arg)
+{
+  struct ScratchArg *sa = (struct ScratchArg *)arg;
+  size_t scratch_size = bshuf_scratch_size(2, sa->block_size);
+  char *out = malloc(sa->npixels * 2);
+  void *scratch = sa->per_block ? NULL : malloc(scratch_size);
+  sa->failed = (out == NULL || (!sa->per_block && scratch == NULL));
+  for (int f = 0; f < sa->nframes && !sa->failed; f++)
+  {
+    const char *in = sa->compressed;
+    for (size_t b = 0; b < sa->npixels / sa->block_size && !sa->failed; b++)
+    {
+      void *s = sa->per_block ? malloc(scratch_size) : scratch;
+      int64_t used = bshuf_decompress_lz4_scratch((void *)in, out + 2 * b * sa->block_size, sa->block_size, 2,
+                                                  sa->block_size, s, scratch_size);
+      if (sa->per_block)
+        free(s);
+      if (used < 0)
+        sa->failed = 1;
+      in += used;
+    }
+  }
+  free(scratch);
+  free(out);
+  return NULL;
+}
+
+// -B, after the kernels: what the per-thread scratch saves. The bitshuffle
+// block functions used to allocate their temporaries for every block; the
+// same frames are decoded block by block with a malloc and free of the
+// scratch for each block, and with one scratch per thread, on one thread
+// and on every core at once, where the threads contend in the allocator.
+void bench_scratch(void)
+{
+  const size_t npixels = 4 * 1024 * 1024, block_size = bshuf_default_block_size(2);
+  int ncores = omp_get_max_threads();
+  char *frame = malloc(npixels * 2), *compressed = malloc(bshuf_compress_lz4_bound(npixels, 2, block_size));
+  if (frame == NULL || compressed == NULL)
+  {
+    fprintf(stderr, "--Error--: failed to allocate benchmark buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned int seed = 1;
+  for (size_t i = 0; i < npixels; i++)
+  {
+    uint16_t v = (rand_r(&seed) % 64 == 0) ? rand_r(&seed) % 1000 : rand_r(&seed) % 4;
+    memcpy(frame + 2 * i, &v, 2);
+  }
+  bshuf_compress_lz4(frame, compressed, npixels, 2, block_size);
+
+  fprintf(stderr, "\nscratch per block vs per thread, 16-bit %zu pixel frames, %zu pixel blocks\n", npixels, block_size);
+  fprintf(stderr, " %8s %16s %16s %16s\n", "threads", "malloc frames/s", "scratch frames/s", "allocator share");
+  int nthreads_list[2] = {1, ncores};
+  for (int k = 0; k < (ncores > 1 ? 2 : 1); k++)
+  {
+    int nthreads = nthreads_list[k];
+    double rate[2];
+    for (int per_block = 1; per_block >= 0; per_block--)
+    {
+      struct ScratchArg args[nthreads];
+      pthread_t tids[nthreads];
+      double t0 = ring_now();
+      for (int i = 0; i < nthreads; i++)
+      {
+        args[i] = (struct ScratchArg){compressed, npixels, block_size, per_block, 4, 0};
+        pthread_create(&tids[i], NULL, scratch_worker, &args[i]);
+      }
+      for (int i = 0; i < nthreads; i++)
+      {
+        pthread_join(tids[i], NULL);
+        if (args[i].failed)
+        {
+          fprintf(stderr, "--Error--: failed to decode the benchmark frame\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      rate[per_block] = 4 * nthreads / (ring_now() - t0);
+    }
+    // share of the per-block decode time that went to malloc and free
+    fprintf(stderr, " %8d %16.1f %16.1f %15.1f%%\n", nthreads, rate[1], rate[0], 100 * (1 - rate[1] / rate[0]));
+  }
+  free(frame);
+  free(compressed);
+}
+
+struct SplitArg
+{
+  const char *compressed;
+  size_t npixels;
+  int nthreads; // bitshuffle threads per frame
+  int *next_frame, nframes;
+  double latency; // summed over the frames decoded by this worker
+  int failed;
+};
+
+void *split_worker(void *arg)
+{
+  struct SplitArg *sa = (struct SplitArg *)arg;
+  int32_t *out = malloc(sa->npixels * sizeof(int32_t));
+  if (out != NULL)
+    memset(out, 0, sa->npixels * sizeof(int32_t)); // fault the pages in beforehand, as the converter's buffers are
+  bshuf_set_threads(sa->nthreads);
+  sa->latency = 0;
+  sa->failed = (out == NULL);
+  while (out != NULL && __sync_fetch_and_add(sa->next_frame, 1) < sa->nframes)
+  {
+    double t0 = ring_now();
+    if (bshuf_decompress_lz4_i32((void *)sa->compressed, out, sa->npixels, 2, 0, 65535) < 0)
+      sa->failed = 1;
+    sa->latency += ring_now() - t0;
+  }
+  free(out);
+  return NULL;
+}
+
+// Second part of -B: the same frames decoded with the cores split between
+// frames and bitshuffle blocks in different ways. One frame per core gives
+// the best throughput for bulk conversion; all cores in one frame the
+// lowest latency for a single frame.
+void bench_split(void)
+{
+  const size_t npixels = 4371 * 4150; // EIGER 16M
+  int ncores = omp_get_max_threads();
+  char *frame = malloc(npixels * 2), *compressed = malloc(bshuf_compress_lz4_bound(npixels, 2, 0));
+  if (frame == NULL || compressed == NULL)
+  {
+    fprintf(stderr, "--Error--: failed to allocate benchmark buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned int seed = 1;
+  for (size_t i = 0; i < npixels; i++)
+  {
+    uint16_t v = (rand_r(&seed) % 64 == 0) ? rand_r(&seed) % 1000 : rand_r(&seed) % 4;
+    memcpy(frame + 2 * i, &v, 2);
+  }
+  bshuf_compress_lz4(frame, compressed, npixels, 2, 0);
+
+  int plan_workers, plan_threads_bulk, plan_threads_one, dummy;
+  plan_threads(ncores, 1000, npixels * 2, true, 0, &plan_workers, &plan_threads_bulk);
+  plan_threads(ncores, 1, npixels * 2, true, 0, &dummy, &plan_threads_one);
+  fprintf(stderr, "\nframes vs blocks, %d cores, 16-bit %zu pixel frames to int32 (planned: %dx%d bulk, 1x%d single frame)\n",
+          ncores, npixels, plan_workers, plan_threads_bulk, plan_threads_one);
+  fprintf(stderr, " %8s %8s %8s %12s %12s\n", "frames", "workers", "threads", "frames/s", "latency ms");
+  int nsplits = 0, workers[3], threads[3];
+  workers[nsplits] = ncores, threads[nsplits++] = 1;
+  if (ncores >= 4)
+    workers[nsplits] = ncores / 2, threads[nsplits++] = 2;
+  if (ncores > 1)
+    workers[nsplits] = 1, threads[nsplits++] = ncores;
+  int nframes_list[2] = {1, 4 * ncores};
+  for (int f = 0; f < 2; f++)
+  {
+    for (int k = 0; k < nsplits; k++)
+    {
+      int nworkers = workers[k] < nframes_list[f] ? workers[k] : nframes_list[f];
+      struct SplitArg args[nworkers];
+      pthread_t tids[nworkers];
+      int next_frame = 0;
+      double t0 = ring_now();
+      for (int i = 0; i < nworkers; i++)
+      {
+        args[i] = (struct SplitArg){compressed, npixels, threads[k], &next_frame, nframes_list[f], 0, 0};
+        pthread_create(&tids[i], NULL, split_worker, &args[i]);
+      }
+      double latency = 0;
+      for (int i = 0; i < nworkers; i++)
+      {
+        pthread_join(tids[i], NULL);
+        latency += args[i].latency;
+        if (args[i].failed)
+        {
+          fprintf(stderr, "--Error--: failed to decode the benchmark frame\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      double wall = ring_now() - t0;
+      fprintf(stderr, " %8d %8d %8d %12.1f %12.2f\n", nframes_list[f], nworkers, threads[k],
+              nframes_list[f] / wall, 1E3 * latency / nframes_list[f]);
+    }
+  }
+  free(frame);
+  free(compressed);
+}
+
+// Dependent reads at random offsets: each address comes from the value read
+// before, so a TLB miss cannot overlap the next read. Returns ns per read.
+double random_reads(const uint64_t *buf, size_t nwords, long nreads)
+{
+  uint64_t x = 1;
+  double t0 = ring_now();
+  for (long i = 0; i < nreads; i++)
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL + buf[(x >> 33) % nwords];
+  double t = ring_now() - t0;
+  volatile uint64_t sink = x; // keeps the loop
+  (void)sink;
+  return 1E9 * t / nreads;
+}
+
+// Third part of -B: what the frame buffers gain from huge pages. Random
+// reads over 512 MB miss the TLB on almost every read with 4 KB pages;
+// its 256 pages of 2 MB fit in the TLB.
+void bench_huge_pages(void)
+{
+  const size_t size = (size_t)512 << 20;
+  const long nreads = 1L << 24;
+  huge_buffer huge;
+  uint64_t *plain = malloc(size);
+  if (plain == NULL || huge_alloc(&huge, size, 0) < 0)
+  {
+    fprintf(stderr, "--Error--: failed to allocate benchmark buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  // Fault the pages in beforehand. Not with zeros: malloc and memset to 0
+  // become calloc, and the reads would all hit the shared zero page.
+  memset(plain, 1, size);
+  memset(huge.ptr, 1, size);
+  fprintf(stderr, "\nrandom reads over %zu MB (ns/read)\n", size >> 20);
+  fprintf(stderr, " %-28s %8.1f\n", "malloc", random_reads(plain, size / 8, nreads));
+  fprintf(stderr, " %-28s %8.1f\n", huge_pages_name(huge.kind), random_reads(huge.ptr, size / 8, nreads));
+  free(plain);
+  huge_free(&huge);
+}
+
+// Fourth part of -B: the pixel mask on an EIGER 16M frame of 16-bit
+// pixels with its module gaps and scattered defective pixels. The run
+// list against testing the mask at every pixel, as eiger2cbf.c does, both
+// through pixel_convert and as the fills left to do on the -c path, where
+// the pixels were widened while they were decoded.
+void bench_mask(void)
+{
+  const int xpixels = 4150, ypixels = 4371; // 4 x 8 modules of 1030 x 514 pixels
+  const size_t npixels = (size_t)xpixels * ypixels;
+  const int nreps = 10;
+  const uint32_t error_val = 65535;
+  uint16_t *raw = malloc(npixels * sizeof(uint16_t));
+  int32_t *pixel_mask = malloc(npixels * sizeof(int32_t));
+  int32_t *expected = malloc(npixels * sizeof(int32_t)), *out = malloc(npixels * sizeof(int32_t));
+  mask_runs runs;
+  if (raw == NULL || pixel_mask == NULL || expected == NULL || out == NULL)
+  {
+    fprintf(stderr, "--Error--: failed to allocate benchmark buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned int seed = 1;
+  for (int y = 0; y < ypixels; y++)
+    for (int x = 0; x < xpixels; x++)
+    {
+      size_t i = (size_t)y * xpixels + x;
+      raw[i] = (rand_r(&seed) % 64 == 0) ? rand_r(&seed) % 1000 : rand_r(&seed) % 4;
+      pixel_mask[i] = (x % 1040 >= 1030 || y % 551 >= 514) ? 1 : (rand_r(&seed) % 2000 == 0) ? 2 : 0;
+    }
+  if (mask_runs_build(pixel_mask, npixels, &runs) < 0)
+  {
+    fprintf(stderr, "--Error--: failed to build the mask runs\n");
+    exit(EXIT_FAILURE);
+  }
+  pixel_convert_fn convert = pixel_convert_select(sizeof(uint16_t), &runs);
+
+  fprintf(stderr, "\npixel mask, %d x %d 16-bit frame, %zu runs (ms per frame)\n", xpixels, ypixels, runs.nruns);
+  const char *names[3] = {"per pixel test", "runs, pixel_convert", "runs, fills only (-c)"};
+  for (int m = 0; m < 3; m++)
+  {
+    double best = 0;
+    for (int rep = 0; rep < nreps; rep++)
+    {
+      if (m == 2)
+        for (size_t i = 0; i < npixels; i++)
+          out[i] = raw[i]; // widened by the decoder
+      double t0 = ring_now();
+      if (m == 0)
+      {
+        for (size_t i = 0; i < npixels; i++)
+        {
+          if (pixel_mask[i] == 1)
+            out[i] = -1;
+          else if (pixel_mask[i] > 1)
+            out[i] = -2;
+          else
+            out[i] = raw[i];
+        }
+      }
+      else if (m == 1)
+      {
+        convert(raw, out, npixels, 0, &runs, error_val);
+      }
+      else
+      {
+        mask_runs_apply(&runs, out);
+      }
+      double t = ring_now() - t0;
+      if (rep == 0 || t < best)
+        best = t;
+    }
+    if (m == 0)
+      memcpy(expected, out, npixels * sizeof(int32_t));
+    else if (memcmp(expected, out, npixels * sizeof(int32_t)) != 0)
+    {
+      fprintf(stderr, "--Error--: %s differs from the per pixel test\n", names[m]);
+      exit(EXIT_FAILURE);
+    }
+    if (m == 1)
+      fprintf(stderr, " %-28s %8.2f (%s)\n", names[m], 1E3 * best, pixel_convert_isa());
+    else
+      fprintf(stderr, " %-28s %8.2f\n", names[m], 1E3 * best);
+  }
+  mask_runs_free(&runs);
+  free(raw);
+  free(pixel_mask);
+  free(expected);
+  free(out);
+}
+
 int main(int argc, char **argv)
 {
   int xpixels = -1, ypixels = -1, beamx = -1, beamy = -1, nimages = -1, depth = -1, countrate_cutoff = -1, ntrigger = 1;
   int from = -1, to = -1;
   double pixelsize = -1, wavelength = -1, distance = -1, count_time = -1, frame_time = -1, osc_width = -1, thickness = -1;
   char detector_sn[256] = {}, description[256] = {}, version[256] = {};
-  bool renumber = true, debug = false;
+  bool renumber = true, debug = false, direct_chunk = false, fused = false, cbflib = false, verify = false;
+  bool direct_io = false;
+  int nwriters = 1;
+  int block_threads = 0; // bitshuffle threads per frame, 0: planned
+  char *archive_path = NULL;
 
   hid_t hdf;
 
@@ -89,7 +1055,7 @@ int main(int argc, char **argv)
 
   int opt;
   char *prefix = NULL;
-  while ((opt = getopt(argc, argv, "s:e:p:xhd")) != -1)
+  while ((opt = getopt(argc, argv, "s:e:p:xhdcfnCVw:OT:Bj:")) != -1)
   {
     switch (opt)
     {
@@ -109,8 +1075,53 @@ int main(int argc, char **argv)
     case 'd':
       debug = true;
       break;
+    case 'c':
+      direct_chunk = true; // read compressed chunks and decode them outside libhdf5
+      fprintf(stderr, "direct chunk read enabled\n");
+      break;
+    case 'f':
+      fused = true; // decode, mask and encode tile by tile; implies -c
+      direct_chunk = true;
+      fprintf(stderr, "fused tile conversion enabled\n");
+      break;
+    case 'n':
+      break; // the native miniCBF writer is the default; accepted for older scripts
+    case 'C':
+      cbflib = true; // write with CBFlib, even with -f or -V
+      fprintf(stderr, "writing with CBFlib\n");
+      break;
+    case 'V':
+      verify = true; // write with the native writer and compare every frame with CBFlib's output
+      fprintf(stderr, "verifying the native writer against CBFlib\n");
+      break;
+    case 'w':
+      nwriters = atoi(optarg); // threads writing files
+      if (nwriters < 1)
+        nwriters = 1;
+      break;
+    case 'O':
+      direct_io = true; // write files with O_DIRECT
+      fprintf(stderr, "O_DIRECT output enabled\n");
+      break;
+    case 'T':
+      archive_path = optarg; // all frames into one tar archive
+      fprintf(stderr, "writing frames into the archive %s\n", optarg);
+      break;
+    case 'j':
+      block_threads = atoi(optarg); // bitshuffle threads per frame
+      if (block_threads < 1)
+        block_threads = 1;
+      break;
+    case 'B':
+      bench_bitshuffle(); // benchmark the bitshuffle kernels, their scratch, the thread split, huge pages and the mask, and exit
+      bench_scratch();
+      bench_split();
+      bench_huge_pages();
+      bench_mask();
+      exit(EXIT_SUCCESS);
     case 'h':
-      fprintf(stderr, "Usage: %s -s start -e end -p prefix master_file\n", argv[0]);
+      fprintf(stderr, "Usage: %s [-c] [-f] [-C] [-V] [-w writers] [-j threads] [-O] [-T archive.tar] -s start -e end -p prefix master_file\n", argv[0]);
+      fprintf(stderr, "       %s -B  (benchmark the bitshuffle kernels, huge pages and the pixel mask)\n", argv[0]);
       exit(EXIT_FAILURE);
     }
   }
@@ -118,7 +1129,7 @@ int main(int argc, char **argv)
   char *master_file = argv[optind];
   if (master_file == NULL || access(master_file, F_OK) == -1)
   {
-    fprintf(stderr, "Usage: %s -s start -e end -p prefix master_file\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-c] [-f] [-C] [-V] [-w writers] [-j threads] [-O] [-T archive.tar] -s start -e end -p prefix master_file\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   printf("master file: %s\n", master_file);
@@ -360,6 +1371,19 @@ int main(int argc, char **argv)
     fprintf(stderr, " However, this might mask overloaded (saturated) pixels as well.\n");
   }
 
+  // The mask is the same for all frames. Keep only the masked runs.
+  mask_runs mask;
+  if (pixel_mask[0] != -9999)
+  {
+    if (mask_runs_build(pixel_mask, (size_t)xpixels * ypixels, &mask) < 0)
+    {
+      fprintf(stderr, "failed to allocate the pixel mask.\n");
+      return -1;
+    }
+    fprintf(stderr, "Pixel mask: %zu pixels set to -1 and %zu to -2 in %zu runs.\n",
+            mask.nminus1, mask.nminus2, mask.nruns);
+  }
+
   // Check if /entry/data present
   group = H5Gopen2(entry, "data", H5P_DEFAULT);
   if (group < 0)
@@ -401,15 +1425,136 @@ int main(int argc, char **argv)
   number_per_block = dims[0];
   fprintf(stderr, "The number of images per data block is %d.\n", number_per_block);
 
+  // Frames are read in their stored width, which should match bit_depth_image.
+  hid_t type = H5Dget_type(data);
+  if (type >= 0)
+  {
+    fprintf(stderr, "Pixels are stored as %d bit integers.\n", (int)H5Tget_size(type) * 8);
+    if ((int)H5Tget_size(type) * 8 < depth)
+    {
+      fprintf(stderr, " WARNING: this is narrower than bit_depth_image (%d).\n", depth);
+    }
+    H5Tclose(type);
+  }
+
   H5Sclose(dataspace);
   H5Dclose(data);
 
   fprintf(stderr, "\nFile analysis completed.\n\n");
-  int frame;
 
-#pragma omp parallel for private(data, dataspace, data_name, frame) // shared(group, entry, angles, buf_signed, buf, debug)
-  for (frame = from; frame <= to; frame++)
+  // Set up the pipeline: this thread reads, nworkers threads decode, mask
+  // and encode, and nwriters threads write.
+  struct Pipeline pl;
+  pl.xpixels = xpixels;
+  pl.ypixels = ypixels;
+  pl.mask = (pixel_mask[0] != -9999) ? &mask : NULL;
+  pl.error_val = error_val;
+  pl.description = description;
+  pl.detector_sn = detector_sn;
+  pl.thickness = thickness;
+  pl.pixelsize = pixelsize;
+  pl.count_time = count_time;
+  pl.frame_time = frame_time;
+  pl.countrate_cutoff = countrate_cutoff;
+  pl.wavelength = wavelength;
+  pl.distance = distance;
+  pl.beamx = beamx;
+  pl.beamy = beamy;
+  pl.osc_width = osc_width;
+  pl.debug = debug;
+  render_header_template(&pl);
+  if (minicbf_header_init(&pl.cbf_header, MINICBF_WRITTEN_BY, pl.header_head, pl.header_tail, xpixels, ypixels) < 0)
+  {
+    fprintf(stderr, "failed to render the CBF header.\n");
+    return -1;
+  }
+  // The native writer writes unless -C asks for CBFlib. The fused path
+  // never holds the whole frame, which -V and CBFlib need.
+  pl.cbflib = cbflib;
+  pl.fused = fused && !pl.cbflib && !verify;
+  pl.verify = verify && !pl.cbflib;
+  pl.nmismatch = 0;
+  if (fused && !pl.fused)
+    fprintf(stderr, "fused tile conversion disabled by -C or -V\n");
+  if (verify && !pl.verify)
+    fprintf(stderr, "verification disabled by -C\n");
+  size_t frame_bytes = (size_t)xpixels * ypixels * ((depth <= 8) ? 1 : (depth <= 16) ? 2 : 4);
+  int ncores = omp_get_max_threads();
+  plan_threads(ncores, to - from + 1, frame_bytes, !pl.fused, block_threads,
+               &pl.nworkers, &pl.block_threads);
+  // Without -c, libhdf5 decodes in the read stage, one frame at a time:
+  // only the blocks of a frame can be spread, over the cores the decode
+  // workers leave free.
+  int read_threads = ncores - pl.nworkers * pl.block_threads;
+  bshuf_set_threads(direct_chunk ? pl.block_threads : (read_threads > 1) ? read_threads : 1);
+  pl.nwriters = nwriters;
+  pl.busy_read = 0;
+  pl.busy_decode = (double *)calloc(pl.nworkers, sizeof(double));
+  pl.busy_mask = (double *)calloc(pl.nworkers, sizeof(double));
+  pl.nmask_fills = (int *)calloc(pl.nworkers, sizeof(int));
+  pl.writers = (file_writer *)malloc(sizeof(file_writer) * pl.nwriters);
+  pl.scratch = (struct Scratch *)calloc(pl.nworkers, sizeof(struct Scratch));
+  for (int i = 0; pl.scratch != NULL && i < pl.nworkers; i++)
+  {
+    // raw is large enough for pixels of up to 32 bits
+    minicbf_init(&pl.scratch[i].cbf);
+    if (huge_alloc(&pl.scratch[i].raw, sizeof(int32_t) * xpixels * ypixels, 0) < 0 ||
+        huge_alloc(&pl.scratch[i].pixels, sizeof(int32_t) * xpixels * ypixels, 0) < 0)
+    {
+      fprintf(stderr, "failed to allocate frame buffers.\n");
+      return -1;
+    }
+  }
+  if (pl.busy_decode == NULL || pl.busy_mask == NULL || pl.nmask_fills == NULL || pl.writers == NULL || pl.scratch == NULL ||
+      ring_init(&pl.decode_queue, pl.nworkers) < 0 ||
+      ring_init(&pl.write_queue, 2 * pl.nworkers) < 0) // absorbs file system latency spikes
+  {
+    fprintf(stderr, "failed to set up the pipeline.\n");
+    return -1;
+  }
+
+  tar_archive archive;
+  if (archive_path != NULL && tar_archive_open(&archive, archive_path) < 0)
+  {
+    fprintf(stderr, "failed to create %s: %s\n", archive_path, strerror(errno));
+    return -1;
+  }
+  for (int i = 0; i < pl.nwriters; i++)
+    file_writer_init(&pl.writers[i], direct_io, (archive_path != NULL) ? &archive : NULL);
+
+  double t_start = ring_now();
+  pthread_t *writers = (pthread_t *)malloc(sizeof(pthread_t) * pl.nwriters);
+  struct WorkerArg *writer_args = (struct WorkerArg *)malloc(sizeof(struct WorkerArg) * pl.nwriters);
+  pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * pl.nworkers);
+  struct WorkerArg *worker_args = (struct WorkerArg *)malloc(sizeof(struct WorkerArg) * pl.nworkers);
+  for (int i = 0; i < pl.nwriters; i++)
+  {
+    writer_args[i].pl = &pl;
+    writer_args[i].id = i;
+    pthread_create(&writers[i], NULL, write_stage, &writer_args[i]);
+  }
+  for (int i = 0; i < pl.nworkers; i++)
+  {
+    worker_args[i].pl = &pl;
+    worker_args[i].id = i;
+    pthread_create(&workers[i], NULL, decode_stage, &worker_args[i]);
+  }
+
+  // Read stage. This is the only thread that touches libhdf5 from here on.
+  block_cache blocks;
+  block_cache_init(&blocks, group, xpixels, ypixels);
+  for (int frame = from; frame <= to; frame++)
   {
+    double t0 = ring_now();
+    struct FrameJob *job = (struct FrameJob *)calloc(1, sizeof(struct FrameJob));
+    if (job == NULL)
+    {
+      fprintf(stderr, "--Error--: Failed to allocate a job for frame %d.\n", frame);
+      continue;
+    }
+    job->frame = frame;
+    job->chunk_bytes = -1;
+
     double osc_start = -9999.0;
     if (debug)
       fprintf(stderr, "Converting frame %d (%d / %d)\n", frame, frame - from + 1, to - from + 1);
@@ -425,6 +1570,7 @@ int main(int argc, char **argv)
         fprintf(stderr, " oscillation start not defined. \"Start_angle\" field in the output is set to 0!\n");
       osc_start = osc_width * frame; // old firmware
     }
+    job->osc_start = osc_start;
 
     int modified_frame = frame;
     if (renumber == 1 && osc_width >= 1e-6)
@@ -432,10 +1578,9 @@ int main(int argc, char **argv)
       modified_frame = (int)round((osc_start - angles[0]) / osc_width + 1);
     }
 
-    char filename[4096];
-    snprintf(filename, 4096, "%s%06d.cbf", prefix, modified_frame);
+    snprintf(job->filename, sizeof(job->filename), "%s%06d.cbf", prefix, modified_frame);
     if (debug)
-      fprintf(stderr, "frame=%i --> %i  osc=%.3f outfile=%s\n", frame, modified_frame, osc_start, filename);
+      fprintf(stderr, "frame=%i --> %i  osc=%.3f outfile=%s\n", frame, modified_frame, osc_start, job->filename);
 
     if (frame > nimages)
     {
@@ -444,28 +1589,6 @@ int main(int argc, char **argv)
       // So we don't exit here
     }
 
-    char header_format[] =
-        "\n"
-        "# Detector: %s, S/N %s\n"
-        "# Pixel_size %de-6 m x %de-6 m\n"
-        "# Silicon sensor, thickness %.6f m\n"
-        "# Exposure_time %f s\n"
-        "# Exposure_period %f s\n"
-        "# Count_cutoff %d counts\n"
-        "# Wavelength %f A\n"
-        "# Detector_distance %f m\n"
-        "# Beam_xy (%d, %d) pixels\n"
-        "# Start_angle %f deg.\n"
-        "# Angle_increment %f deg.\n";
-
-    char header_content[4096] = {};
-    snprintf(header_content, 4096, header_format,
-             description, detector_sn,
-             thickness,
-             (int)(pixelsize * 1E6), (int)(pixelsize * 1E6),
-             count_time, frame_time, countrate_cutoff, wavelength, distance,
-             beamx, beamy, osc_start, osc_width);
-
     // Now open the required data
 
     int block_number = block_start + (frame - 1) / number_per_block;
@@ -474,128 +1597,116 @@ int main(int argc, char **argv)
     //            frame, block_number, frame_in_block + 1);
 
     snprintf(data_name, 20, "data_%06d", block_number);
-    char err_msg[4096] = "";
-    data = H5Dopen2(group, data_name, H5P_DEFAULT);
-    dataspace = H5Dget_space(data);
-    if (data < 0)
+    char *err_msg = job->err_msg;
+
+    // Frames are read in order, so each block is opened only once.
+    int ret = block_cache_open(&blocks, block_number);
+    if (ret == -1)
     {
       sprintf(err_msg, "failed to open /entry/%s\n", data_name);
     }
-    if (H5Sget_simple_extent_ndims(dataspace) != 3)
+    else if (ret == -2)
     {
       sprintf(err_msg, "Dimension of /entry/%s is not 3!\n", data_name);
     }
 
-    // Get the frame
-    H5Sget_simple_extent_dims(dataspace, dims, NULL);
-    hsize_t offset_in[3] = {frame_in_block, 0, 0};
-    hsize_t offset_out[3] = {0, 0, 0};
-    hsize_t count[3] = {1, ypixels, xpixels};
-    hid_t memspace = H5Screate_simple(3, dims, NULL);
-    if (memspace < 0)
+    // Fetch the compressed chunk. It is decoded by the next stage.
+    job->fmt = blocks.fmt;
+    if (direct_chunk && strlen(err_msg) == 0 && job->fmt.codec != CHUNK_CODEC_UNSUPPORTED)
     {
-      sprintf(err_msg, "failed to create memspace\n");
+      job->chunk_bytes = chunk_read(blocks.data, frame_in_block, &job->chunk, &job->chunk_size);
     }
 
-    int ret = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset_in, NULL,
-                                  count, NULL);
-    if (ret < 0)
-    {
-      sprintf(err_msg, "select_hyperslab for file failed\n");
-    }
-    ret = H5Sselect_hyperslab(memspace, H5S_SELECT_SET, offset_out, NULL,
-                              count, NULL);
-    if (ret < 0)
+    // Get the frame through the filter pipeline
+    if (job->chunk_bytes < 0 && strlen(err_msg) == 0)
     {
-      sprintf(err_msg, "select_hyperslab for memory failed\n");
-    }
-
-    unsigned int *buf = (unsigned int *)malloc(sizeof(unsigned int) * xpixels * ypixels);
-    signed int *buf_signed = (signed int *)malloc(sizeof(signed int) * xpixels * ypixels);
-    if (buf == NULL || buf_signed == NULL || pixel_mask == NULL)
-    {
-      sprintf(err_msg, "Failed to allocate image buffer.\n");
-    }
-
-    ret = H5Dread(data, H5T_NATIVE_UINT, memspace, dataspace, H5P_DEFAULT, buf);
-    if (ret < 0)
-    {
-      sprintf(err_msg, "H5Dread for image failed. Wrong frame number? frame=%d\n", frame);
+      job->elem_size = blocks.elem_size;
+      job->raw = malloc(blocks.elem_size * xpixels * ypixels);
+      if (job->raw == NULL)
+      {
+        sprintf(err_msg, "Failed to allocate image buffer.\n");
+      }
+      else
+      {
+        ret = block_cache_read(&blocks, frame_in_block, blocks.mem_type, job->raw);
+        if (ret == -2)
+        {
+          sprintf(err_msg, "select_hyperslab for file failed\n");
+        }
+        else if (ret < 0)
+        {
+          sprintf(err_msg, "H5Dread for image failed. Wrong frame number? frame=%d\n", frame);
+        }
+      }
     }
 
-    H5Sclose(dataspace);
-    H5Sclose(memspace);
-    H5Dclose(data);
+    pl.busy_read += ring_now() - t0;
 
     if (strlen(err_msg) > 0)
     {
       fprintf(stderr, "--Error--: %s", err_msg);
+      free_job(job);
+      continue;
     }
-    else
-    {
-
-      /////////////////////////////////////////////////////////////////
-      // Reading done. Here output starts...
-
-      FILE *fh = fopen(filename, "wb");
-
-      // create a CBF
-      cbf_handle cbf;
-      cbf_make_handle(&cbf);
-      cbf_new_datablock(cbf, "image_1");
+    ring_push(&pl.decode_queue, job);
+  }
+  ring_close(&pl.decode_queue);
+  block_cache_close(&blocks);
 
-      // put a miniCBF header
-      cbf_new_category(cbf, "array_data");
-      cbf_new_column(cbf, "header_convention");
-      cbf_set_value(cbf, "SLS_1.0");
-      cbf_new_column(cbf, "header_contents");
-      cbf_set_value(cbf, header_content);
+  for (int i = 0; i < pl.nworkers; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  ring_close(&pl.write_queue);
+  for (int i = 0; i < pl.nwriters; i++)
+  {
+    pthread_join(writers[i], NULL);
+  }
 
-      // put the image
-      cbf_new_category(cbf, "array_data");
-      cbf_new_column(cbf, "data");
-      int i;
-      for (i = 0; i < xpixels * ypixels; i++)
-      {
-        if ((pixel_mask[0] != -9999 && pixel_mask[i] == 1) || // the pixel mask is available
-            (pixel_mask[0] == -9999 && buf[i] == error_val))
-        { // not available
-          buf_signed[i] = -1;
-        }
-        else if (pixel_mask[0] != -9999 && pixel_mask[i] > 1)
-        { // the pixel mask is 2, 4, 8, 16
-          buf_signed[i] = -2;
-        }
-        else
-        {
-          buf_signed[i] = buf[i];
-        }
-      }
-      cbf_set_integerarray_wdims_fs(cbf,
-                                    CBF_BYTE_OFFSET,
-                                    1, // binary id
-                                    buf_signed,
-                                    sizeof(int),
-                                    1, // signed?
-                                    xpixels * ypixels,
-                                    "little_endian",
-                                    xpixels,
-                                    ypixels,
-                                    0,
-                                    0); // padding
-      cbf_write_file(cbf, fh, 1, CBF, MSG_DIGEST | MIME_HEADERS | PAD_4K, 0);
-      // no need to fclose() here as the 3rd argument "readable" is 1
-      cbf_free_handle(cbf);
-      free(buf);
-      free(buf_signed);
-    }
+  if (archive_path != NULL && tar_archive_close(&archive) < 0)
+    fprintf(stderr, "--Error--: failed to complete %s or its index: %s\n", archive_path, strerror(errno));
+
+  report_pipeline(&pl, ring_now() - t_start);
+  // -V fails the run on a difference, so that it can serve as a test.
+  int nwritten = frames_written(&pl), nmismatch = pl.verify ? pl.nmismatch : 0;
+
+  ring_destroy(&pl.decode_queue);
+  ring_destroy(&pl.write_queue);
+  free(workers);
+  free(worker_args);
+  free(writers);
+  free(writer_args);
+  for (int i = 0; i < pl.nwriters; i++)
+    file_writer_destroy(&pl.writers[i]);
+  free(pl.writers);
+  free(pl.busy_decode);
+  free(pl.busy_mask);
+  free(pl.nmask_fills);
+  for (int i = 0; i < pl.nworkers; i++)
+  {
+    huge_free(&pl.scratch[i].raw);
+    huge_free(&pl.scratch[i].pixels);
+    free(pl.scratch[i].tile_raw);
+    free(pl.scratch[i].tile);
+    minicbf_free(&pl.scratch[i].cbf);
   }
+  free(pl.scratch);
+  minicbf_header_free(&pl.cbf_header);
+  if (pl.mask != NULL)
+    mask_runs_free(&mask);
+  free(pixel_mask);
 
   H5Gclose(group);
   H5Fclose(hdf);
 
   free(angles);
 
+  if (nwritten < to - from + 1 || nmismatch > 0)
+  {
+    fprintf(stderr, "\n--Error--: %d of %d frames written, %d differ from CBFlib.\n", nwritten, to - from + 1, nmismatch);
+    return 1;
+  }
+
   fprintf(stderr, "\nAll done!\n");
 
   return 0;
@@ -0,0 +1,138 @@
+/*
+ Output of finished files. See file_writer.h.
+*/
+
+#define _GNU_SOURCE // O_DIRECT, fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_writer.h"
+#include "ring.h"
+
+// O_DIRECT transfers must be multiples of the logical block size.
+// 4 KB covers all current disks and Lustre/BeeGFS.
+#define DIRECT_ALIGN 4096
+
+void file_writer_init(file_writer *w, int direct, tar_archive *archive) {
+  w->direct = archive ? 0 : direct;
+  w->archive = archive;
+  w->bounce = NULL;
+  w->bounce_size = 0;
+  w->nfiles = 0;
+  w->nbytes = 0;
+  w->busy = 0;
+  w->max_latency = 0;
+}
+
+void file_writer_destroy(file_writer *w) {
+  free(w->bounce);
+  w->bounce = NULL;
+  w->bounce_size = 0;
+}
+
+/* write() until everything is out */
+static int write_all(int fd, const char *p, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int write_direct(file_writer *w, int fd, const void *data, size_t size) {
+  size_t padded = (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  if (w->bounce_size < padded) {
+    free(w->bounce);
+    w->bounce = NULL;
+    w->bounce_size = 0;
+    if (posix_memalign(&w->bounce, DIRECT_ALIGN, padded) != 0) return -1;
+    w->bounce_size = padded;
+  }
+  memcpy(w->bounce, data, size);
+  memset((char *)w->bounce + size, 0, padded - size);
+
+  if (write_all(fd, (const char *)w->bounce, padded) < 0) return -1;
+  return ftruncate(fd, size);
+}
+
+int file_writer_write(file_writer *w, const char *path, const void *data, size_t size) {
+  double t0 = ring_now();
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = -1;
+  int ret, saved_errno;
+
+  if (w->archive != NULL) {
+    ret = tar_archive_append(w->archive, path, data, size);
+    goto done;
+  }
+
+  if (w->direct) {
+    fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) w->direct = 0; // not supported here
+  }
+  if (fd < 0) fd = open(path, flags, 0644);
+  if (fd < 0) return -1;
+
+  // Reserve the blocks at once; this is only a hint, so errors
+  // (e.g. EOPNOTSUPP on file systems without fallocate) are ignored.
+  if (size > 0) fallocate(fd, 0, 0, size);
+
+  if (w->direct) {
+    ret = write_direct(w, fd, data, size);
+    if (ret < 0 && errno == EINVAL) {
+      // The alignment requirement of this device is stricter; go buffered.
+      w->direct = 0;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      ret = (lseek(fd, 0, SEEK_SET) < 0 || ftruncate(fd, 0) < 0) ? -1 : write_all(fd, (const char *)data, size);
+    }
+  } else {
+    ret = write_all(fd, (const char *)data, size);
+  }
+  saved_errno = errno;
+  if (close(fd) < 0 && ret == 0) {
+    ret = -1;
+  } else {
+    errno = saved_errno;
+  }
+
+ done:
+  saved_errno = errno;
+  double dt = ring_now() - t0;
+  w->busy += dt;
+  if (dt > w->max_latency) w->max_latency = dt;
+  if (ret == 0) {
+    w->nfiles++;
+    w->nbytes += size;
+  }
+  errno = saved_errno;
+  return ret;
+}
+
+void file_writer_report(const file_writer *w, int n, double wall, FILE *out) {
+  long nfiles = 0;
+  size_t nbytes = 0;
+  double busy = 0, max_latency = 0;
+  int direct = 0;
+
+  for (int i = 0; i < n; i++) {
+    nfiles += w[i].nfiles;
+    nbytes += w[i].nbytes;
+    busy += w[i].busy;
+    if (w[i].max_latency > max_latency) max_latency = w[i].max_latency;
+    direct |= w[i].direct;
+  }
+  double mb = nbytes / 1E6;
+  const char *unit = (n > 0 && w[0].archive != NULL) ? "archive member" : "file";
+  fprintf(out, " output: %ld %ss, %.1f MB%s, %.1f MB/s (%.1f MB/s per writer while busy), %.1f ms per %s (max %.1f ms)\n",
+          nfiles, unit, mb, direct ? " with O_DIRECT" : "",
+          (wall > 0) ? mb / wall : 0, (busy > 0) ? mb / busy : 0,
+          (nfiles > 0) ? 1E3 * busy / nfiles : 0, unit, 1E3 * max_latency);
+}
@@ -0,0 +1,47 @@
+/*
+ Output of finished files.
+
+ Each file is created, preallocated with fallocate() and written with a
+ single write() of the whole buffer, so a frame costs one open, one write
+ and one close on the (parallel) file system. With O_DIRECT the data is
+ staged in an aligned buffer, written in whole pages bypassing the page
+ cache and truncated to its real size.
+
+ With an archive, files become members of it instead (tar_archive.h).
+
+ A file_writer belongs to one thread. It keeps the statistics needed to
+ report the achieved write bandwidth.
+*/
+
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "tar_archive.h"
+
+typedef struct file_writer {
+  int direct;          // use O_DIRECT; cleared if the file system refuses it
+  void *bounce;        // aligned staging buffer for O_DIRECT
+  size_t bounce_size;
+  tar_archive *archive; // shared by all writers; NULL for one file per frame
+
+  // statistics
+  long nfiles;
+  size_t nbytes;
+  double busy;         // seconds spent in open/write/close
+  double max_latency;  // slowest file
+} file_writer;
+
+void file_writer_init(file_writer *w, int direct, tar_archive *archive);
+void file_writer_destroy(file_writer *w);
+
+/* Create (or truncate) path, or the archive member of that name,
+ * and write size bytes to it.
+ * Returns 0, or -1 with errno set. */
+int file_writer_write(file_writer *w, const char *path, const void *data, size_t size);
+
+/* Summary of n writers: files, bytes, bandwidth and latency. */
+void file_writer_report(const file_writer *w, int n, double wall, FILE *out);
+
+#endif // FILE_WRITER_H
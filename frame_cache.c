@@ -0,0 +1,297 @@
+/*
+ Decoded frames kept on the node across plugin sessions. See frame_cache.h.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_cache.h"
+
+#define FRAME_CACHE_MAGIC "E2CCACHE"
+#define FRAME_CACHE_VERSION 1
+#define FRAME_CACHE_PREFIX "eiger2cbf-"
+#define FRAME_CACHE_SUFFIX ".cache"
+
+struct frame_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nslots;
+  uint64_t frame_bytes;
+  int64_t nframes;
+  int64_t master_size;
+  int64_t master_mtime_sec, master_mtime_nsec;
+  char master[1024];
+  uint64_t next __attribute__((aligned(64))); // slots claimed so far
+};
+
+struct frame_cache_slot {
+  uint32_t seq;  // odd while the slot is being written
+  int32_t frame; // 0 if empty
+};
+
+/* File layout: header, slots, index and the frames from a page boundary */
+static size_t cache_layout(uint32_t nslots, int nframes, size_t frame_bytes,
+                           size_t *slots_offset, size_t *index_offset, size_t *data_offset) {
+  *slots_offset = (sizeof(struct frame_cache_header) + 63) & ~(size_t)63;
+  *index_offset = *slots_offset + sizeof(struct frame_cache_slot) * nslots;
+  *data_offset = (*index_offset + sizeof(int32_t) * nframes + 4095) & ~(size_t)4095;
+  return *data_offset + frame_bytes * nslots;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t n) {
+  const unsigned char *b = (const unsigned char *)p;
+  for (size_t i = 0; i < n; i++) {
+    h ^= b[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int header_matches(const struct frame_cache_header *h, const struct frame_cache_header *want) {
+  return memcmp(h->magic, want->magic, sizeof(h->magic)) == 0 &&
+    h->version == want->version && h->nslots == want->nslots &&
+    h->frame_bytes == want->frame_bytes && h->nframes == want->nframes &&
+    h->master_size == want->master_size &&
+    h->master_mtime_sec == want->master_mtime_sec &&
+    h->master_mtime_nsec == want->master_mtime_nsec &&
+    strcmp(h->master, want->master) == 0;
+}
+
+typedef struct cache_file {
+  char path[4096];
+  time_t mtime;
+  off_t size;
+} cache_file;
+
+static int cache_file_cmp(const void *a, const void *b) {
+  time_t ta = ((const cache_file *)a)->mtime, tb = ((const cache_file *)b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+/* Delete the least recently opened cache files of dir, except keep, until
+ * the total size is below limit. Files count at their full size even
+ * while still sparse. Files that some process has open (and locked) stay:
+ * deleting them would not free their memory while they are mapped. */
+static void trim_dir(const char *dir, size_t limit, const char *keep) {
+  DIR *d = opendir(dir);
+  if (d == NULL) return;
+
+  cache_file *files = NULL;
+  size_t nfiles = 0, capacity = 0, total = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    size_t len = strlen(e->d_name);
+    if (strncmp(e->d_name, FRAME_CACHE_PREFIX, strlen(FRAME_CACHE_PREFIX)) != 0 ||
+        len < strlen(FRAME_CACHE_SUFFIX) ||
+        strcmp(e->d_name + len - strlen(FRAME_CACHE_SUFFIX), FRAME_CACHE_SUFFIX) != 0) continue;
+    if (nfiles == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      cache_file *grown = (cache_file *)realloc(files, sizeof(cache_file) * capacity);
+      if (grown == NULL) break;
+      files = grown;
+    }
+    cache_file *f = &files[nfiles];
+    struct stat st;
+    snprintf(f->path, sizeof(f->path), "%s/%s", dir, e->d_name);
+    if (stat(f->path, &st) < 0) continue;
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    total += st.st_size;
+    nfiles++;
+  }
+  closedir(d);
+
+  qsort(files, nfiles, sizeof(cache_file), cache_file_cmp);
+  for (size_t i = 0; i < nfiles && total > limit; i++) {
+    if (strcmp(files[i].path, keep) == 0) continue;
+    int fd = open(files[i].path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(files[i].path) == 0) {
+      fprintf(stderr, "PLUGIN INFO: removed %s from the frame cache.\n", files[i].path);
+      total -= files[i].size;
+    }
+    close(fd);
+  }
+  free(files);
+}
+
+/* Open path and take a shared lock on it. Returns the descriptor, or -1
+ * if there is no file or it was deleted by trim_dir() before we got the lock. */
+static int open_locked(const char *path) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st_fd, st_path;
+  if (flock(fd, LOCK_SH) < 0 || fstat(fd, &st_fd) < 0 || stat(path, &st_path) < 0 ||
+      st_fd.st_ino != st_path.st_ino || st_fd.st_dev != st_path.st_dev) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int frame_cache_open(frame_cache *c, const char *dir, const char *master,
+                     size_t frame_bytes, int nframes, size_t limit, int share, int policy) {
+  memset(c, 0, sizeof(frame_cache));
+  c->fd = -1;
+
+  char real[PATH_MAX];
+  struct stat st;
+  if (nframes <= 0 || frame_bytes == 0 || realpath(master, real) == NULL ||
+      stat(real, &st) < 0 || strlen(real) >= sizeof(((struct frame_cache_header *)0)->master)) {
+    return -1;
+  }
+  if (share <= 0 || share > 100) share = FRAME_CACHE_DEFAULT_SHARE;
+  uint64_t nslots = limit / 100 * share / frame_bytes;
+  if (nslots > (uint64_t)nframes) nslots = nframes;
+  if (nslots == 0) return -1;
+
+  struct frame_cache_header want;
+  memset(&want, 0, sizeof(want));
+  memcpy(want.magic, FRAME_CACHE_MAGIC, sizeof(want.magic));
+  want.version = FRAME_CACHE_VERSION;
+  want.nslots = nslots;
+  want.frame_bytes = frame_bytes;
+  want.nframes = nframes;
+  want.master_size = st.st_size;
+  want.master_mtime_sec = st.st_mtim.tv_sec;
+  want.master_mtime_nsec = st.st_mtim.tv_nsec;
+  strcpy(want.master, real);
+
+  uint64_t key = fnv1a(0xcbf29ce484222325ULL, real, strlen(real));
+  key = fnv1a(key, &want.master_size, 3 * sizeof(int64_t));
+  snprintf(c->path, sizeof(c->path), "%s/" FRAME_CACHE_PREFIX "%016llx" FRAME_CACHE_SUFFIX,
+           dir, (unsigned long long)key);
+
+  size_t slots_offset, index_offset, data_offset;
+  size_t size = cache_layout(nslots, nframes, frame_bytes, &slots_offset, &index_offset, &data_offset);
+
+  /* Use the existing file if it is for the same dataset and size */
+  void *map = MAP_FAILED;
+  int fd = open_locked(c->path);
+  if (fd >= 0) {
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map != MAP_FAILED && !header_matches((struct frame_cache_header *)map, &want)) {
+      munmap(map, size);
+      map = MAP_FAILED;
+    }
+    if (map == MAP_FAILED) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  /* Otherwise build a new one and move it into place in one step, so that
+     other processes never see it half initialized */
+  if (fd < 0) {
+    char tmp[4096 + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", c->path, (int)getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_SH) < 0 || ftruncate(fd, size) < 0 ||
+        (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+    memcpy(map, &want, sizeof(want));
+    if (rename(tmp, c->path) < 0) {
+      munmap(map, size);
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+  }
+  futimens(fd, NULL); // most recently used for trim_dir()
+
+  c->fd = fd;
+  c->map = map;
+  c->map_size = size;
+  c->header = (struct frame_cache_header *)map;
+  c->slots = (struct frame_cache_slot *)((char *)map + slots_offset);
+  c->index = (int32_t *)((char *)map + index_offset);
+  c->data = (char *)map + data_offset;
+  c->frame_bytes = frame_bytes;
+  c->nframes = nframes;
+  c->nslots = nslots;
+  c->policy = policy;
+
+  trim_dir(dir, limit, c->path);
+  return 0;
+}
+
+/* Slot holding frame and its sequence number, or NULL */
+static struct frame_cache_slot *find(frame_cache *c, int frame, uint32_t *seq) {
+  if (c->map == NULL || frame < 1 || frame > c->nframes) return NULL;
+  int32_t s = __atomic_load_n(&c->index[frame - 1], __ATOMIC_ACQUIRE);
+  if (s <= 0 || (uint32_t)s > c->nslots) return NULL;
+
+  struct frame_cache_slot *slot = &c->slots[s - 1];
+  *seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if ((*seq & 1) || __atomic_load_n(&slot->frame, __ATOMIC_RELAXED) != frame) return NULL;
+  return slot;
+}
+
+int frame_cache_get(frame_cache *c, int frame, void *out) {
+  uint32_t seq;
+  struct frame_cache_slot *slot = find(c, frame, &seq);
+  if (slot == NULL) return 0;
+
+  memcpy(out, c->data + c->frame_bytes * (slot - c->slots), c->frame_bytes);
+
+  // overwritten while we copied?
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+int frame_cache_has(frame_cache *c, int frame) {
+  uint32_t seq;
+  return find(c, frame, &seq) != NULL;
+}
+
+void frame_cache_put(frame_cache *c, int frame, const void *data) {
+  if (c->map == NULL || frame < 1 || frame > c->nframes || frame_cache_has(c, frame)) return;
+  if (c->policy == FRAME_CACHE_KEEP && __atomic_load_n(&c->header->next, __ATOMIC_RELAXED) >= c->nslots) return;
+
+  uint64_t next = __atomic_fetch_add(&c->header->next, 1, __ATOMIC_RELAXED);
+  if (c->policy == FRAME_CACHE_KEEP && next >= c->nslots) return; // filled by another process meanwhile
+  uint32_t s = next % c->nslots;
+  struct frame_cache_slot *slot = &c->slots[s];
+
+  // Someone else is still writing this slot after the ring wrapped
+  // around: skip this frame rather than wait.
+  uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return;
+
+  int32_t old = slot->frame;
+  if (old >= 1 && old <= c->nframes) {
+    int32_t expected = s + 1;
+    __atomic_compare_exchange_n(&c->index[old - 1], &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  memcpy(c->data + c->frame_bytes * s, data, c->frame_bytes);
+
+  __atomic_store_n(&slot->frame, frame, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&c->index[frame - 1], (int32_t)(s + 1), __ATOMIC_RELEASE);
+}
+
+void frame_cache_close(frame_cache *c) {
+  if (c->map != NULL) {
+    munmap(c->map, c->map_size);
+    close(c->fd); // releases the lock
+  }
+  c->map = NULL;
+  c->fd = -1;
+}
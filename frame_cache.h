@@ -0,0 +1,79 @@
+/*
+ Decoded frames kept on the node across plugin sessions.
+
+ XDS reads every frame in COLSPOT, again in INTEGRATE and again on every
+ rerun. With PLUGIN_CACHE_DIR set, the plugin keeps the frames it has
+ decoded (and masked) in a file in that directory, so later passes are a
+ memcpy from the page cache. Pointing it at /dev/shm keeps the frames in
+ memory.
+
+ A dataset has one cache file, named after its master file path, size
+ and modification time; rewriting the master file starts a new cache. The
+ file holds a fixed number of frame slots and is mapped by every process
+ reading the dataset. Slots are claimed with an atomic counter and read
+ under a per-slot sequence number, so no lock is taken.
+
+ XDS reads a dataset front to back, so when it has more frames than
+ slots, a ring overwritten in FIFO order has replaced every frame by the
+ time the next pass wants it again, and no pass ever hits. By default the
+ cache therefore keeps the frames it stored first once it is full
+ (FRAME_CACHE_KEEP): every later pass reads that part of the dataset from
+ the cache. FRAME_CACHE_FIFO replaces the oldest frame instead, which only
+ pays when passes read the same few frames.
+
+ A dataset's file takes at most a share of the directory's size limit (a
+ quarter by default), so that several datasets can be cached side by
+ side. When the cache
+ files of a directory exceed the limit, the files of the least recently
+ opened datasets are deleted, but never one that a process still has
+ open: every user holds a shared flock() on its file.
+*/
+
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_CACHE_KEEP 0 // once full, keep the frames stored first
+#define FRAME_CACHE_FIFO 1 // once full, replace the oldest frame
+
+#define FRAME_CACHE_DEFAULT_SHARE 25 // percent of the limit one dataset may take
+
+typedef struct frame_cache {
+  char path[4096];
+  int fd;          // holds the shared lock that keeps the file from being trimmed
+  void *map;
+  size_t map_size;
+  struct frame_cache_header *header;
+  struct frame_cache_slot *slots;
+  int32_t *index;  // slot + 1 holding each frame, 0 if none
+  char *data;
+  size_t frame_bytes;
+  int nframes;
+  uint32_t nslots;
+  int policy;      // FRAME_CACHE_*
+} frame_cache;
+
+/* Open or create the cache of the dataset whose master file is master.
+ * Frames are numbered from 1 to nframes. limit is the total size in bytes
+ * of all cache files in dir, of which this dataset takes at most share
+ * percent. policy (FRAME_CACHE_*) applies to this process's frame_cache_put
+ * calls. Returns 0, or -1 if the cache cannot be used (it then stays
+ * closed and all calls are no-ops). */
+int frame_cache_open(frame_cache *c, const char *dir, const char *master,
+                     size_t frame_bytes, int nframes, size_t limit, int share, int policy);
+
+/* Copy a frame to out. Returns 1 on a hit, 0 on a miss. */
+int frame_cache_get(frame_cache *c, int frame, void *out);
+
+/* Whether a frame is cached, without copying it */
+int frame_cache_has(frame_cache *c, int frame);
+
+/* Store a frame. If the cache is full, FRAME_CACHE_KEEP drops it and
+ * FRAME_CACHE_FIFO replaces the oldest frame. */
+void frame_cache_put(frame_cache *c, int frame, const void *data);
+
+void frame_cache_close(frame_cache *c);
+
+#endif // FRAME_CACHE_H
@@ -0,0 +1,295 @@
+/*
+ EIGER frame reader
+  Direct chunk access to data_NNNNNN datasets. See frame_reader.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdf5.h"
+#include "frame_reader.h"
+#include "bitshuffle.h"
+#include "bshuf_h5filter.h"
+#include "h5zlz4.h"
+#include "lz4.h"
+
+int chunk_format_query(hid_t data, int xpixels, int ypixels, chunk_format *fmt) {
+  fmt->codec = CHUNK_CODEC_UNSUPPORTED;
+  fmt->elem_size = 0;
+  fmt->block_size = 0;
+  fmt->cd_nelmts = 0;
+  fmt->nelem = (size_t)xpixels * ypixels;
+
+  hid_t dcpl = H5Dget_create_plist(data);
+  if (dcpl < 0) return -1;
+
+  int ret = -1;
+  hsize_t chunk_dims[3];
+  if (H5Pget_layout(dcpl) != H5D_CHUNKED ||
+      H5Pget_chunk(dcpl, 3, chunk_dims) != 3 ||
+      chunk_dims[0] != 1 || chunk_dims[1] != (hsize_t)ypixels || chunk_dims[2] != (hsize_t)xpixels) {
+    goto done; // not one frame per chunk
+  }
+
+  hid_t type = H5Dget_type(data);
+  if (type < 0) goto done;
+  size_t elem_size = H5Tget_size(type);
+  int ok = H5Tget_class(type) == H5T_INTEGER &&
+           H5Tget_sign(type) == H5T_SGN_NONE &&
+           H5Tget_order(type) == H5Tget_order(H5T_NATIVE_UINT) &&
+           (elem_size == 1 || elem_size == 2 || elem_size == 4);
+  H5Tclose(type);
+  if (!ok) goto done;
+  fmt->elem_size = elem_size;
+
+  int nfilters = H5Pget_nfilters(dcpl);
+  if (nfilters == 0) {
+    fmt->codec = CHUNK_CODEC_NONE;
+  } else if (nfilters == 1) {
+    unsigned int flags, config;
+    unsigned int cd_values[16];
+    size_t cd_nelmts = 16;
+    H5Z_filter_t filter = H5Pget_filter2(dcpl, 0, &flags, &cd_nelmts, cd_values, 0, NULL, &config);
+    if (filter == BSHUF_H5FILTER && cd_nelmts >= 3 && cd_values[2] == elem_size) {
+      // cd_values: version major, minor, element size, block size, compression
+      if (cd_nelmts > 3) fmt->block_size = cd_values[3];
+      fmt->cd_nelmts = (cd_nelmts < CHUNK_CD_VALUES) ? cd_nelmts : CHUNK_CD_VALUES;
+      memcpy(fmt->cd_values, cd_values, fmt->cd_nelmts * sizeof(unsigned int));
+      if (cd_nelmts > 4 && cd_values[4] == BSHUF_H5_COMPRESS_LZ4) {
+        fmt->codec = CHUNK_CODEC_BSHUF_LZ4;
+      } else {
+        fmt->codec = CHUNK_CODEC_BSHUF;
+      }
+    } else if (filter == LZ4_FILTER) {
+      fmt->codec = CHUNK_CODEC_LZ4;
+    }
+  }
+  if (fmt->codec != CHUNK_CODEC_UNSUPPORTED) ret = 0;
+
+ done:
+  H5Pclose(dcpl);
+  return ret;
+}
+
+int64_t chunk_read(hid_t data, int frame_in_block, void **buf, size_t *buf_size) {
+  hsize_t offset[3] = {frame_in_block, 0, 0};
+  hsize_t chunk_bytes = 0;
+
+  if (H5Dget_chunk_storage_size(data, offset, &chunk_bytes) < 0 || chunk_bytes == 0) {
+    return -1;
+  }
+  if (*buf == NULL || *buf_size < chunk_bytes) {
+    void *p = realloc(*buf, chunk_bytes);
+    if (p == NULL) return -1;
+    *buf = p;
+    *buf_size = chunk_bytes;
+  }
+
+  uint32_t filter_mask = 0;
+  if (H5Dread_chunk(data, H5P_DEFAULT, offset, &filter_mask, *buf) < 0) {
+    return -1;
+  }
+  // A set bit means the filter was skipped when this chunk was written.
+  // This never happens with EIGER data; let H5Dread deal with it.
+  if (filter_mask != 0) return -1;
+
+  return (int64_t)chunk_bytes;
+}
+
+int64_t chunk_decode(const chunk_format *fmt, const void *in, size_t nbytes,
+                     void *out, size_t out_size) {
+  size_t frame_bytes = fmt->nelem * fmt->elem_size;
+  int64_t ret;
+
+  if (out_size < frame_bytes) return -1;
+
+  switch (fmt->codec) {
+  case CHUNK_CODEC_NONE:
+    if (nbytes != frame_bytes) return -1;
+    memcpy(out, in, frame_bytes);
+    return frame_bytes;
+
+  case CHUNK_CODEC_BSHUF_LZ4:
+  case CHUNK_CODEC_BSHUF:
+    // Straight into out, as the filter would into its own buffer
+    if (bshuf_h5_decompressed_size(fmt->cd_nelmts, fmt->cd_values, in, nbytes) != frame_bytes) return -1;
+    ret = bshuf_h5_decompress(fmt->cd_nelmts, fmt->cd_values, in, nbytes, out, out_size);
+    if (ret < 0) return ret;
+    return frame_bytes;
+
+  case CHUNK_CODEC_LZ4:
+    if (nbytes < 12 || lz4_h5_decompressed_size(in) != frame_bytes) return -1;
+    return lz4_h5_decompress(in, nbytes, out, out_size);
+  }
+  return -1;
+}
+
+int chunk_decodes_i32(const chunk_format *fmt) {
+  return (fmt->codec == CHUNK_CODEC_BSHUF || fmt->codec == CHUNK_CODEC_BSHUF_LZ4) &&
+         (fmt->elem_size == 1 || fmt->elem_size == 2);
+}
+
+int64_t chunk_decode_i32(const chunk_format *fmt, const void *in, size_t nbytes,
+                         int32_t *out, size_t out_n, int64_t error_val) {
+  if (!chunk_decodes_i32(fmt)) return -2;
+  if (out_n < fmt->nelem ||
+      bshuf_h5_decompressed_size(fmt->cd_nelmts, fmt->cd_values, in, nbytes) != fmt->nelem * fmt->elem_size) {
+    return -1;
+  }
+  int64_t ret = bshuf_h5_decompress_i32(fmt->cd_nelmts, fmt->cd_values, in, nbytes, out, out_n, error_val);
+  if (ret < 0) return (ret == -2) ? -1 : ret;
+  return ret;
+}
+
+int chunk_tiles_begin(chunk_tiles *t, const chunk_format *fmt, const void *in, size_t nbytes) {
+  t->fmt = *fmt;
+  t->in = (const char *)in;
+  t->in_left = nbytes;
+  t->pos = 0;
+  t->scratch = NULL;
+
+  switch (fmt->codec) {
+  case CHUNK_CODEC_BSHUF_LZ4:
+    // Header: uncompressed size (uint64 BE) and block size in bytes (uint32 BE)
+    if (nbytes < 12 || bshuf_read_uint64_BE((void *)in) != fmt->nelem * fmt->elem_size) return -1;
+    t->block_size = bshuf_read_uint32_BE((char *)in + 8) / fmt->elem_size;
+    t->in += 12;
+    t->in_left -= 12;
+    break;
+  case CHUNK_CODEC_BSHUF:
+    if (nbytes != fmt->nelem * fmt->elem_size) return -1;
+    t->block_size = fmt->block_size ? fmt->block_size : bshuf_default_block_size(fmt->elem_size);
+    break;
+  default:
+    return -1;
+  }
+  if (t->block_size == 0 || t->block_size % 8 != 0) return -1;
+
+  if (fmt->codec == CHUNK_CODEC_BSHUF_LZ4) {
+    t->scratch = malloc(t->block_size * fmt->elem_size);
+    if (t->scratch == NULL) return -1;
+  }
+  return 0;
+}
+
+int64_t chunk_tiles_next(chunk_tiles *t, void *out) {
+  size_t elem_size = t->fmt.elem_size;
+  size_t left = t->fmt.nelem - t->pos;
+  if (left == 0) return 0;
+
+  // Same block boundaries as bshuf_blocked_wrap_fun()
+  size_t size = (left >= t->block_size) ? t->block_size : left - left % 8;
+  size_t nbytes = size * elem_size;
+
+  if (size == 0) {
+    // Trailing pixels that do not fill a group of 8 are stored as is.
+    nbytes = left * elem_size;
+    if (t->in_left < nbytes) return -1;
+    memcpy(out, t->in, nbytes);
+    t->in += nbytes;
+    t->in_left -= nbytes;
+    t->pos += left;
+    return left;
+  }
+
+  const void *shuffled = t->in;
+  size_t consumed = nbytes;
+  if (t->fmt.codec == CHUNK_CODEC_BSHUF_LZ4) {
+    if (t->in_left < 4) return -1;
+    size_t nbytes_lz4 = bshuf_read_uint32_BE((void *)t->in);
+    if (t->in_left < 4 + nbytes_lz4 ||
+        LZ4_decompress_safe(t->in + 4, (char *)t->scratch, nbytes_lz4, nbytes) != (int)nbytes) {
+      return -1;
+    }
+    shuffled = t->scratch;
+    consumed = 4 + nbytes_lz4;
+  } else if (t->in_left < nbytes) {
+    return -1;
+  }
+  if (bshuf_untrans_bit_elem((void *)shuffled, out, size, elem_size) < 0) return -1;
+
+  t->in += consumed;
+  t->in_left -= consumed;
+  t->pos += size;
+  return size;
+}
+
+void chunk_tiles_end(chunk_tiles *t) {
+  free(t->scratch);
+  t->scratch = NULL;
+}
+
+void block_cache_init(block_cache *bc, hid_t group, int xpixels, int ypixels) {
+  bc->group = group;
+  bc->xpixels = xpixels;
+  bc->ypixels = ypixels;
+  bc->block_number = -1;
+  bc->data = bc->dataspace = bc->memspace = -1;
+  bc->fmt.codec = CHUNK_CODEC_UNSUPPORTED;
+  bc->mem_type = H5T_NATIVE_UINT;
+  bc->elem_size = sizeof(unsigned int);
+}
+
+void block_cache_close(block_cache *bc) {
+  if (bc->dataspace >= 0) H5Sclose(bc->dataspace);
+  if (bc->data >= 0) H5Dclose(bc->data);
+  if (bc->memspace >= 0) H5Sclose(bc->memspace);
+  bc->data = bc->dataspace = bc->memspace = -1;
+  bc->block_number = -1;
+  bc->fmt.codec = CHUNK_CODEC_UNSUPPORTED;
+}
+
+int block_cache_open(block_cache *bc, int block_number) {
+  if (bc->block_number == block_number) return 0;
+
+  if (bc->dataspace >= 0) H5Sclose(bc->dataspace);
+  if (bc->data >= 0) H5Dclose(bc->data);
+  bc->data = bc->dataspace = -1;
+  bc->block_number = -1;
+
+  char data_name[20] = {};
+  snprintf(data_name, 20, "data_%06d", block_number);
+  bc->data = H5Dopen2(bc->group, data_name, H5P_DEFAULT);
+  if (bc->data < 0) return -1;
+  bc->dataspace = H5Dget_space(bc->data);
+  if (H5Sget_simple_extent_ndims(bc->dataspace) != 3) return -2;
+
+  // All blocks have the same frame shape, so the memory space is kept.
+  if (bc->memspace < 0) {
+    hsize_t count[3] = {1, bc->ypixels, bc->xpixels};
+    bc->memspace = H5Screate_simple(3, count, NULL);
+    if (bc->memspace < 0) return -1;
+  }
+
+  chunk_format_query(bc->data, bc->xpixels, bc->ypixels, &bc->fmt);
+
+  // Pixels are read in their stored width. Anything unusual is converted
+  // to unsigned int by libhdf5 as before.
+  bc->mem_type = H5T_NATIVE_UINT;
+  bc->elem_size = sizeof(unsigned int);
+  hid_t type = H5Dget_type(bc->data);
+  if (type >= 0) {
+    if (H5Tget_class(type) == H5T_INTEGER && H5Tget_sign(type) == H5T_SGN_NONE) {
+      switch (H5Tget_size(type)) {
+      case 1: bc->mem_type = H5T_NATIVE_UINT8; bc->elem_size = 1; break;
+      case 2: bc->mem_type = H5T_NATIVE_UINT16; bc->elem_size = 2; break;
+      case 4: bc->mem_type = H5T_NATIVE_UINT32; bc->elem_size = 4; break;
+      }
+    }
+    H5Tclose(type);
+  }
+  bc->block_number = block_number;
+  return 0;
+}
+
+int block_cache_read(block_cache *bc, int frame_in_block, hid_t mem_type, void *buf) {
+  hsize_t offset_in[3] = {frame_in_block, 0, 0};
+  hsize_t count[3] = {1, bc->ypixels, bc->xpixels};
+
+  if (bc->block_number < 0) return -1;
+  if (H5Sselect_hyperslab(bc->dataspace, H5S_SELECT_SET, offset_in, NULL, count, NULL) < 0) {
+    return -2;
+  }
+  return H5Dread(bc->data, mem_type, bc->memspace, bc->dataspace, H5P_DEFAULT, buf);
+}
@@ -0,0 +1,128 @@
+/*
+ EIGER frame reader
+  Direct chunk access to data_NNNNNN datasets.
+
+ Frames written by EIGER are stored one frame per chunk, compressed with
+ bitshuffle/LZ4 (filter 32008) or LZ4 (filter 32004). Instead of going
+ through H5Dread, which runs the filter pipeline and the type conversion
+ under the HDF5 library lock, the compressed chunk is fetched as is with
+ H5Dread_chunk and decoded by the caller with chunk_decode(). Only the
+ fetch needs HDF5; decoding can run concurrently in any number of threads.
+*/
+
+#ifndef FRAME_READER_H
+#define FRAME_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hdf5.h"
+
+/* Codec of a chunk as far as we can decode it ourselves */
+#define CHUNK_CODEC_UNSUPPORTED -1
+#define CHUNK_CODEC_NONE         0
+#define CHUNK_CODEC_BSHUF        1
+#define CHUNK_CODEC_BSHUF_LZ4    2
+#define CHUNK_CODEC_LZ4          3
+
+#define CHUNK_CD_VALUES 8
+
+typedef struct chunk_format {
+  int codec;
+  size_t elem_size;   // bytes per pixel as stored
+  size_t block_size;  // bitshuffle block size in elements (0: default)
+  size_t nelem;       // pixels in a frame
+  size_t cd_nelmts;   // bitshuffle filter parameters, for bshuf_h5_decompress()
+  unsigned int cd_values[CHUNK_CD_VALUES];
+} chunk_format;
+
+/* Inspect the creation properties of a data_NNNNNN dataset.
+ * Returns 0 if frames can be read with chunk_read() and decoded with
+ * chunk_decode(), negative otherwise (fmt->codec is then
+ * CHUNK_CODEC_UNSUPPORTED and the caller should fall back to H5Dread). */
+int chunk_format_query(hid_t data, int xpixels, int ypixels, chunk_format *fmt);
+
+/* Fetch the still compressed chunk holding frame_in_block (0-indexed).
+ * *buf is grown with realloc() when necessary; *buf_size tracks its capacity.
+ * Returns the number of bytes in the chunk or negative on error. */
+int64_t chunk_read(hid_t data, int frame_in_block, void **buf, size_t *buf_size);
+
+/* Decode a chunk fetched by chunk_read() into out, which must hold
+ * fmt->nelem * fmt->elem_size bytes. Does not call HDF5 and, once the
+ * calling thread has decoded a frame, allocates nothing: pass the final
+ * frame buffer or pool slot as out and the frame is decoded exactly once.
+ * Returns the number of bytes written or negative on error. */
+int64_t chunk_decode(const chunk_format *fmt, const void *in, size_t nbytes,
+                     void *out, size_t out_size);
+
+/* Whether chunk_decode_i32() can decode chunks of this format: bitshuffled
+ * 8 or 16 bit pixels. */
+int chunk_decodes_i32(const chunk_format *fmt);
+
+/* Decode a chunk fetched by chunk_read() straight into the 32 bit signed
+ * pixels written to CBF. Pixels are widened block by block while they are
+ * in cache, which saves the buffer of pixels as stored and the full frame
+ * pass of pixel_convert. Pixels equal to error_val become -1; pass a
+ * negative error_val when a mask will be applied instead, as
+ * pixel_convert does. out holds out_n >= fmt->nelem pixels.
+ * Returns the number of pixels, -2 if !chunk_decodes_i32(fmt) or another
+ * negative value on error. */
+int64_t chunk_decode_i32(const chunk_format *fmt, const void *in, size_t nbytes,
+                         int32_t *out, size_t out_n, int64_t error_val);
+
+/* Decoding of a bitshuffle chunk one block at a time.
+ *
+ * A bitshuffle block is 8 KB of pixels, so a tile can be masked and
+ * encoded while it is still in cache instead of going through a full
+ * frame buffer. Tiles come in frame order: full blocks, a last partial
+ * block and then up to 7 pixels stored as is. */
+typedef struct chunk_tiles {
+  chunk_format fmt;
+  const char *in;     // next block in the chunk
+  size_t in_left;     // bytes left in the chunk
+  size_t block_size;  // pixels in a full block: the largest tile
+  size_t pos;         // pixels decoded so far
+  void *scratch;      // LZ4 output of one block
+} chunk_tiles;
+
+/* Returns 0, or -1 if the chunk is not bitshuffled (decode it with
+ * chunk_decode() instead) or is malformed. */
+int chunk_tiles_begin(chunk_tiles *t, const chunk_format *fmt, const void *in, size_t nbytes);
+
+/* Decode the next tile into out, which must hold t->block_size pixels.
+ * Returns the number of pixels decoded, 0 after the last tile or
+ * negative on error. */
+int64_t chunk_tiles_next(chunk_tiles *t, void *out);
+
+void chunk_tiles_end(chunk_tiles *t);
+
+/* Handles of the data_NNNNNN block the last frame came from.
+ *
+ * Consecutive frames almost always live in the same block, so the dataset,
+ * its dataspace, the memory space and the chunk format are looked up once
+ * per block instead of once per frame. A cache must only be used by one
+ * thread at a time. */
+typedef struct block_cache {
+  hid_t group;
+  int xpixels, ypixels;
+  int block_number;   // -1 if nothing is open
+  hid_t data, dataspace, memspace;
+  chunk_format fmt;   // fmt.codec is CHUNK_CODEC_UNSUPPORTED if not directly readable
+  hid_t mem_type;     // native unsigned type matching the stored pixels
+  size_t elem_size;   // its size in bytes
+} block_cache;
+
+void block_cache_init(block_cache *bc, hid_t group, int xpixels, int ypixels);
+
+/* Make block_number the current block, reopening only if it changed.
+ * Returns 0 on success, -1 if the dataset cannot be opened and -2 if it
+ * is not 3 dimensional. */
+int block_cache_open(block_cache *bc, int block_number);
+
+/* Read frame_in_block of the current block through H5Dread, converted
+ * to mem_type. Pass bc->mem_type to read pixels as stored, without
+ * libhdf5's type conversion. Returns a negative value on error. */
+int block_cache_read(block_cache *bc, int frame_in_block, hid_t mem_type, void *buf);
+
+void block_cache_close(block_cache *bc);
+
+#endif // FRAME_READER_H
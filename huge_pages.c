@@ -0,0 +1,113 @@
+/*
+ Frame sized buffers on huge pages. See huge_pages.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "huge_pages.h"
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+/* madvise(MADV_HUGEPAGE) succeeds even when the policy in sysfs
+   ignores it; only claim huge pages if it does not. */
+static int thp_allowed(const char *policy) {
+  char buf[256] = {};
+  FILE *f = fopen(policy, "r");
+  if (f == NULL) return 0;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = 0;
+  return strstr(buf, "[never]") == NULL && strstr(buf, "[deny]") == NULL;
+}
+
+/* Anonymous private mapping aligned to a huge page */
+static void *map_aligned(size_t size) {
+  char *p = (char *)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  size_t head = (HUGE_PAGE_SIZE - (uintptr_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+  if (head > 0) munmap(p, head);
+  munmap(p + head + size, HUGE_PAGE_SIZE - head);
+  return p + head;
+}
+
+static int alloc_private(huge_buffer *b) {
+  void *p = mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    b->ptr = p;
+    b->kind = HUGE_PAGES_TLB;
+    return 0;
+  }
+
+  b->ptr = map_aligned(b->size);
+  if (b->ptr == NULL) return -1;
+  b->kind = (madvise(b->ptr, b->size, MADV_HUGEPAGE) == 0 &&
+             thp_allowed("/sys/kernel/mm/transparent_hugepage/enabled")) ? HUGE_PAGES_THP : HUGE_PAGES_NONE;
+  return 0;
+}
+
+static int alloc_shared(huge_buffer *b) {
+  // A hugetlbfs mapping reserves its pages in mmap(), so a shortage shows
+  // up here and not as SIGBUS later.
+  b->fd = memfd_create("eiger2cbf", MFD_HUGETLB);
+  if (b->fd >= 0) {
+    if (ftruncate(b->fd, b->size) == 0) {
+      b->ptr = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+      if (b->ptr != MAP_FAILED) {
+        b->kind = HUGE_PAGES_TLB;
+        return 0;
+      }
+    }
+    close(b->fd);
+  }
+
+  b->fd = memfd_create("eiger2cbf", 0);
+  if (b->fd < 0) return -1;
+  if (ftruncate(b->fd, b->size) < 0 ||
+      (b->ptr = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0)) == MAP_FAILED) {
+    close(b->fd);
+    b->fd = -1;
+    b->ptr = NULL;
+    return -1;
+  }
+  b->kind = (madvise(b->ptr, b->size, MADV_HUGEPAGE) == 0 &&
+             thp_allowed("/sys/kernel/mm/transparent_hugepage/shmem_enabled")) ? HUGE_PAGES_THP : HUGE_PAGES_NONE;
+  return 0;
+}
+
+int huge_alloc(huge_buffer *b, size_t size, int shared) {
+  b->size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  b->ptr = NULL;
+  b->fd = -1;
+  b->kind = HUGE_PAGES_NONE;
+  if (b->size == 0) b->size = HUGE_PAGE_SIZE;
+
+  if ((shared ? alloc_shared(b) : alloc_private(b)) < 0) {
+    b->ptr = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void huge_free(huge_buffer *b) {
+  if (b->ptr != NULL) munmap(b->ptr, b->size);
+  if (b->fd >= 0) close(b->fd);
+  b->ptr = NULL;
+  b->fd = -1;
+}
+
+const char *huge_pages_name(int kind) {
+  switch (kind) {
+  case HUGE_PAGES_TLB: return "2 MB hugetlbfs pages";
+  case HUGE_PAGES_THP: return "transparent huge pages";
+  default: return "4 KB pages";
+  }
+}
@@ -0,0 +1,47 @@
+/*
+ Frame sized buffers on huge pages.
+
+ A 16M pixel frame of 32 bit values covers about 16,000 4 KB pages, so a
+ pass over it misses the TLB at almost every page. On 2 MB pages it
+ takes 32 entries. huge_alloc() tries, in order:
+
+  - hugetlbfs pages (MAP_HUGETLB, or memfd_create(MFD_HUGETLB) for shared
+    buffers), which exist only if the administrator reserved them,
+  - transparent huge pages, requested with madvise(MADV_HUGEPAGE) on a
+    2 MB aligned mapping,
+  - normal pages.
+
+ Only our own code writes into these buffers: libhdf5 has been seen to
+ crash on hugetlbfs memory, so frames are filled through the direct chunk
+ path (frame_reader.h), or read by H5Dread into a normal buffer first.
+*/
+
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+#define HUGE_PAGES_NONE 0 // normal pages
+#define HUGE_PAGES_TLB  1 // hugetlbfs
+#define HUGE_PAGES_THP  2 // transparent huge pages, if the kernel finds them
+
+typedef struct huge_buffer {
+  void *ptr;
+  size_t size;  // mapped bytes, a multiple of HUGE_PAGE_SIZE
+  int kind;     // HUGE_PAGES_*
+  int fd;       // shared buffers: memfd to hand to other processes, else -1
+} huge_buffer;
+
+/* Map at least size bytes, zero filled. With shared, the memory is a
+ * memfd that can be mapped by other processes through b->fd (it is
+ * inherited across fork and exec). Returns 0, or -1 with b->ptr NULL. */
+int huge_alloc(huge_buffer *b, size_t size, int shared);
+
+void huge_free(huge_buffer *b);
+
+/* "2 MB hugetlbfs pages", ... for reports */
+const char *huge_pages_name(int kind);
+
+#endif // HUGE_PAGES_H
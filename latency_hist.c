@@ -0,0 +1,103 @@
+/*
+ Latency histograms. See latency_hist.h.
+*/
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#include "latency_hist.h"
+
+#define SUB_COUNT (1 << LATENCY_HIST_SUB_BITS)
+
+uint64_t latency_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+  if (ns < SUB_COUNT) return (int)ns;
+  int e = 63 - __builtin_clzll(ns);
+  if (e >= LATENCY_HIST_MAX_BITS) return LATENCY_HIST_BUCKETS - 1;
+  int sub = (ns >> (e - LATENCY_HIST_SUB_BITS)) & (SUB_COUNT - 1);
+  return ((e - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS) + sub;
+}
+
+/* The middle of a bucket */
+static uint64_t value_of(int bucket) {
+  if (bucket < SUB_COUNT) return bucket;
+  int e = (bucket >> LATENCY_HIST_SUB_BITS) + LATENCY_HIST_SUB_BITS - 1;
+  int sub = bucket & (SUB_COUNT - 1);
+  uint64_t width = (uint64_t)1 << (e - LATENCY_HIST_SUB_BITS);
+  return (uint64_t)(SUB_COUNT + sub) * width + width / 2;
+}
+
+void latency_hist_record(latency_hist *h, uint64_t ns) {
+  h->buckets[bucket_of(ns)]++;
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max) h->max = ns;
+}
+
+void latency_hist_record_atomic(latency_hist *h, uint64_t ns) {
+  __sync_fetch_and_add(&h->buckets[bucket_of(ns)], 1);
+  __sync_fetch_and_add(&h->count, 1);
+  __sync_fetch_and_add(&h->sum, ns);
+  uint64_t max = h->max;
+  while (ns > max && !__sync_bool_compare_and_swap(&h->max, max, ns)) max = h->max;
+}
+
+void latency_hist_merge(latency_hist *into, const latency_hist *h) {
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) into->buckets[i] += h->buckets[i];
+  into->count += h->count;
+  into->sum += h->sum;
+  if (h->max > into->max) into->max = h->max;
+}
+
+uint64_t latency_hist_percentile(const latency_hist *h, double p) {
+  if (h->count == 0) return 0;
+  uint64_t rank = (uint64_t)(p * h->count + 0.5);
+  if (rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t v = value_of(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+static double mean_us(const latency_hist *h) {
+  return h->count > 0 ? 1E-3 * h->sum / h->count : 0;
+}
+
+void latency_hist_report(const latency_hist *h, const char *name, FILE *out) {
+  fprintf(out, " %-10s %8llu  mean %9.1f  p50 %9.1f  p99 %9.1f  max %9.1f us\n",
+          name, (unsigned long long)h->count, mean_us(h),
+          1E-3 * latency_hist_percentile(h, 0.5), 1E-3 * latency_hist_percentile(h, 0.99), 1E-3 * h->max);
+}
+
+void latency_hist_print(const latency_hist *h, FILE *out) {
+  fprintf(out, " %12s %12s %10s\n", "Value (us)", "Percentile", "TotalCount");
+  if (h->count == 0) return;
+  double p = 0.5, step = 0.5;
+  while (1) {
+    uint64_t rank = (uint64_t)(p * h->count + 0.5);
+    fprintf(out, " %12.1f %12.6f %10llu\n", 1E-3 * latency_hist_percentile(h, p), p, (unsigned long long)rank);
+    if (rank >= h->count) break;
+    step /= 2;
+    p += step;
+  }
+  if (p < 1) fprintf(out, " %12.1f %12.6f %10llu\n", 1E-3 * h->max, 1.0, (unsigned long long)h->count);
+}
+
+void latency_hist_json(const latency_hist *h, FILE *out) {
+  fprintf(out, "{\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+          "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+          (unsigned long long)h->count, mean_us(h),
+          1E-3 * latency_hist_percentile(h, 0.5), 1E-3 * latency_hist_percentile(h, 0.9),
+          1E-3 * latency_hist_percentile(h, 0.99), 1E-3 * latency_hist_percentile(h, 0.999),
+          1E-3 * h->max);
+}
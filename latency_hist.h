@@ -0,0 +1,50 @@
+/*
+ Latency histograms in the manner of HdrHistogram.
+
+ Values are nanoseconds. Buckets are linear within each power of two, 32
+ of them, so every recorded value is known to within about 3% whatever
+ its magnitude, and a histogram is a fixed 9 KB array that never has to
+ be resized. Recording is an index computation and an increment; the
+ _atomic variant may be called by several threads on the same histogram.
+*/
+
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define LATENCY_HIST_SUB_BITS 5
+#define LATENCY_HIST_MAX_BITS 40 // about 18 minutes; larger values are clamped
+#define LATENCY_HIST_BUCKETS ((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS)
+
+typedef struct latency_hist {
+  uint64_t count;
+  uint64_t sum; // ns
+  uint64_t max; // ns
+  uint64_t buckets[LATENCY_HIST_BUCKETS];
+} latency_hist;
+
+/* Monotonic clock in nanoseconds, comparable between processes */
+uint64_t latency_now(void);
+
+void latency_hist_record(latency_hist *h, uint64_t ns);
+void latency_hist_record_atomic(latency_hist *h, uint64_t ns);
+
+/* into += h */
+void latency_hist_merge(latency_hist *into, const latency_hist *h);
+
+/* Value below which the fraction p (0 to 1) of the records lies, in ns */
+uint64_t latency_hist_percentile(const latency_hist *h, double p);
+
+/* One line: count, mean, median, 99th percentile and maximum */
+void latency_hist_report(const latency_hist *h, const char *name, FILE *out);
+
+/* Percentile distribution, halving the distance to 100% on every line
+ * like HdrHistogram's outputPercentileDistribution */
+void latency_hist_print(const latency_hist *h, FILE *out);
+
+/* A JSON object with count, mean and percentiles in microseconds */
+void latency_hist_json(const latency_hist *h, FILE *out);
+
+#endif // LATENCY_HIST_H
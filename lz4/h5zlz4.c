@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "lz4.h"
+#include "h5zlz4.h"
 #include <H5PLextern.h>
 //#include <netinet/in.h>
 
@@ -12,8 +13,6 @@
 #define INT32_MAX   0x7fffffffL  /// 2GB
 #endif
 
-#define LZ4_FILTER 32004
-
 /// conversion macros: BE -> host, and host -> BE
 #if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__APPLE__) || defined(__MACH__) || defined(__unix)
 #include <arpa/inet.h>
@@ -34,6 +33,86 @@
 
 #define DEFAULT_BLOCK_SIZE 1<<30; /* 1GB. LZ4 needs blocks < 1.9GB. */
 
+/* Size of the data stored in an lz4 filtered chunk, read from its header. */
+uint64_t lz4_h5_decompressed_size(const void *in)
+{
+  const uint64_t * const i64Buf = (const uint64_t *) in;
+  return (uint64_t)(be64toht(*i64Buf));
+}
+
+/* Decode an lz4 filtered chunk *in* of *nbytes* bytes into the caller's
+ * buffer *out*, which must hold at least lz4_h5_decompressed_size(in) bytes.
+ * Returns the number of bytes written or a negative value on error. */
+int64_t lz4_h5_decompress(const void *in, size_t nbytes, void *out, size_t out_size)
+{
+  const char* rpos = (const char*)in; /* pointer to current read position */
+  const char* const rend = rpos + nbytes;
+
+  if(nbytes < 12)
+    {
+      fprintf(stderr, "lz4 chunk too short: %zu bytes\n", nbytes);
+      return -1;
+    }
+
+  const uint64_t origSize = lz4_h5_decompressed_size(rpos);
+  rpos += 8; /* advance the pointer */
+
+  const uint32_t *i32Buf = (const uint32_t*)rpos;
+  uint32_t blockSize = (uint32_t)(be32toht(*i32Buf));
+  rpos += 4;
+  if(blockSize>origSize)
+    blockSize = origSize;
+
+  if(origSize > out_size)
+    return -1;
+  if(blockSize == 0 && origSize > 0)
+    {
+      fprintf(stderr, "lz4 chunk has a block size of 0\n");
+      return -1;
+    }
+
+  char *roBuf = (char*)out;   /* pointer to current write position */
+  uint64_t decompSize     = 0;
+  /// start with the first block ///
+  while(decompSize < origSize)
+    {
+
+      if(origSize-decompSize < blockSize) /* the last block can be smaller than blockSize. */
+	blockSize = origSize-decompSize;
+      if(rend - rpos < 4)
+	{
+	  fprintf(stderr, "lz4 chunk truncated at block header\n");
+	  return -1;
+	}
+      i32Buf = (const uint32_t*)rpos;
+      uint32_t compressedBlockSize =  be32toht(*i32Buf);  /// is saved in be format
+      rpos += 4;
+      if(compressedBlockSize > (size_t)(rend - rpos) || compressedBlockSize > INT32_MAX)
+	{
+	  fprintf(stderr, "lz4 block of %u bytes runs past the end of the chunk\n", compressedBlockSize);
+	  return -1;
+	}
+      if(compressedBlockSize == blockSize) /* there was no compression */
+	{
+	  memcpy(roBuf, rpos, blockSize);
+	}
+      else /* do the decompression */
+	{
+	  int decompressedBytes = LZ4_decompress_safe(rpos, roBuf, (int)compressedBlockSize, (int)blockSize);
+	  if(decompressedBytes != (int)blockSize)
+	    {
+	      fprintf(stderr, "decompressed size not the same: %d, != %u\n", decompressedBytes, blockSize);
+	      return -1;
+	    }
+	}
+
+      rpos += compressedBlockSize;   /* advance the read pointer to the next block */
+      roBuf += blockSize;            /* advance the write pointer */
+      decompSize += blockSize;
+    }
+  return (int64_t)origSize;
+}
+
 static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,  
 			 const unsigned int cd_values[], size_t nbytes,
 			 size_t *buf_size, void **buf)
@@ -43,53 +122,17 @@ static size_t lz4_filter(unsigned int flags, size_t cd_nelmts,
   
   if (flags & H5Z_FLAG_REVERSE)
     {
-      const char* rpos = (char*)*buf; /* pointer to current read position */
+      if (nbytes < 12)
+	goto error;
+      const uint64_t origSize = lz4_h5_decompressed_size(*buf);
 
-      
-      const uint64_t * const i64Buf = (uint64_t *) rpos;
-      const uint64_t origSize = (uint64_t)(be64toht(*i64Buf));/* is saved in be format */
-      rpos += 8; /* advance the pointer */
-      
-      uint32_t *i32Buf = (uint32_t*)rpos;
-      uint32_t blockSize = (uint32_t)(be32toht(*i32Buf));
-      rpos += 4;
-      if(blockSize>origSize)
-	blockSize = origSize;
-      
       if (NULL==(outBuf = malloc(origSize)))
 	{
 	  printf("cannot malloc\n");
 	  goto error;
 	}
-      char *roBuf = (char*)outBuf;   /* pointer to current write position */      
-      uint64_t decompSize     = 0;
-      /// start with the first block ///
-           while(decompSize < origSize)
-	{
-
-	  if(origSize-decompSize < blockSize) /* the last block can be smaller than blockSize. */
-	    blockSize = origSize-decompSize;
-	  i32Buf = (uint32_t*)rpos;
-	  uint32_t compressedBlockSize =  be32toht(*i32Buf);  /// is saved in be format
-	  rpos += 4;
-	  if(compressedBlockSize == blockSize) /* there was no compression */
-	    {
-	      memcpy(roBuf, rpos, blockSize);
-	    }
-	  else /* do the decompression */
-	    {
-	      int compressedBytes = LZ4_uncompress(rpos, roBuf, blockSize); 
-	      if(compressedBytes != compressedBlockSize)
-		{
-		  printf("decompressed size not the same: %d, != %d\n", compressedBytes, compressedBlockSize);
-		  goto error;
-		}
-	    }
-	  
-	  rpos += compressedBlockSize;   /* advance the read pointer to the next block */
-	  roBuf += blockSize;            /* advance the write pointer */
-	  decompSize += blockSize;
-	}
+      if (lz4_h5_decompress(*buf, nbytes, outBuf, origSize) < 0)
+	goto error;
       free(*buf);
       *buf = outBuf;
       outBuf = NULL;
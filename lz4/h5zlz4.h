@@ -0,0 +1,19 @@
+/* lz4 HDF5 filter (32004): decoding a chunk outside the filter pipeline. */
+
+#ifndef H5ZLZ4_H
+#define H5ZLZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_FILTER 32004
+
+/* Size of the data stored in an lz4 filtered chunk, read from its header. */
+uint64_t lz4_h5_decompressed_size(const void *in);
+
+/* Decode an lz4 filtered chunk *in* of *nbytes* bytes into the caller's
+ * buffer *out*, which must hold at least lz4_h5_decompressed_size(in) bytes.
+ * Returns the number of bytes written or a negative value on error. */
+int64_t lz4_h5_decompress(const void *in, size_t nbytes, void *out, size_t out_size);
+
+#endif
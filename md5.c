@@ -0,0 +1,127 @@
+/*
+ MD5 message digest (RFC 1321). See md5.h.
+*/
+
+#include <string.h>
+
+#include "md5.h"
+
+#define ROTL(x, c) (((x) << (c)) | ((x) >> (32 - (c))))
+
+static const uint32_t md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_transform(uint32_t state[4], const unsigned char *p) {
+  uint32_t w[16];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[4 * i] | ((uint32_t)p[4 * i + 1] << 8) |
+           ((uint32_t)p[4 * i + 2] << 16) | ((uint32_t)p[4 * i + 3] << 24);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  for (int i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7 * i) % 16;
+    }
+    uint32_t tmp = d;
+    d = c;
+    c = b;
+    b = b + ROTL(a + f + md5_k[i] + w[g], md5_r[i]);
+    a = tmp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+void md5_init(md5_ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->nbytes = 0;
+}
+
+void md5_update(md5_ctx *ctx, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t used = ctx->nbytes % 64;
+
+  ctx->nbytes += len;
+  if (used > 0) {
+    size_t fill = 64 - used;
+    if (len < fill) {
+      memcpy(ctx->block + used, p, len);
+      return;
+    }
+    memcpy(ctx->block + used, p, fill);
+    md5_transform(ctx->state, ctx->block);
+    p += fill;
+    len -= fill;
+  }
+  for (; len >= 64; p += 64, len -= 64) {
+    md5_transform(ctx->state, p);
+  }
+  memcpy(ctx->block, p, len);
+}
+
+void md5_final(md5_ctx *ctx, unsigned char digest[16]) {
+  uint64_t nbits = ctx->nbytes * 8;
+  unsigned char pad[72] = {0x80};
+  size_t used = ctx->nbytes % 64;
+  size_t npad = (used < 56) ? 56 - used : 120 - used;
+
+  for (int i = 0; i < 8; i++) {
+    pad[npad + i] = (unsigned char)(nbits >> (8 * i));
+  }
+  md5_update(ctx, pad, npad + 8);
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      digest[4 * i + j] = (unsigned char)(ctx->state[i] >> (8 * j));
+    }
+  }
+}
+
+void md5_base64(const unsigned char digest[16], char out[25]) {
+  static const char table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int o = 0;
+
+  for (int i = 0; i < 16; i += 3) {
+    uint32_t v = (uint32_t)digest[i] << 16;
+    if (i + 1 < 16) v |= (uint32_t)digest[i + 1] << 8;
+    if (i + 2 < 16) v |= digest[i + 2];
+    out[o++] = table[(v >> 18) & 63];
+    out[o++] = table[(v >> 12) & 63];
+    out[o++] = (i + 1 < 16) ? table[(v >> 6) & 63] : '=';
+    out[o++] = (i + 2 < 16) ? table[v & 63] : '=';
+  }
+  out[o] = '\0';
+}
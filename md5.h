@@ -0,0 +1,24 @@
+/*
+ MD5 message digest (RFC 1321), used for the Content-MD5 field of CBF files.
+*/
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct md5_ctx {
+  uint32_t state[4];
+  uint64_t nbytes;
+  unsigned char block[64];
+} md5_ctx;
+
+void md5_init(md5_ctx *ctx);
+void md5_update(md5_ctx *ctx, const void *data, size_t len);
+void md5_final(md5_ctx *ctx, unsigned char digest[16]);
+
+/* Digest as 24 characters of base64, as in MIME headers (plus a NUL) */
+void md5_base64(const unsigned char digest[16], char out[25]);
+
+#endif // MD5_H
@@ -0,0 +1,329 @@
+/*
+ Native miniCBF writer. See minicbf.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "minicbf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MINICBF_X86
+#include <immintrin.h>
+#endif
+
+#define MINICBF_PADDING 4095
+
+/* minicbf_append() encodes this many pixels at a time, so that the buffer
+ * only needs CBF_BYTE_OFFSET_BOUND of a piece beyond the data so far. */
+#define MINICBF_APPEND_PIECE 65536
+
+static const char minicbf_trailer[] = "\n--CIF-BINARY-FORMAT-SECTION----\n;\n\n";
+
+/* One pixel: the delta if it fits in a byte, otherwise escapes to wider
+ * fields (0x80, then 0x8000, then 0x80000000) followed by the delta. */
+static inline unsigned char *byte_offset_put(unsigned char *p, int64_t delta) {
+  if (delta >= -127 && delta <= 127) {
+    *p++ = (unsigned char)delta;
+    return p;
+  }
+  *p++ = 0x80;
+  if (delta >= -32767 && delta <= 32767) {
+    p[0] = (unsigned char)delta;
+    p[1] = (unsigned char)(delta >> 8);
+    return p + 2;
+  }
+  p[0] = 0x00;
+  p[1] = 0x80;
+  p += 2;
+  if (delta >= -2147483647LL && delta <= 2147483647LL) {
+    for (int b = 0; b < 4; b++) p[b] = (unsigned char)(delta >> (8 * b));
+    return p + 4;
+  }
+  p[0] = p[1] = p[2] = 0x00;
+  p[3] = 0x80;
+  p += 4;
+  for (int b = 0; b < 8; b++) p[b] = (unsigned char)(delta >> (8 * b));
+  return p + 8;
+}
+
+static size_t byte_offset_encode_scalar(const int32_t *in, size_t n, int32_t *prev, unsigned char *out) {
+  unsigned char *p = out;
+  int64_t last = *prev;
+
+  for (size_t i = 0; i < n; i++) {
+    p = byte_offset_put(p, (int64_t)in[i] - last);
+    last = in[i];
+  }
+  *prev = (int32_t)last;
+  return p - out;
+}
+
+#ifdef MINICBF_X86
+
+/* The vector kernels compute the deltas of a group of pixels with 32 bit
+ * lanes. When all pixels of the group and the one before lie within
+ * +-2^30, no delta overflows; when in addition all deltas fit in a byte,
+ * which is the case for most pixels of a diffraction image, the group is
+ * written with one store. Other groups go through byte_offset_put(). */
+
+__attribute__((target("sse2")))
+static size_t byte_offset_encode_sse2(const int32_t *in, size_t n, int32_t *prev, unsigned char *out) {
+  const __m128i bias = _mm_set1_epi32(0x40000000);
+  const __m128i lo = _mm_set1_epi32(-128), hi = _mm_set1_epi32(128);
+  unsigned char *p = out;
+  int32_t last = *prev;
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i before = _mm_or_si128(_mm_slli_si128(v, 4), _mm_cvtsi32_si128(last));
+    __m128i delta = _mm_sub_epi32(v, before);
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi32(delta, lo), _mm_cmplt_epi32(delta, hi));
+    __m128i wide = _mm_or_si128(_mm_add_epi32(v, bias), _mm_add_epi32(before, bias));
+    if (_mm_movemask_ps(_mm_castsi128_ps(ok)) == 0xf && _mm_movemask_ps(_mm_castsi128_ps(wide)) == 0) {
+      __m128i words = _mm_packs_epi32(delta, delta);
+      __m128i bytes = _mm_packs_epi16(words, words);
+      int32_t packed = _mm_cvtsi128_si32(bytes);
+      memcpy(p, &packed, 4);
+      p += 4;
+    } else {
+      for (int k = 0; k < 4; k++) {
+        p = byte_offset_put(p, (int64_t)in[i + k] - (k ? in[i + k - 1] : last));
+      }
+    }
+    last = in[i + 3];
+  }
+  *prev = last;
+  return (p - out) + byte_offset_encode_scalar(in + i, n - i, prev, p);
+}
+
+__attribute__((target("avx2")))
+static size_t byte_offset_encode_avx2(const int32_t *in, size_t n, int32_t *prev, unsigned char *out) {
+  const __m256i bias = _mm256_set1_epi32(0x40000000);
+  const __m256i lo = _mm256_set1_epi32(-128), hi = _mm256_set1_epi32(128);
+  const __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+  // low byte of each lane to the bottom of its 128 bit half, then both halves together
+  const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i combine = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+  unsigned char *p = out;
+  int32_t last = *prev;
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i before = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(v, rotate), _mm256_set1_epi32(last), 1);
+    __m256i delta = _mm256_sub_epi32(v, before);
+    __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi32(delta, lo), _mm256_cmpgt_epi32(hi, delta));
+    __m256i wide = _mm256_or_si256(_mm256_add_epi32(v, bias), _mm256_add_epi32(before, bias));
+    if (_mm256_movemask_ps(_mm256_castsi256_ps(ok)) == 0xff && _mm256_movemask_ps(_mm256_castsi256_ps(wide)) == 0) {
+      __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(delta, gather), combine);
+      _mm_storel_epi64((__m128i *)p, _mm256_castsi256_si128(bytes));
+      p += 8;
+    } else {
+      for (int k = 0; k < 8; k++) {
+        p = byte_offset_put(p, (int64_t)in[i + k] - (k ? in[i + k - 1] : last));
+      }
+    }
+    last = in[i + 7];
+  }
+  *prev = last;
+  return (p - out) + byte_offset_encode_scalar(in + i, n - i, prev, p);
+}
+
+#endif // MINICBF_X86
+
+typedef size_t (*byte_offset_fn)(const int32_t *in, size_t n, int32_t *prev, unsigned char *out);
+
+static byte_offset_fn byte_offset_kernel = byte_offset_encode_scalar;
+static const char *byte_offset_isa = "scalar";
+static pthread_once_t byte_offset_once = PTHREAD_ONCE_INIT;
+
+static void byte_offset_select(void) {
+#ifdef MINICBF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    byte_offset_kernel = byte_offset_encode_avx2;
+    byte_offset_isa = "AVX2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    byte_offset_kernel = byte_offset_encode_sse2;
+    byte_offset_isa = "SSE2";
+  }
+#endif
+}
+
+size_t cbf_byte_offset_encode(const int32_t *in, size_t n, int32_t *prev, unsigned char *out) {
+  pthread_once(&byte_offset_once, byte_offset_select);
+  return byte_offset_kernel(in, n, prev, out);
+}
+
+const char *cbf_byte_offset_isa(void) {
+  pthread_once(&byte_offset_once, byte_offset_select);
+  return byte_offset_isa;
+}
+
+static int minicbf_reserve(minicbf *c, size_t extra) {
+  size_t need = MINICBF_RESERVE + c->data_size + extra;
+  if (need <= c->capacity) return 0;
+
+  size_t capacity = c->capacity * 2;
+  if (capacity < need) capacity = need;
+  char *p = (char *)realloc(c->buf, capacity);
+  if (p == NULL) return -1;
+  c->buf = p;
+  c->capacity = capacity;
+  return 0;
+}
+
+void minicbf_init(minicbf *c) {
+  memset(c, 0, sizeof(*c));
+}
+
+int minicbf_begin(minicbf *c, size_t nelem_hint) {
+  c->data_size = 0;
+  c->nelem = 0;
+  c->prev = 0;
+  md5_init(&c->md5);
+  if (c->buf != NULL) return 0;
+
+  // Diffraction images usually need less than 2 bytes per pixel.
+  c->capacity = MINICBF_RESERVE + nelem_hint * 2 + MINICBF_PADDING + sizeof(minicbf_trailer);
+  c->buf = (char *)malloc(c->capacity);
+  if (c->buf == NULL) c->capacity = 0;
+  return (c->buf == NULL) ? -1 : 0;
+}
+
+int minicbf_append(minicbf *c, const int32_t *pixels, size_t n) {
+  while (n > 0) {
+    size_t piece = (n < MINICBF_APPEND_PIECE) ? n : MINICBF_APPEND_PIECE;
+    if (minicbf_reserve(c, CBF_BYTE_OFFSET_BOUND(piece)) < 0) return -1;
+
+    unsigned char *out = (unsigned char *)c->buf + MINICBF_RESERVE + c->data_size;
+    size_t nbytes = cbf_byte_offset_encode(pixels, piece, &c->prev, out);
+    md5_update(&c->md5, out, nbytes);
+    c->data_size += nbytes;
+    c->nelem += piece;
+    pixels += piece;
+    n -= piece;
+  }
+  return 0;
+}
+
+int minicbf_header_init(minicbf_header *h, const char *written_by,
+                        const char *contents_head, const char *contents_tail,
+                        int xpixels, int ypixels) {
+  h->nelem = (size_t)xpixels * ypixels;
+  h->text = (char *)malloc(MINICBF_RESERVE);
+  if (h->text == NULL) return -1;
+
+  // Everything in front of the data, ending with the binary section marker.
+  // The variable fields are left as \1 and cut out below.
+  // header_contents starts and ends with a newline.
+  int len = snprintf(h->text, MINICBF_RESERVE,
+                     "###CBF: VERSION 1.5\n"
+                     "# CBF file written by %s\n"
+                     "\n"
+                     "data_image_1\n"
+                     "\n"
+                     "_array_data.header_convention \"SLS_1.0\"\n"
+                     "_array_data.header_contents\n"
+                     ";%s\1%s;\n"
+                     "\n"
+                     "_array_data.data\n"
+                     ";\n"
+                     "--CIF-BINARY-FORMAT-SECTION--\n"
+                     "Content-Type: application/octet-stream;\n"
+                     "     conversions=\"x-CBF_BYTE_OFFSET\"\n"
+                     "Content-Transfer-Encoding: BINARY\n"
+                     "X-Binary-Size: \1\n"
+                     "X-Binary-ID: 1\n"
+                     "X-Binary-Element-Type: \"signed 32-bit integer\"\n"
+                     "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\n"
+                     "Content-MD5: \1\n"
+                     "X-Binary-Number-of-Elements: %zu\n"
+                     "X-Binary-Size-Fastest-Dimension: %d\n"
+                     "X-Binary-Size-Second-Dimension: %d\n"
+                     "X-Binary-Size-Padding: %d\n"
+                     "\n"
+                     "\x0c\x1a\x04\xd5",
+                     written_by, contents_head, contents_tail, h->nelem, xpixels, ypixels, MINICBF_PADDING);
+  if (len < 0 || len >= MINICBF_RESERVE) {
+    minicbf_header_free(h);
+    return -1;
+  }
+
+  // Split at the variable fields. The parts stay back to back in h->text.
+  const char *part = h->text;
+  char *dst = h->text;
+  for (int i = 0; i < 4; i++) {
+    const char *mark = (i < 3) ? strchr(part, '\1') : h->text + len;
+    if (mark == NULL) {
+      minicbf_header_free(h);
+      return -1;
+    }
+    h->part_len[i] = mark - part;
+    memmove(dst, part, h->part_len[i]);
+    dst += h->part_len[i];
+    part = mark + 1;
+  }
+  return 0;
+}
+
+void minicbf_header_free(minicbf_header *h) {
+  free(h->text);
+  h->text = NULL;
+}
+
+int minicbf_finish(minicbf *c, const minicbf_header *h, double start_angle,
+                   char **buf, size_t *size) {
+  if (c->nelem != h->nelem) return -1;
+  if (minicbf_reserve(c, MINICBF_PADDING + sizeof(minicbf_trailer)) < 0) return -1;
+
+  unsigned char digest[16];
+  char fields[3][32];
+  size_t field_len[3];
+  md5_final(&c->md5, digest);
+  field_len[0] = snprintf(fields[0], sizeof(fields[0]), "%f", start_angle);
+  field_len[1] = snprintf(fields[1], sizeof(fields[1]), "%zu", c->data_size);
+  md5_base64(digest, fields[2]);
+  field_len[2] = 24;
+
+  size_t len = h->part_len[0] + h->part_len[1] + h->part_len[2] + h->part_len[3];
+  for (int i = 0; i < 3; i++) {
+    if (field_len[i] >= sizeof(fields[i])) return -1;
+    len += field_len[i];
+  }
+  if (len > MINICBF_RESERVE) return -1;
+
+  // Fixed parts and variable fields alternate in front of the data.
+  char *dst = c->buf + MINICBF_RESERVE - len;
+  const char *part = h->text;
+  for (int i = 0; i < 4; i++) {
+    memcpy(dst, part, h->part_len[i]);
+    dst += h->part_len[i];
+    part += h->part_len[i];
+    if (i < 3) {
+      memcpy(dst, fields[i], field_len[i]);
+      dst += field_len[i];
+    }
+  }
+  char *tail = c->buf + MINICBF_RESERVE + c->data_size;
+  memset(tail, 0, MINICBF_PADDING);
+  memcpy(tail + MINICBF_PADDING, minicbf_trailer, sizeof(minicbf_trailer) - 1);
+
+  size_t file_size = len + c->data_size + MINICBF_PADDING + sizeof(minicbf_trailer) - 1;
+  *buf = (char *)malloc(file_size);
+  if (*buf == NULL) return -1;
+  memcpy(*buf, c->buf + MINICBF_RESERVE - len, file_size);
+  *size = file_size;
+  return 0;
+}
+
+void minicbf_free(minicbf *c) {
+  free(c->buf);
+  c->buf = NULL;
+  c->capacity = 0;
+}
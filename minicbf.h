@@ -0,0 +1,84 @@
+/*
+ Native miniCBF writer.
+
+ Writes the same file layout as CBFlib's cbf_write_file() with
+ MSG_DIGEST | MIME_HEADERS | PAD_4K for a single byte-offset compressed
+ image: CIF preamble, SLS_1.0 header_contents, the MIME header of the
+ binary section, the compressed pixels and 4095 bytes of padding.
+
+ Pixels are appended a tile at a time with minicbf_append(), which
+ compresses them and updates the MD5 digest while the tile is still in
+ cache. The compressed data is written right after a reserved area; the
+ text in front of it is filled in by minicbf_finish() once the size and
+ the digest are known. The buffer is kept from one file to the next, so
+ a worker grows one buffer to the largest frame it sees; minicbf_finish()
+ hands out a copy of the finished file.
+*/
+
+#ifndef MINICBF_H
+#define MINICBF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "md5.h"
+
+/* Room reserved in front of the data for the text part of the file */
+#define MINICBF_RESERVE 8192
+
+typedef struct minicbf {
+  char *buf;
+  size_t capacity;
+  size_t data_size;  // compressed bytes after MINICBF_RESERVE
+  size_t nelem;      // pixels appended so far
+  int32_t prev;      // last pixel, for the byte offset deltas
+  md5_ctx md5;
+} minicbf;
+
+/* Bytes the byte offset encoding of n pixels can take at most */
+#define CBF_BYTE_OFFSET_BOUND(n) ((n) * 15)
+
+/* CBF byte offset compression of n pixels. *prev is the pixel before in[0]
+ * (0 at the start of an image) and is updated to in[n - 1].
+ * Returns the number of bytes written to out. */
+size_t cbf_byte_offset_encode(const int32_t *in, size_t n, int32_t *prev, unsigned char *out);
+
+/* Instruction set of the byte offset encoder picked at runtime */
+const char *cbf_byte_offset_isa(void);
+
+/* Set up a writer without a buffer */
+void minicbf_init(minicbf *c);
+
+/* Start a file. nelem_hint: expected number of pixels, used to size the
+ * buffer the first time. Returns 0 or -1 if memory could not be allocated. */
+int minicbf_begin(minicbf *c, size_t nelem_hint);
+
+/* Compress and append n pixels. Returns 0 or -1 on allocation failure. */
+int minicbf_append(minicbf *c, const int32_t *pixels, size_t n);
+
+/* The text in front of the data, rendered once per dataset. Only the
+ * Start_angle value, X-Binary-Size and Content-MD5 change from frame to
+ * frame; minicbf_finish() copies the fixed parts and patches these in. */
+typedef struct minicbf_header {
+  char *text;         // the fixed parts, back to back
+  size_t part_len[4]; // lengths of the parts around the 3 variable fields
+  size_t nelem;
+} minicbf_header;
+
+/* contents_head and contents_tail are the SLS_1.0 header_contents before
+ * and after the Start_angle value. written_by goes into the
+ * "# CBF file written by" line. Returns 0 or -1. */
+int minicbf_header_init(minicbf_header *h, const char *written_by,
+                        const char *contents_head, const char *contents_tail,
+                        int xpixels, int ypixels);
+void minicbf_header_free(minicbf_header *h);
+
+/* Complete the file with the header h and the start angle of this frame.
+ * On success *buf holds a malloc()ed copy of the file of *size bytes.
+ * Returns 0 or -1. */
+int minicbf_finish(minicbf *c, const minicbf_header *h, double start_angle,
+                   char **buf, size_t *size);
+
+/* Release the buffer */
+void minicbf_free(minicbf *c);
+
+#endif // MINICBF_H
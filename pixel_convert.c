@@ -0,0 +1,171 @@
+/*
+ Conversion of raw EIGER pixels to signed 32 bit values. See pixel_convert.h.
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include "pixel_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+/* Generate the masked and unmasked kernels for one stored pixel type.
+ * The loops are written without branches so that compilers vectorize them. */
+#define DEFINE_PIXEL_CONVERT(bits, type_t)                                  \
+  static void convert_mask_u##bits(const void *in, int32_t *out, size_t n,  \
+                                   size_t first, const mask_runs *mask,     \
+                                   uint32_t error_val) {                    \
+    const type_t *in_t = (const type_t *)in;                                \
+    for (size_t i = 0; i < n; i++) {                                        \
+      out[i] = (int32_t)in_t[i];                                            \
+    }                                                                       \
+    mask_runs_apply_range(mask, out, first, n);                             \
+  }                                                                         \
+  static void convert_nomask_u##bits(const void *in, int32_t *out, size_t n,\
+                                     size_t first, const mask_runs *mask,   \
+                                     uint32_t error_val) {                  \
+    const type_t *in_t = (const type_t *)in;                                \
+    for (size_t i = 0; i < n; i++) {                                        \
+      uint32_t v = in_t[i];                                                 \
+      out[i] = (v == error_val) ? -1 : (int32_t)v;                          \
+    }                                                                       \
+  }
+
+DEFINE_PIXEL_CONVERT(8, uint8_t)
+DEFINE_PIXEL_CONVERT(16, uint16_t)
+DEFINE_PIXEL_CONVERT(32, uint32_t)
+
+#undef DEFINE_PIXEL_CONVERT
+
+#ifdef PIXEL_CONVERT_X86
+
+static inline int load_u8x4(const uint8_t *p) {
+  int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Load `lanes` pixels and zero extend them to 32 bit lanes */
+#define SSE2_LOAD_U8(p)  _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_u8x4(p)), \
+                                                              _mm_setzero_si128()),             \
+                                            _mm_setzero_si128())
+#define SSE2_LOAD_U16(p) _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(p)), _mm_setzero_si128())
+#define SSE2_LOAD_U32(p) _mm_loadu_si128((const __m128i *)(p))
+#define AVX2_LOAD_U8(p)  _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p)))
+#define AVX2_LOAD_U16(p) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(p)))
+#define AVX2_LOAD_U32(p) _mm256_loadu_si256((const __m256i *)(p))
+
+/* Same kernels with explicit vectors. Without a mask, pixels equal to
+ * error_val are OR-ed with the all-ones compare result, which is -1. */
+#define DEFINE_PIXEL_CONVERT_X86(isa, bits, type_t, vec_t, lanes, LOAD,     \
+                                 SET1, CMPEQ, OR, STORE)                    \
+  __attribute__((target(#isa)))                                             \
+  static void convert_mask_u##bits##_##isa(const void *in, int32_t *out,    \
+                                           size_t n, size_t first,          \
+                                           const mask_runs *mask,           \
+                                           uint32_t error_val) {            \
+    const type_t *in_t = (const type_t *)in;                                \
+    size_t i = 0;                                                           \
+    for (; i + lanes <= n; i += lanes) {                                    \
+      STORE((vec_t *)(out + i), LOAD(in_t + i));                            \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+      out[i] = (int32_t)in_t[i];                                            \
+    }                                                                       \
+    mask_runs_apply_range(mask, out, first, n);                             \
+  }                                                                         \
+  __attribute__((target(#isa)))                                             \
+  static void convert_nomask_u##bits##_##isa(const void *in, int32_t *out,  \
+                                             size_t n, size_t first,        \
+                                             const mask_runs *mask,         \
+                                             uint32_t error_val) {          \
+    const type_t *in_t = (const type_t *)in;                                \
+    const vec_t err = SET1((int32_t)error_val);                             \
+    size_t i = 0;                                                           \
+    for (; i + lanes <= n; i += lanes) {                                    \
+      vec_t v = LOAD(in_t + i);                                             \
+      STORE((vec_t *)(out + i), OR(v, CMPEQ(v, err)));                      \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+      uint32_t v = in_t[i];                                                 \
+      out[i] = (v == error_val) ? -1 : (int32_t)v;                          \
+    }                                                                       \
+  }
+
+DEFINE_PIXEL_CONVERT_X86(sse2, 8, uint8_t, __m128i, 4, SSE2_LOAD_U8,
+                         _mm_set1_epi32, _mm_cmpeq_epi32, _mm_or_si128, _mm_storeu_si128)
+DEFINE_PIXEL_CONVERT_X86(sse2, 16, uint16_t, __m128i, 4, SSE2_LOAD_U16,
+                         _mm_set1_epi32, _mm_cmpeq_epi32, _mm_or_si128, _mm_storeu_si128)
+DEFINE_PIXEL_CONVERT_X86(sse2, 32, uint32_t, __m128i, 4, SSE2_LOAD_U32,
+                         _mm_set1_epi32, _mm_cmpeq_epi32, _mm_or_si128, _mm_storeu_si128)
+DEFINE_PIXEL_CONVERT_X86(avx2, 8, uint8_t, __m256i, 8, AVX2_LOAD_U8,
+                         _mm256_set1_epi32, _mm256_cmpeq_epi32, _mm256_or_si256, _mm256_storeu_si256)
+DEFINE_PIXEL_CONVERT_X86(avx2, 16, uint16_t, __m256i, 8, AVX2_LOAD_U16,
+                         _mm256_set1_epi32, _mm256_cmpeq_epi32, _mm256_or_si256, _mm256_storeu_si256)
+DEFINE_PIXEL_CONVERT_X86(avx2, 32, uint32_t, __m256i, 8, AVX2_LOAD_U32,
+                         _mm256_set1_epi32, _mm256_cmpeq_epi32, _mm256_or_si256, _mm256_storeu_si256)
+
+#undef DEFINE_PIXEL_CONVERT_X86
+
+#endif // PIXEL_CONVERT_X86
+
+#define PIXEL_CONVERT_SCALAR 0
+#define PIXEL_CONVERT_SSE2   1
+#define PIXEL_CONVERT_AVX2   2
+
+static int pixel_convert_cpu = PIXEL_CONVERT_SCALAR;
+static pthread_once_t pixel_convert_once = PTHREAD_ONCE_INIT;
+
+static void pixel_convert_detect(void) {
+#ifdef PIXEL_CONVERT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) pixel_convert_cpu = PIXEL_CONVERT_AVX2;
+  else if (__builtin_cpu_supports("sse2")) pixel_convert_cpu = PIXEL_CONVERT_SSE2;
+#endif
+}
+
+static int pixel_convert_level(void) {
+  pthread_once(&pixel_convert_once, pixel_convert_detect);
+  return pixel_convert_cpu;
+}
+
+const char *pixel_convert_isa(void) {
+  switch (pixel_convert_level()) {
+  case PIXEL_CONVERT_AVX2: return "AVX2";
+  case PIXEL_CONVERT_SSE2: return "SSE2";
+  }
+  return "scalar";
+}
+
+pixel_convert_fn pixel_convert_select(size_t elem_size, const mask_runs *mask) {
+  int level = pixel_convert_level();
+
+#ifdef PIXEL_CONVERT_X86
+  if (level == PIXEL_CONVERT_AVX2) {
+    switch (elem_size) {
+    case 1: return mask ? convert_mask_u8_avx2 : convert_nomask_u8_avx2;
+    case 2: return mask ? convert_mask_u16_avx2 : convert_nomask_u16_avx2;
+    case 4: return mask ? convert_mask_u32_avx2 : convert_nomask_u32_avx2;
+    }
+    return NULL;
+  }
+  if (level == PIXEL_CONVERT_SSE2) {
+    switch (elem_size) {
+    case 1: return mask ? convert_mask_u8_sse2 : convert_nomask_u8_sse2;
+    case 2: return mask ? convert_mask_u16_sse2 : convert_nomask_u16_sse2;
+    case 4: return mask ? convert_mask_u32_sse2 : convert_nomask_u32_sse2;
+    }
+    return NULL;
+  }
+#endif
+  (void)level;
+  switch (elem_size) {
+  case 1: return mask ? convert_mask_u8 : convert_nomask_u8;
+  case 2: return mask ? convert_mask_u16 : convert_nomask_u16;
+  case 4: return mask ? convert_mask_u32 : convert_nomask_u32;
+  }
+  return NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ Conversion of raw EIGER pixels to the signed 32 bit values written to CBF.
+
+ One kernel is generated for each stored pixel width (8, 16 and 32 bit),
+ each masking mode and each instruction set, so that the inner loops have
+ no type dispatch, no test of whether a mask is present and no branches:
+
+  with mask:    pixels are widened, then the masked runs are overwritten
+                (pixel_mask == 1 -> -1, pixel_mask > 1 -> -2)
+  without mask: value == error_val (2^bit_depth_image - 1) -> -1, else the value
+
+ On x86 the SSE2 or AVX2 kernels are picked at runtime.
+*/
+
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pixel_mask.h"
+
+/* in and out hold the n pixels starting at pixel first of the frame */
+typedef void (*pixel_convert_fn)(const void *in, int32_t *out, size_t n, size_t first,
+                                 const mask_runs *mask, uint32_t error_val);
+
+/* Kernel for elem_size bytes per stored pixel (1, 2 or 4).
+ * mask is NULL when no mask is available.
+ * Returns NULL for unsupported element sizes. */
+pixel_convert_fn pixel_convert_select(size_t elem_size, const mask_runs *mask);
+
+/* Name of the instruction set the selected kernels use */
+const char *pixel_convert_isa(void);
+
+#endif // PIXEL_CONVERT_H
@@ -0,0 +1,119 @@
+/*
+ Compact form of the EIGER pixel mask. See pixel_mask.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixel_mask.h"
+
+static inline int32_t mask_value(int32_t m) {
+  if (m == 1) return -1;
+  if (m > 1) return -2;
+  return 0;
+}
+
+int mask_runs_build(const int32_t *pixel_mask, size_t npixels, mask_runs *m) {
+  size_t i, nruns = 0;
+
+  m->runs = NULL;
+  m->nruns = 0;
+  m->npixels = npixels;
+  m->nminus1 = m->nminus2 = 0;
+
+  // First pass: count the runs so that the list is allocated once.
+  int32_t prev = 0;
+  for (i = 0; i < npixels; i++) {
+    int32_t v = mask_value(pixel_mask[i]);
+    if (v != 0 && v != prev) nruns++;
+    prev = v;
+  }
+  if (nruns == 0) return 0;
+
+  m->runs = (mask_run *)malloc(sizeof(mask_run) * nruns);
+  if (m->runs == NULL) return -1;
+
+  prev = 0;
+  for (i = 0; i < npixels; i++) {
+    int32_t v = mask_value(pixel_mask[i]);
+    if (v != 0) {
+      if (v != prev) {
+        m->runs[m->nruns].start = i;
+        m->runs[m->nruns].length = 0;
+        m->runs[m->nruns].value = v;
+        m->nruns++;
+      }
+      m->runs[m->nruns - 1].length++;
+      if (v == -1) m->nminus1++;
+      else m->nminus2++;
+    }
+    prev = v;
+  }
+  return 0;
+}
+
+void mask_runs_apply(const mask_runs *m, int32_t *out) {
+  for (size_t r = 0; r < m->nruns; r++) {
+    int32_t *p = out + m->runs[r].start;
+    const int32_t value = m->runs[r].value;
+    for (uint32_t i = 0, ilim = m->runs[r].length; i < ilim; i++) {
+      p[i] = value;
+    }
+  }
+}
+
+void mask_runs_apply_range(const mask_runs *m, int32_t *out, size_t first, size_t n) {
+  size_t last = first + n;
+
+  // First run that ends after the start of the tile
+  size_t lo = 0, hi = m->nruns;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (m->runs[mid].start + m->runs[mid].length <= first) lo = mid + 1;
+    else hi = mid;
+  }
+  for (size_t r = lo; r < m->nruns && m->runs[r].start < last; r++) {
+    size_t start = (m->runs[r].start > first) ? m->runs[r].start : first;
+    size_t end = m->runs[r].start + m->runs[r].length;
+    if (end > last) end = last;
+    const int32_t value = m->runs[r].value;
+    for (size_t i = start; i < end; i++) {
+      out[i - first] = value;
+    }
+  }
+}
+
+void mask_runs_free(mask_runs *m) {
+  free(m->runs);
+  m->runs = NULL;
+  m->nruns = 0;
+}
+
+typedef struct mask_runs_flat {
+  uint64_t nruns, npixels, nminus1, nminus2;
+} mask_runs_flat;
+
+size_t mask_runs_flat_size(const mask_runs *m) {
+  return sizeof(mask_runs_flat) + sizeof(mask_run) * m->nruns;
+}
+
+void mask_runs_flatten(const mask_runs *m, void *buf) {
+  mask_runs_flat *f = (mask_runs_flat *)buf;
+  f->nruns = m->nruns;
+  f->npixels = m->npixels;
+  f->nminus1 = m->nminus1;
+  f->nminus2 = m->nminus2;
+  if (m->nruns > 0) memcpy(f + 1, m->runs, sizeof(mask_run) * m->nruns);
+}
+
+int mask_runs_view(const void *buf, size_t size, mask_runs *m) {
+  const mask_runs_flat *f = (const mask_runs_flat *)buf;
+  if (size < sizeof(mask_runs_flat) ||
+      (size - sizeof(mask_runs_flat)) / sizeof(mask_run) < f->nruns) return -1;
+  m->runs = (mask_run *)(f + 1);
+  m->nruns = f->nruns;
+  m->npixels = f->npixels;
+  m->nminus1 = f->nminus1;
+  m->nminus2 = f->nminus2;
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ Compact form of the EIGER pixel mask.
+
+ The detector mask marks module gaps and defective pixels. Gaps are long
+ contiguous runs, so the mask is turned once into a list of runs of
+ consecutive pixels that get the same substitute value:
+
+  pixel_mask == 1 -> -1
+  pixel_mask  > 1 -> -2 (2, 4, 8, 16)
+
+ Applying the mask to a frame is then a handful of fills instead of a
+ test for every pixel.
+*/
+
+#ifndef PIXEL_MASK_H
+#define PIXEL_MASK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct mask_run {
+  uint32_t start;
+  uint32_t length;
+  int32_t value;
+} mask_run;
+
+typedef struct mask_runs {
+  mask_run *runs;
+  size_t nruns;
+  size_t npixels;  // frame size the mask was built for
+  size_t nminus1;  // pixels set to -1
+  size_t nminus2;  // pixels set to -2
+} mask_runs;
+
+/* Build the run list from the mask as stored in the master file.
+ * Returns 0 on success, -1 if memory could not be allocated. */
+int mask_runs_build(const int32_t *pixel_mask, size_t npixels, mask_runs *m);
+
+/* Overwrite the masked pixels of out (m->npixels values). */
+void mask_runs_apply(const mask_runs *m, int32_t *out);
+
+/* Same for a tile: out holds the n pixels starting at pixel first. */
+void mask_runs_apply_range(const mask_runs *m, int32_t *out, size_t first, size_t n);
+
+void mask_runs_free(mask_runs *m);
+
+/* The run list as one position independent block of memory, so that it
+ * can be built once and mapped read only by other processes.
+ * mask_runs_flatten() writes mask_runs_flat_size() bytes to buf.
+ * mask_runs_view() sets up m to use the runs in buf in place; do not
+ * call mask_runs_free() on it. Returns -1 if buf is not a valid block of
+ * size bytes. */
+size_t mask_runs_flat_size(const mask_runs *m);
+void mask_runs_flatten(const mask_runs *m, void *buf);
+int mask_runs_view(const void *buf, size_t size, mask_runs *m);
+
+#endif // PIXEL_MASK_H
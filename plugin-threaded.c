@@ -0,0 +1,450 @@
+/*
+ EIGER HDF5 reader plugin (in-process, threaded)
+
+ Same interface as plugin.c, without child processes. XDS calls
+ plugin_get_data from several threads at once; each call decodes its
+ frame in the calling thread. Only fetching the compressed chunk goes
+ through libhdf5, under a lock as libhdf5 is not thread safe. The
+ bitshuffle/LZ4 decoding runs outside the lock and the result is written
+ straight into data_array. There is nothing to fork, no pipe and no
+ shared memory, so plugin_open returns as soon as the metadata is read.
+
+ Datasets whose chunks cannot be decoded directly are read with H5Dread
+ under the lock.
+
+To build:
+
+ Linux:
+
+ gcc -std=gnu99 -o plugin-threaded.so -shared -fPIC -g -O3 \
+     -I/app/dials/base/include -L/app/dials/base/lib \
+     plugin-threaded.c frame_reader.c pixel_convert.c pixel_mask.c \
+     -Ilz4 -Ibitshuffle lz4/lz4.c lz4/h5zlz4.c \
+     bitshuffle/bshuf_h5filter.c \
+     bitshuffle/bshuf_h5plugin.c \
+     bitshuffle/bitshuffle.c \
+     -lpthread -lhdf5_hl -lhdf5 -lrt
+
+ Mac OS:
+ TODO: need to test.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hdf5_hl.h"
+#include "hdf5.h"
+#include "frame_reader.h"
+#include "pixel_convert.h"
+
+#define INVALID -9999
+
+// Blocks kept open. XDS threads work on neighbouring frames, which are
+// in one or two blocks.
+#define NBLOCKS 4
+
+extern const H5Z_class2_t H5Z_LZ4;
+extern const H5Z_class2_t bshuf_H5Filter;
+void register_filters() {
+  H5Zregister(&H5Z_LZ4);
+  H5Zregister(&bshuf_H5Filter);
+}
+
+struct GlobalData {
+  hid_t hdf, group;
+  int dimx, dimy;
+  int nframesPerDataset;
+  float xpixelSize;
+  float ypixelSize;
+  int block_start;
+  unsigned int error_val;
+  int has_mask;
+  mask_runs mask;
+
+  pthread_mutex_t hdf_lock; // all libhdf5 calls after plugin_open
+  block_cache blocks[NBLOCKS];
+  unsigned long block_used[NBLOCKS]; // for LRU replacement
+  unsigned long clock;
+  pthread_key_t scratch_key;
+  pthread_mutex_t scratch_lock;
+  struct Scratch *scratch; // of every calling thread, freed by plugin_close
+};
+struct GlobalData *GLOBAL_DATA = NULL;
+
+/* Buffers of one calling thread. They are all freed by plugin_close, not
+   at thread exit: the thread may outlive the plugin, which the host may
+   have unloaded by then. */
+struct Scratch {
+  void *chunk;
+  size_t chunk_size;
+  void *raw;
+  size_t raw_size;
+  struct Scratch *next;
+};
+
+void free_scratch(void *p) {
+  struct Scratch *s = (struct Scratch *)p;
+  free(s->chunk);
+  free(s->raw);
+  free(s);
+}
+
+struct Scratch *get_scratch(void) {
+  struct Scratch *s = (struct Scratch *)pthread_getspecific(GLOBAL_DATA->scratch_key);
+  if (s == NULL) {
+    s = (struct Scratch *)calloc(1, sizeof(struct Scratch));
+    if (s == NULL) return NULL;
+    pthread_setspecific(GLOBAL_DATA->scratch_key, s);
+    pthread_mutex_lock(&GLOBAL_DATA->scratch_lock);
+    s->next = GLOBAL_DATA->scratch;
+    GLOBAL_DATA->scratch = s;
+    pthread_mutex_unlock(&GLOBAL_DATA->scratch_lock);
+  }
+  return s;
+}
+
+void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy,
+                       int *number_of_frames, int info[1024],
+                       int *error_flag);
+
+void plugin_open(const char *filename, int info_array[1024], int *error_flag) {
+  register_filters();
+
+  /* patch bug in the latest BUILT */
+  char fn[4096];
+  strcpy(fn, filename);
+  int n = strlen(fn);
+  fn[n - 9] = 'm';
+  fn[n - 8] = 'a';
+  fn[n - 7] = 's';
+  fn[n - 6] = 't';
+  fn[n - 5] = 'e';
+  fn[n - 4] = 'r';
+  fprintf(stderr, "PLUGIN INFO: plugin_open called with filename = %s\n", fn);
+  if (GLOBAL_DATA != NULL) {
+    fprintf(stderr, "PLUGIN ERROR: CAN ONLY OPEN ONE FILE AT A TIME\n");
+    *error_flag = -4;
+    return;
+  }
+
+  /* Setup global variables */
+  GLOBAL_DATA = (struct GlobalData*)calloc(1, sizeof(struct GlobalData));
+  pthread_mutex_init(&GLOBAL_DATA->hdf_lock, NULL);
+  pthread_key_create(&GLOBAL_DATA->scratch_key, NULL);
+  pthread_mutex_init(&GLOBAL_DATA->scratch_lock, NULL);
+
+  GLOBAL_DATA->hdf = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (GLOBAL_DATA->hdf < 0) {
+    fprintf(stderr, "PLUGIN ERROR: Failed to open file %s\n", filename);
+    *error_flag = -4;
+    return;
+  }
+
+  int nx, ny, nbytes, nframes, info[1024];
+  float qx, qy;
+  plugin_get_header(&nx, &ny, &nbytes, &qx, &qy, &nframes, info, error_flag);
+  if (*error_flag < 0) return;
+
+  for (int i = 0; i < NBLOCKS; i++) {
+    block_cache_init(&GLOBAL_DATA->blocks[i], GLOBAL_DATA->group, nx, ny);
+    GLOBAL_DATA->block_used[i] = 0;
+  }
+  fprintf(stderr, "PLUGIN INFO: Decoding in the calling threads (%s).\n", pixel_convert_isa());
+
+  *error_flag = 0;
+  return;
+}
+
+void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int *number_of_frames,
+		       int info[1024], int *error_flag) {
+  info[0] =  1; // Vendor   [1:Dectris] // other values were not accepted by the host program!
+  info[1] =  0; // Version  [Major]
+  info[2] =  1; // Version  [Minor]
+  info[3] =  0; // Version  [Patch]
+  info[4] = -1; // Version  [timestamp]
+
+  if (GLOBAL_DATA == NULL) {
+    fprintf(stderr, "PLUGIN ERROR: plugin_get_header called before plugin_open\n");
+    *error_flag = -2;
+    return;
+  }
+
+  // Called again by XDS after plugin_open: everything is known already.
+  if (GLOBAL_DATA->nframesPerDataset > 0) {
+    pthread_mutex_lock(&GLOBAL_DATA->hdf_lock);
+  }
+  hid_t hdf = GLOBAL_DATA->hdf;
+
+  /* Image depth*/
+  int depth = -1;
+  H5LTread_dataset_int(hdf, "/entry/instrument/detector/bit_depth_image", &depth);
+  if (depth > 0) {
+    fprintf(stderr, "PLUGIN INFO: /entry/instrument/detector/bit_depth_image = %d\n", depth);
+  } else {
+    fprintf(stderr, "PLUGIN WARNING: /entry/instrument/detector/bit_depth_image is not avaialble. We assume 16 bit.\n");
+    depth = 16; 
+  }
+  GLOBAL_DATA->error_val = (unsigned int)((1ULL << depth) - 1); 
+
+  /* Pixel size */
+  H5LTread_dataset_float(hdf, "/entry/instrument/detector/x_pixel_size", &GLOBAL_DATA->xpixelSize);
+  H5LTread_dataset_float(hdf, "/entry/instrument/detector/y_pixel_size", &GLOBAL_DATA->ypixelSize);
+
+  /* Image size */
+  int xpixels = -1, ypixels = -1;
+  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", &xpixels);
+  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", &ypixels);
+  GLOBAL_DATA->dimx = xpixels;
+  GLOBAL_DATA->dimy = ypixels;
+
+  /* Number of images */
+  int nimages = -1;
+  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/nimages", &nimages);
+  if (nimages < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to read the nimages.\n");
+    *error_flag = -4;
+    goto unlock;
+  }
+
+  /* Number of triggers */
+  int ntrigger = -1;
+  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/ntrigger", &ntrigger);
+  if (ntrigger < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to read the ntrigger.\n");
+    *error_flag = -4;
+    goto unlock;
+  }
+
+  if (GLOBAL_DATA->nframesPerDataset == 0) {
+    /* Pixel mask. As in plugin-worker, pixels of both classes become -1. */
+    signed int* pixel_mask = (signed int*)malloc(sizeof(signed int) * xpixels * ypixels);
+    pixel_mask[0] = INVALID;
+    H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
+    if (pixel_mask[0] == INVALID) {
+      fprintf(stderr, "PLUGIN WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
+      GLOBAL_DATA->has_mask = 0;
+    } else {
+      for (int i = 0, ilim = xpixels * ypixels; i < ilim; i++) {
+        if (pixel_mask[i] > 1) pixel_mask[i] = 1;
+      }
+      if (mask_runs_build(pixel_mask, (size_t)xpixels * ypixels, &GLOBAL_DATA->mask) < 0) {
+        fprintf(stderr, "PLUGIN ERROR: failed to allocate the pixel mask.\n");
+        free(pixel_mask);
+        *error_flag = -2;
+        return;
+      }
+      GLOBAL_DATA->has_mask = 1;
+      fprintf(stderr, "PLUGIN: #pixels masked to -1 = %zu in %zu runs.\n", GLOBAL_DATA->mask.nminus1, GLOBAL_DATA->mask.nruns);
+    }
+    free(pixel_mask);
+
+    /* Make sure /entry/data is present */
+    hid_t entry, group;
+    entry = H5Gopen2(hdf, "/entry", H5P_DEFAULT);
+    if (entry < 0) {
+      fprintf(stderr, "PLUGIN ERROR: /entry does not exist!\n");
+      *error_flag = -4;
+      return;
+    }
+    GLOBAL_DATA->group = entry;
+    group = H5Gopen2(entry, "data", H5P_DEFAULT);
+    if (group < 0) {
+      fprintf(stderr, "PLUGIN WARNING: /entry/data does not exist!\n");
+    } else {
+      GLOBAL_DATA->group = group;
+    }
+
+    /* Is it 0-indexed? */
+    GLOBAL_DATA->block_start = 1;
+    if (H5LTfind_dataset(GLOBAL_DATA->group, "data_000000")) {
+      fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000000.\n");
+      GLOBAL_DATA->block_start = 0;
+    } else {
+      fprintf(stderr, "PLUGIN INFO: This dataset starts from data_000001.\n");
+    }
+
+    // Open the first data block to get the number of frames in a block
+    char data_name[20] = {};
+    hid_t data, dataspace;
+    snprintf(data_name, 20, "data_%06d", GLOBAL_DATA->block_start); 
+    data = H5Dopen2(GLOBAL_DATA->group, data_name, H5P_DEFAULT);
+    if (data < 0) {
+      fprintf(stderr, "PLUGIN ERROR: failed to open /entry/%s\n", data_name);
+      *error_flag = -4;
+      return;
+    }
+    dataspace = H5Dget_space(data);
+    if (H5Sget_simple_extent_ndims(dataspace) != 3) {
+      fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/%s is not 3!\n", data_name);
+      *error_flag = -4;
+      return;
+    }
+
+    hsize_t dims[3];
+    H5Sget_simple_extent_dims(dataspace, dims, NULL);
+    GLOBAL_DATA->nframesPerDataset = dims[0];
+    fprintf(stderr, "PLUGIN INFO: The number of images per data block is %d.\n", GLOBAL_DATA->nframesPerDataset);
+
+    H5Sclose(dataspace);
+    H5Dclose(data);
+  } else {
+    pthread_mutex_unlock(&GLOBAL_DATA->hdf_lock);
+  }
+
+  *nx = GLOBAL_DATA->dimx;
+  *ny = GLOBAL_DATA->dimy;
+  *nbytes = GLOBAL_DATA->dimx * GLOBAL_DATA->dimy * sizeof(int);
+  *qx = GLOBAL_DATA->xpixelSize;
+  *qy = GLOBAL_DATA->ypixelSize;
+  *number_of_frames = (int)(nimages * ntrigger);
+
+  *error_flag = 0;
+  return;
+
+ unlock:
+  if (GLOBAL_DATA->nframesPerDataset > 0) {
+    pthread_mutex_unlock(&GLOBAL_DATA->hdf_lock);
+  }
+}
+
+/* The open block holding block_number, opening it in place of the least
+ * recently used one if needed. Call with hdf_lock held. */
+block_cache *get_block(int block_number, int *error_flag) {
+  int victim = 0;
+  for (int i = 0; i < NBLOCKS; i++) {
+    if (GLOBAL_DATA->blocks[i].block_number == block_number) {
+      victim = i;
+      break;
+    }
+    if (GLOBAL_DATA->block_used[i] < GLOBAL_DATA->block_used[victim]) victim = i;
+  }
+  GLOBAL_DATA->block_used[victim] = ++GLOBAL_DATA->clock;
+
+  block_cache *bc = &GLOBAL_DATA->blocks[victim];
+  int ret = block_cache_open(bc, block_number);
+  if (ret == -1) {
+    fprintf(stderr, "PLUGIN ERROR: failed to open /entry/data_%06d\n", block_number);
+    *error_flag = -4;
+    return NULL;
+  } else if (ret == -2) {
+    fprintf(stderr, "PLUGIN ERROR: Dimension of /entry/data_%06d is not 3!\n", block_number);
+    block_cache_close(bc);
+    *error_flag = -4;
+    return NULL;
+  }
+  return bc;
+}
+
+void plugin_get_data(int *frame_number, int *nx, int *ny,
+		     int data_array[], int info_array[1024],
+		     int *error_flag) {
+  if (GLOBAL_DATA == NULL){
+    fprintf(stderr, "PLUGIN ERROR: plugin_get_data called before plugin_open.\n");
+    *error_flag = -4;
+    return;
+  }
+
+  size_t npixels = (size_t)GLOBAL_DATA->dimx * GLOBAL_DATA->dimy;
+  int block_number = GLOBAL_DATA->block_start + (*frame_number - 1) / GLOBAL_DATA->nframesPerDataset;
+  int frame_in_block = (*frame_number - 1) % GLOBAL_DATA->nframesPerDataset;
+  struct Scratch *s = get_scratch();
+  if (s == NULL) {
+    *error_flag = -2;
+    return;
+  }
+
+  /* Fetch the frame: the compressed chunk if we can decode it, otherwise
+     the pixels through H5Dread. */
+  pthread_mutex_lock(&GLOBAL_DATA->hdf_lock);
+  block_cache *bc = get_block(block_number, error_flag);
+  if (bc == NULL) {
+    pthread_mutex_unlock(&GLOBAL_DATA->hdf_lock);
+    return;
+  }
+  chunk_format fmt = bc->fmt;
+  size_t elem_size = bc->elem_size;
+  int64_t chunk_bytes = -1;
+  if (fmt.codec != CHUNK_CODEC_UNSUPPORTED) {
+    chunk_bytes = chunk_read(bc->data, frame_in_block, &s->chunk, &s->chunk_size);
+    elem_size = fmt.elem_size;
+  }
+
+  // 32 bit pixels are decoded straight into data_array and converted in
+  // place; 8 and 16 bit bitshuffled pixels are widened as they are decoded.
+  int widen = chunk_bytes >= 0 && chunk_decodes_i32(&fmt);
+  void *raw = data_array;
+  if (elem_size != sizeof(int) && !widen) {
+    if (s->raw_size < npixels * elem_size) {
+      free(s->raw);
+      s->raw = malloc(npixels * elem_size);
+      s->raw_size = (s->raw != NULL) ? npixels * elem_size : 0;
+    }
+    raw = s->raw;
+  }
+  int ret = 0;
+  if (raw == NULL) {
+    ret = -2;
+  } else if (chunk_bytes < 0 && block_cache_read(bc, frame_in_block, bc->mem_type, raw) < 0) {
+    fprintf(stderr, "PLUGIN ERROR: H5Dread for frame #%d failed.\n", *frame_number);
+    ret = -2;
+  }
+  pthread_mutex_unlock(&GLOBAL_DATA->hdf_lock);
+
+  /* Decode and mask outside the lock */
+  const mask_runs *mask = GLOBAL_DATA->has_mask ? &GLOBAL_DATA->mask : NULL;
+  if (ret == 0 && widen) {
+    if (chunk_decode_i32(&fmt, s->chunk, chunk_bytes, data_array, npixels,
+                         mask ? -1 : (int64_t)GLOBAL_DATA->error_val) < 0) {
+      fprintf(stderr, "PLUGIN ERROR: failed to decode frame #%d.\n", *frame_number);
+      ret = -2;
+    } else if (mask) {
+      mask_runs_apply(mask, data_array);
+    }
+    *error_flag = ret;
+    return;
+  }
+  if (ret == 0 && chunk_bytes >= 0 &&
+      chunk_decode(&fmt, s->chunk, chunk_bytes, raw, npixels * elem_size) < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to decode frame #%d.\n", *frame_number);
+    ret = -2;
+  }
+  if (ret == 0) {
+    pixel_convert_fn convert = pixel_convert_select(elem_size, mask);
+    if (convert == NULL) {
+      fprintf(stderr, "PLUGIN ERROR: unsupported pixel size %d for frame #%d.\n", (int)elem_size, *frame_number);
+      ret = -2;
+    } else {
+      convert(raw, data_array, npixels, 0, mask, GLOBAL_DATA->error_val);
+    }
+  }
+
+  *error_flag = ret;
+  return;
+}
+
+void plugin_close(int *error_flag){
+  printf("PLUGIN: plugin_close called.\n");
+  if (GLOBAL_DATA == NULL) {
+    *error_flag = 0;
+    return;
+  }
+
+  for (int i = 0; i < NBLOCKS; i++) {
+    block_cache_close(&GLOBAL_DATA->blocks[i]);
+  }
+  if (GLOBAL_DATA->has_mask) mask_runs_free(&GLOBAL_DATA->mask);
+  while (GLOBAL_DATA->scratch != NULL) {
+    struct Scratch *s = GLOBAL_DATA->scratch;
+    GLOBAL_DATA->scratch = s->next;
+    free_scratch(s);
+  }
+  pthread_key_delete(GLOBAL_DATA->scratch_key);
+  pthread_mutex_destroy(&GLOBAL_DATA->scratch_lock);
+  H5Fclose(GLOBAL_DATA->hdf);
+  pthread_mutex_destroy(&GLOBAL_DATA->hdf_lock);
+  free(GLOBAL_DATA);
+  GLOBAL_DATA = NULL;
+
+  *error_flag = 0;
+}
@@ -13,8 +13,8 @@ To build:
 
  gcc -std=gnu99 -o plugin-worker -g -O3 \
      -I/app/dials/base/include -L/app/dials/base/lib \
-     plugin-worker.c \
-     -Ilz4 lz4/lz4.c lz4/h5zlz4.c \
+     plugin-worker.c shm_ring.c pixel_mask.c frame_reader.c pixel_convert.c latency_hist.c \
+     -Ilz4 -Ibitshuffle lz4/lz4.c lz4/h5zlz4.c \
      bitshuffle/bshuf_h5filter.c \
      bitshuffle/bshuf_h5plugin.c \
      bitshuffle/bitshuffle.c \
@@ -29,9 +29,15 @@ To build:
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include "hdf5_hl.h"
 #include "hdf5.h"
+#include "shm_ring.h"
+#include "pixel_mask.h"
+#include "frame_reader.h"
+#include "pixel_convert.h"
+#include "latency_hist.h"
 
 #define INVALID -9999
 
@@ -45,15 +51,18 @@ void register_filters() {
 struct GlobalData {
   hid_t hdf, group;
   int dimx, dimy;
-  int Nminus1, Nminus2;
   int datasize;
   int nframesPerDataset;
-  signed int *minus1, *minus2;
+  mask_runs mask; // built by the parent, over zero pixels if there is no mask
+  void *mask_map;
+  size_t mask_size;
   float xpixelSize;
   float ypixelSize;
   int block_start;
   unsigned int error_val;
-  unsigned int *mapped_buf;
+  shm_channel *channel;
+  size_t pool_size;
+  unsigned int *pool; // frame buffers shared with the parent and the other workers
 };
 struct GlobalData *GLOBAL_DATA = NULL;
 
@@ -125,25 +134,7 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   GLOBAL_DATA->dimx = xpixels;
   GLOBAL_DATA->dimy = ypixels;
 
-  /* Pixel mask */
-  GLOBAL_DATA->minus1 = (signed int*)malloc(sizeof(signed int) * xpixels * ypixels);
-  GLOBAL_DATA->minus2 = (signed int*)malloc(sizeof(signed int) * xpixels * ypixels);
-  signed int* pixel_mask = (signed int*)malloc(sizeof(signed int) * xpixels * ypixels);
-  GLOBAL_DATA->Nminus1 = 0;
-  GLOBAL_DATA->Nminus2 = 0;
-  pixel_mask[0] = INVALID;
-  H5LTread_dataset_int(hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
-  if (pixel_mask[0] == INVALID) {
-    fprintf(stderr, "PLUGIN WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
-    GLOBAL_DATA->Nminus1 = -1;
-  } else {
-    for (int i =0, ilim = xpixels * ypixels; i < ilim; i++) {
-      if (pixel_mask[i] == 1) GLOBAL_DATA->minus1[GLOBAL_DATA->Nminus1++] = i;
-      else if (pixel_mask[i] > 1) GLOBAL_DATA->minus2[GLOBAL_DATA->Nminus2++] = i;
-    }
-  }
-  fprintf(stderr, "PLUGIN: #pixels masked to -1 = %d, to -2 = %d.\n", GLOBAL_DATA->Nminus1, GLOBAL_DATA->Nminus2++);
-  free(pixel_mask);
+  /* The pixel mask is read by the parent */
 
   /* Number of images */
   int nimages = -1;
@@ -228,101 +219,124 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy, int
   return;
 }
 
-int prev_block_number = -1;
-hid_t data = NULL, dataspace = NULL, memspace=NULL;
+/* The compressed chunk, or the pixels read by H5Dread, before they are
+   widened and masked into the frame buffer */
+block_cache blocks;
+void *chunk = NULL, *raw = NULL;
+size_t chunk_size = 0, raw_size = 0;
 
-int get_data(int myid, int frame_number, int *mapped_buf) {
-  int ret;
-  int xpixels = GLOBAL_DATA->dimx, ypixels = GLOBAL_DATA->dimy;
+/* Stage times travel back in 32 bits */
+uint32_t elapsed_ns(uint64_t from, uint64_t to) {
+  uint64_t ns = to - from;
+  return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+/* Fill the frame buffer ourselves from the compressed chunk: libhdf5 never
+   writes into the shared (possibly huge page) memory. The time spent in
+   each stage goes into msg. */
+int get_data(int myid, int frame_number, int *mapped_buf, shm_msg *msg) {
+  uint64_t t0 = latency_now();
+  size_t npixels = (size_t)GLOBAL_DATA->dimx * GLOBAL_DATA->dimy;
 
   int block_number = GLOBAL_DATA->block_start + (frame_number - 1) / GLOBAL_DATA->nframesPerDataset;
   int frame_in_block = (frame_number - 1) % GLOBAL_DATA->nframesPerDataset;
 
-  char data_name[20] = {};
- 
-  if (prev_block_number != block_number) {
-    prev_block_number = block_number;
-
-    if (data != NULL) H5Dclose(data); 
-    if (dataspace != NULL) H5Sclose(dataspace);
-
-    snprintf(data_name, 20, "data_%06d", block_number); 
-    data = H5Dopen2(GLOBAL_DATA->group, data_name, H5P_DEFAULT);
-    dataspace = H5Dget_space(data);
-    if (data < 0) {
-      fprintf(stderr, "failed to open /entry/%s\n", data_name);
-      return -4;
+  int ret = block_cache_open(&blocks, block_number);
+  if (ret == -1) {
+    fprintf(stderr, "failed to open /entry/data_%06d\n", block_number);
+    return -4;
+  } else if (ret == -2) {
+    fprintf(stderr, "Dimension of /entry/data_%06d is not 3!\n", block_number);
+    block_cache_close(&blocks);
+    return -4;
+  }
+
+  size_t elem_size = blocks.elem_size;
+  int64_t chunk_bytes = -1;
+  if (blocks.fmt.codec != CHUNK_CODEC_UNSUPPORTED) {
+    elem_size = blocks.fmt.elem_size;
+    chunk_bytes = chunk_read(blocks.data, frame_in_block, &chunk, &chunk_size);
+    if (chunk_bytes < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: H5Dread_chunk failed.\n", myid, frame_number);
+      return -2;
     }
-    if (H5Sget_simple_extent_ndims(dataspace) != 3) {
-      fprintf(stderr, "Dimension of /entry/%s is not 3!\n", data_name);
-      return -4;
+  }
+  uint64_t t1 = latency_now();
+  msg->read_ns = elapsed_ns(t0, t1);
+
+  // Without a mask, pixels at error_val become -1.
+  const mask_runs *mask = (GLOBAL_DATA->mask.npixels == 0) ? NULL : &GLOBAL_DATA->mask;
+
+  // 8 and 16 bit bitshuffled pixels are widened as they are decoded,
+  // straight into the frame buffer.
+  if (chunk_bytes >= 0 && chunk_decodes_i32(&blocks.fmt)) {
+    if (chunk_decode_i32(&blocks.fmt, chunk, chunk_bytes, mapped_buf, npixels,
+                         mask ? -1 : (int64_t)GLOBAL_DATA->error_val) < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: failed to decode the chunk.\n", myid, frame_number);
+      return -2;
     }
+    uint64_t t2 = latency_now();
+    msg->decode_ns = elapsed_ns(t1, t2);
+    if (mask) mask_runs_apply(mask, mapped_buf);
+    msg->mask_ns = elapsed_ns(t2, latency_now());
+    return 0;
   }
 
-  hsize_t offset_in[3] = {frame_in_block, 0, 0};
-  hsize_t offset_out[3] = {0, 0, 0};
-  hsize_t count[3] = {1, ypixels, xpixels};
-
-  /* Create memory space */
-  if (memspace == NULL) {
-    hsize_t dims[3];
-    H5Sget_simple_extent_dims(dataspace, dims, NULL);
-
-    memspace = H5Screate_simple(3, dims, NULL);
-    if (memspace < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: failed to create memspace.\n", myid, frame_number);
-      return -4;
+  // 32 bit pixels are decoded straight into the frame buffer; H5Dread
+  // always gets a buffer of our own.
+  void *in = mapped_buf;
+  if (elem_size != sizeof(int) || chunk_bytes < 0) {
+    if (raw_size < npixels * elem_size) {
+      free(raw);
+      raw = malloc(npixels * elem_size);
+      raw_size = (raw != NULL) ? npixels * elem_size : 0;
+      if (raw == NULL) return -2;
     }
-    ret = H5Sselect_hyperslab(memspace, H5S_SELECT_SET, offset_out, NULL, 
-                              count, NULL);
-    if (ret < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: select_hyperslab for memory failed.\n", myid, frame_number);
+    in = raw;
+  }
+  if (chunk_bytes >= 0) {
+    if (chunk_decode(&blocks.fmt, chunk, chunk_bytes, in, npixels * elem_size) < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: failed to decode the chunk.\n", myid, frame_number);
+      return -2;
+    }
+  } else {
+    if (block_cache_read(&blocks, frame_in_block, blocks.mem_type, in) < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d for frame #%d: H5Dread for image failed.\n", myid, frame_number);
       return -2;
     }
   }
-  
-  /* Get the frame */
-  ret = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET, offset_in, NULL, count, NULL);
-  if (ret < 0) {
-    fprintf(stderr, "PLUGIN CHILD %d for frame #%d: select_hyperslab for file failed.\n", myid, frame_number);
-    return -2;
-  }
+  uint64_t t2 = latency_now();
+  msg->decode_ns = elapsed_ns(t1, t2);
 
-  ret = H5Dread(data, H5T_NATIVE_UINT, memspace, dataspace, H5P_DEFAULT, mapped_buf);
-  if (ret < 0) {
-    fprintf(stderr, "PLUGIN CHILD %d for frame #%d: H5Dread for image failed.\n", myid, frame_number);
+  pixel_convert_fn convert = pixel_convert_select(elem_size, mask);
+  if (convert == NULL) {
+    fprintf(stderr, "PLUGIN CHILD %d for frame #%d: unsupported pixel size %d.\n", myid, frame_number, (int)elem_size);
     return -2;
   }
+  convert(in, mapped_buf, npixels, 0, mask, GLOBAL_DATA->error_val);
+  msg->mask_ns = elapsed_ns(t2, latency_now());
 
-  int error_val = GLOBAL_DATA->error_val;
-  if (GLOBAL_DATA->Nminus1 < 0) {// pixel mask is not available
-    for (int i = 0, ilim = xpixels * ypixels; i < ilim; i++) {
-      if (mapped_buf[i] == error_val) mapped_buf[i] = -1;
-    }
-  } else { // pixel mask is available
-    for (int i = 0, ilim = GLOBAL_DATA->Nminus1; i < ilim; i++) {
-      mapped_buf[GLOBAL_DATA->minus1[i]] = -1;
-    }
-    for (int i = 0, ilim = GLOBAL_DATA->Nminus2; i < ilim; i++) {
-      mapped_buf[GLOBAL_DATA->minus2[i]] = -1;
-    }
-  }
-  
   return 0; 
 }
 
+/* For shm_ring: we are reparented when the plugin's host process dies */
+int parent_alive(void *arg) {
+  return getppid() == *(pid_t *)arg;
+}
+
 void usr1_handler(int dummy) {
   // don't care open handlers and memories; we are going to die!
   exit(0);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
+  if (argc != 6) {
     fprintf(stderr, "PLUGIN: This program should not be called from the command line.\n");
     return -1;
   }
   int myid = atoi(argv[3]);
-  fprintf(stderr, "PLUGIN CHILD %d started for %s with shared memory %s.\n", myid, argv[1], argv[2]);
+  pid_t ppid = getppid();
+  fprintf(stderr, "PLUGIN CHILD %d started for %s with shared memory %s, %s and %s.\n", myid, argv[1], argv[2], argv[4], argv[5]);
 
   int failed = 0;
   if (open_file(argv[1]) < 0) {
@@ -334,13 +348,47 @@ int main(int argc, char **argv) {
     fprintf(stderr, "PLUGIN CHILD %d: Failed to open shared memory %s.\n", myid, argv[2]);
     failed = 1;
   } else {
-    GLOBAL_DATA->mapped_buf = mmap(0, sizeof(unsigned int) * GLOBAL_DATA->dimx * GLOBAL_DATA->dimy, 
-                                   PROT_READ | PROT_WRITE, MAP_SHARED, child_shm_fd, 0);
-    if (GLOBAL_DATA->mapped_buf == NULL) {
+    GLOBAL_DATA->channel = mmap(0, SHM_CHANNEL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, child_shm_fd, 0);
+    close(child_shm_fd);
+    if (GLOBAL_DATA->channel == MAP_FAILED) {
+      fprintf(stderr, "PLUGIN CHILD %d: Failed to setup memory mapping.\n", myid);
+      failed = 1;
+    }
+  }
+
+  /* The frame buffers: a memfd inherited from the parent */
+  int pool_fd = atoi(argv[4]);
+  struct stat st;
+  if (fstat(pool_fd, &st) < 0) {
+    fprintf(stderr, "PLUGIN CHILD %d: Failed to open the frame buffers (fd %s).\n", myid, argv[4]);
+    failed = 1;
+  } else {
+    GLOBAL_DATA->pool_size = st.st_size;
+    GLOBAL_DATA->pool = mmap(0, GLOBAL_DATA->pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
+    close(pool_fd);
+    if (GLOBAL_DATA->pool == MAP_FAILED) {
       fprintf(stderr, "PLUGIN CHILD %d: Failed to setup memory mapping.\n", myid);
       failed = 1;
-    }    
+    } else {
+      madvise(GLOBAL_DATA->pool, GLOBAL_DATA->pool_size, MADV_HUGEPAGE); // per mapping
+    }
+  }
+  int mask_fd = shm_open(argv[5], O_RDONLY, 0);
+  GLOBAL_DATA->mask_map = MAP_FAILED;
+  if (mask_fd >= 0 && fstat(mask_fd, &st) == 0) {
+    GLOBAL_DATA->mask_size = st.st_size;
+    GLOBAL_DATA->mask_map = mmap(0, GLOBAL_DATA->mask_size, PROT_READ, MAP_SHARED, mask_fd, 0);
   }
+  if (mask_fd >= 0) close(mask_fd);
+  if (GLOBAL_DATA->mask_map == MAP_FAILED ||
+      mask_runs_view(GLOBAL_DATA->mask_map, GLOBAL_DATA->mask_size, &GLOBAL_DATA->mask) < 0 ||
+      (GLOBAL_DATA->mask.npixels != 0 && GLOBAL_DATA->mask.npixels != (size_t)GLOBAL_DATA->dimx * GLOBAL_DATA->dimy)) {
+    fprintf(stderr, "PLUGIN CHILD %d: Failed to map the pixel mask %s.\n", myid, argv[5]);
+    failed = 1;
+  }
+
+  if (!failed) block_cache_init(&blocks, GLOBAL_DATA->group, GLOBAL_DATA->dimx, GLOBAL_DATA->dimy);
+
   if (failed != 0) {
     fprintf(stderr, "PLUGIN CHILD %d: Failed to start.\n", myid);
     exit(-1);
@@ -353,30 +401,47 @@ int main(int argc, char **argv) {
   prctl(PR_SET_PDEATHSIG, SIGUSR1); // TODO: this is not supported on Mac OS.
   #endif
 
-  int frame_num;
+  shm_msg msg;
   while (1) {
     /* receive command from the parent */
-    if (read(0, &frame_num, sizeof(int)) < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d ERROR: cannot read from parent.\n", myid);
-      // we cannot do anything but crash!
+    if (shm_ring_pop(&GLOBAL_DATA->channel->request, &msg, parent_alive, &ppid) < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d ERROR: the parent has gone.\n", myid);
+      break;
+    }
+    int frame_num = msg.frame;
+    if (frame_num == INVALID) {
+      // lets the parent stop listening to us
+      shm_ring_push(&GLOBAL_DATA->channel->done, &msg, parent_alive, &ppid);
+      break;
     }
-    if (frame_num == INVALID) break;
 
     /* do the work */
 //    fprintf(stderr, "PLUGIN CHILD %d: got request for frame #%d.\n", myid, frame_num);
-    int retval = get_data(myid, frame_num, GLOBAL_DATA->mapped_buf);
+    msg.queue_ns = elapsed_ns(msg.sent, latency_now());
+    msg.read_ns = msg.decode_ns = msg.mask_ns = 0;
+    size_t frame_size = (size_t)GLOBAL_DATA->dimx * GLOBAL_DATA->dimy;
+    if (msg.slot < 0 || (msg.slot + 1) * frame_size * sizeof(unsigned int) > GLOBAL_DATA->pool_size) {
+      fprintf(stderr, "PLUGIN CHILD %d ERROR: invalid slot %d for frame #%d.\n", myid, msg.slot, frame_num);
+      msg.retval = -1;
+    } else {
+      msg.retval = get_data(myid, frame_num, (int *)GLOBAL_DATA->pool + frame_size * msg.slot, &msg);
+    }
 
     /* send back the result */
-    if (write(1, &retval, sizeof(int)) < 0) {
-      fprintf(stderr, "PLUGIN CHILD %d ERROR: cannot write to parent.\n", myid);
+    if (shm_ring_push(&GLOBAL_DATA->channel->done, &msg, parent_alive, &ppid) < 0) {
+      fprintf(stderr, "PLUGIN CHILD %d ERROR: the parent has gone.\n", myid);
+      break;
     }
-//    fprintf(stderr, "PLUGIN CHILD %d: processed frame #%d with retval %d.\n", myid, frame_num, retval);
+//    fprintf(stderr, "PLUGIN CHILD %d: processed frame #%d with retval %d.\n", myid, frame_num, msg.retval);
   }
 
-  munmap(GLOBAL_DATA->mapped_buf, sizeof(unsigned int) * GLOBAL_DATA->dimx * GLOBAL_DATA->dimy);
+  munmap(GLOBAL_DATA->channel, SHM_CHANNEL_SIZE);
+  munmap(GLOBAL_DATA->pool, GLOBAL_DATA->pool_size);
   shm_unlink(argv[2]);
-  free(GLOBAL_DATA -> minus1);
-  free(GLOBAL_DATA -> minus2);
+  munmap(GLOBAL_DATA->mask_map, GLOBAL_DATA->mask_size);
+  block_cache_close(&blocks);
+  free(chunk);
+  free(raw);
   fprintf(stderr, "PLUGIN CHILD %d: finished.\n", myid);
   exit(-1);
 }
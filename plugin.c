@@ -13,7 +13,7 @@ To build:
 
  gcc -std=gnu99 -o plugin.so -shared -fPIC -g -O3 \
      -I/app/dials/base/include -L/app/dials/base/lib \
-     plugin.c \
+     plugin.c shm_ring.c frame_cache.c pixel_mask.c huge_pages.c latency_hist.c \
      -Ilz4 lz4/lz4.c lz4/h5zlz4.c \
      bitshuffle/bshuf_h5filter.c \
      bitshuffle/bshuf_h5plugin.c \
@@ -23,15 +23,44 @@ To build:
  Mac OS:
  TODO: need to test.
 
+Environment variables:
+ PLUGIN_NCHILD    number of worker processes (default: the CPUs we may
+                  use, from the affinity mask and the cgroup cpu.max quota)
+ PLUGIN_ADAPT     0 keeps all workers busy; by default only as many take
+                  requests as keep up with XDS (see adapt_children())
+ PLUGIN_PREFETCH  frames decoded ahead of a sequential reader
+                  (default: the number of workers, 0 to disable)
+ PLUGIN_NSLOTS    decoded frames kept in shared memory
+                  (default: twice the number of workers, as far as they
+                  fit in PLUGIN_POOL_MB)
+ PLUGIN_POOL_MB   memory for the decoded frames if PLUGIN_NSLOTS is not
+                  set (default 2048); fewer workers are started if each
+                  would not get a frame
+ PLUGIN_CACHE_DIR keep decoded frames in this directory for later
+                  sessions (see frame_cache.h; default: off)
+ PLUGIN_CACHE_MB  size limit of that directory (default 4096)
+ PLUGIN_CACHE_SHARE  percent of PLUGIN_CACHE_MB one dataset may use
+                  (default 25)
+ PLUGIN_CACHE_POLICY  what a full dataset cache does with new frames:
+                  "keep" the frames cached first, so that every pass
+                  rereads those from the cache (default), or "fifo",
+                  replacing the oldest
+ PLUGIN_STATS     write the telemetry summary (JSON) to this file, every
+                  PLUGIN_STATS_PERIOD seconds (default 10) and at the end,
+                  instead of to stderr at plugin_close
+
 TODO:
  Need better error exit to ensure shared memories are freed.
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #ifdef __linux
  #include <sys/prctl.h>
@@ -41,13 +70,29 @@ TODO:
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "hdf5_hl.h"
 #include "hdf5.h"
+#include "shm_ring.h"
+#include "frame_cache.h"
+#include "pixel_mask.h"
+#include "huge_pages.h"
+#include "latency_hist.h"
 
 #define INVALID -9999
 
 #define MAXCHILD 64
-#define DEFAULT_NCHILD 16
+#define DEFAULT_NCHILD 16 // if the affinity mask cannot be read
+#define MAXSLOTS 1024
+#define DEFAULT_CACHE_MB 4096
+#define DEFAULT_POOL_MB 2048 // decoded frames in memory, if PLUGIN_NSLOTS is not set
+#define ADAPT_PERIOD 0.5 // seconds between changes of the active children
+#define DEFAULT_STATS_PERIOD 10
+
+/* Stages timed by the workers, per child */
+enum { STAGE_DISPATCH, STAGE_READ, STAGE_DECODE, STAGE_MASK, NCHILD_STAGES };
+static const char *stage_names[NCHILD_STAGES] = {"dispatch", "read", "decode", "mask"};
 
 extern const H5Z_class2_t H5Z_LZ4;
 extern const H5Z_class2_t bshuf_H5Filter;
@@ -69,17 +114,526 @@ struct GlobalData {
   int block_start;
   unsigned int error_val;
   int nchild;
-  pthread_mutex_t locks[MAXCHILD];
-  unsigned int *mapped_bufs[MAXCHILD];
-  int ctop_pipes[MAXCHILD][2]; 
-  int ptoc_pipes[MAXCHILD][2];
+  int nframes;
+  pthread_mutex_t locks[MAXCHILD]; // one thread at a time pushes requests to a child
+  pid_t pids[MAXCHILD];
+  shm_channel *channels[MAXCHILD]; // in the shared memory of each child
+  pthread_t proxies[MAXCHILD];     // collect the replies of each child
+  int outstanding[MAXCHILD];       // requests sent and not answered, under pool_lock
+  int child_block[MAXCHILD];       // data block of the last request, which the child keeps open
+  int dead[MAXCHILD];
+
+  /* Only the first nactive children take new requests, under pool_lock */
+  int nactive, nactive_min, nactive_max;
+  int adapt;
+  double busy_since[MAXCHILD]; // when outstanding became non zero
+  double busy_time[MAXCHILD];  // seconds with work since adapt_start
+  double adapt_start;
+  long adapt_waits;            // nlate + nmiss at adapt_start
+
+  char mask_name[NAME_MAX]; // run list of the pixel mask, read only for the children
+
+  /* Decoded frames, shared with all children */
+  huge_buffer pool_buf; // a memfd, inherited by the children
+  size_t frame_bytes;
+  int nslots;
+  unsigned int *pool;
+  struct Slot *slots;
+  pthread_mutex_t pool_lock; // protects slots and everything below
+  pthread_cond_t pool_cond;  // a slot may be taken for another frame
+  unsigned long clock;
+
+  /* Sequential access detection */
+  int prefetch;  // frames to decode ahead
+  int last_frame;
+  int nsequential;
+
+  long nhit, nlate, nmiss, nprefetch, nwasted;
+
+  frame_cache cache; // frames of earlier sessions
+  long ncached;
+
+  /* Telemetry. Each proxy thread records what its child reports, so these
+     need no lock; callers of plugin_get_data record atomically. */
+  latency_hist (*child_hist)[NCHILD_STAGES];
+  latency_hist copy_hist;  // into the caller's array
+  latency_hist total_hist; // plugin_get_data as seen by XDS
+  uint64_t t_open;
+  char stats_path[4096];   // empty: summary to stderr
+  uint64_t stats_period, stats_due;
 };
 struct GlobalData *GLOBAL_DATA = NULL;
 
+#define SLOT_FREE    0
+#define SLOT_PENDING 1 // sent to a child
+#define SLOT_READY   2
+
+struct Slot {
+  int frame;
+  int child;       // decoding it while PENDING, -1 until submitted
+  int pushed;      // the request is in the child's ring
+  int state;
+  int retval;
+  int refs;        // callers waiting for or copying this frame
+  int prefetched;  // decoded ahead and not asked for yet
+  unsigned long used;
+  pthread_cond_t ready; // no longer PENDING
+};
+
+/* For shm_ring: has the child exited? */
+int child_alive(void *arg) {
+  pid_t pid = *(pid_t *)arg;
+  int status;
+  return waitpid(pid, &status, WNOHANG) == 0;
+}
+
 void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy,
                        int *number_of_frames, int info[1024],
                        int *error_flag);
-void child_loop(int myid);
+
+int env_int(const char *name, int default_value) {
+  char *env = getenv(name); // Do not free!
+  return (env == NULL) ? default_value : atoi(env);
+}
+
+double plugin_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+/* CPUs this process may run on: the affinity mask (taskset, Slurm's
+   cpusets), further limited by the cgroup v2 quota cpu.max of our cgroup
+   and its parents. A quota of 250000 per 100000 us allows 3 workers. */
+int available_cpus(void) {
+  int ncpu = DEFAULT_NCHILD;
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ncpu = CPU_COUNT(&cpus);
+
+  char line[4096], path[4200];
+  char *cgroup = NULL;
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f == NULL) return ncpu;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "0::/", 4) == 0) { // the v2 hierarchy
+      cgroup = line + 3;
+      cgroup[strcspn(cgroup, "\n")] = '\0';
+      break;
+    }
+  }
+  fclose(f);
+  if (cgroup == NULL) return ncpu;
+
+  while (1) {
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup);
+    f = fopen(path, "r");
+    if (f != NULL) {
+      char quota[32];
+      long period;
+      if (fscanf(f, "%31s %ld", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+        int limit = (atol(quota) + period - 1) / period;
+        if (limit < ncpu) ncpu = limit;
+      }
+      fclose(f);
+    }
+    char *slash = strrchr(cgroup, '/');
+    if (slash == cgroup) {
+      if (cgroup[1] == '\0') break;
+      cgroup[1] = '\0'; // the root
+    } else {
+      *slash = '\0';
+    }
+  }
+  return ncpu < 1 ? 1 : ncpu;
+}
+
+/* Map a shared memory of size bytes, creating it. Returns NULL on failure. */
+void *create_shm(const char *name, size_t size) {
+  int shm_fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (shm_fd == -1) {
+    fprintf(stderr, "PLUGIN ERROR: failed to create shared memory %s.\n", name);
+    return NULL;
+  }
+  if (ftruncate(shm_fd, size) < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to set the size of shared memory %s.\n", name);
+    close(shm_fd);
+    return NULL;
+  }
+  void *shm = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  // MAP_HUGETLB | 25 << MAP_HUGE_SHIFT causes SEGV in HDF5 lib
+  close(shm_fd);
+  if (shm == MAP_FAILED) {
+    fprintf(stderr, "PLUGIN ERROR: failed to mmap %s\n", name);
+    return NULL;
+  }
+  return shm;
+}
+
+/* Read the pixel mask once for all children and share its run list.
+   As before, pixels of both classes become -1. A run list over zero pixels
+   tells the children that there is no mask. */
+int share_mask(int nx, int ny) {
+  size_t npixels = (size_t)nx * ny;
+  mask_runs mask = {NULL, 0, 0, 0, 0};
+
+  signed int* pixel_mask = (signed int*)malloc(sizeof(signed int) * npixels);
+  if (pixel_mask == NULL) return -1;
+  pixel_mask[0] = INVALID;
+  H5LTread_dataset_int(GLOBAL_DATA->hdf, "/entry/instrument/detector/detectorSpecific/pixel_mask", pixel_mask);
+  if (pixel_mask[0] == INVALID) {
+    fprintf(stderr, "PLUGIN WARNING: failed to read the pixel mask from /entry/instrument/detector/detectorSpecific/pixel_mask.\n");
+  } else {
+    for (size_t i = 0; i < npixels; i++) {
+      if (pixel_mask[i] > 1) pixel_mask[i] = 1;
+    }
+    if (mask_runs_build(pixel_mask, npixels, &mask) < 0) {
+      fprintf(stderr, "PLUGIN ERROR: failed to allocate the pixel mask.\n");
+      free(pixel_mask);
+      return -1;
+    }
+    fprintf(stderr, "PLUGIN: #pixels masked to -1 = %zu in %zu runs.\n", mask.nminus1, mask.nruns);
+  }
+  free(pixel_mask);
+
+  size_t size = mask_runs_flat_size(&mask);
+  void *shm = create_shm(GLOBAL_DATA->mask_name, size);
+  if (shm == NULL) {
+    mask_runs_free(&mask);
+    return -1;
+  }
+  mask_runs_flatten(&mask, shm);
+  munmap(shm, size);
+  mask_runs_free(&mask);
+  return 0;
+}
+
+/* Change the number of requests queued at a child, keeping track of the
+   time it had work. Call with pool_lock held. */
+void child_queue(int child_id, int delta) {
+  double now = plugin_now();
+  if (GLOBAL_DATA->outstanding[child_id] == 0 && delta > 0) GLOBAL_DATA->busy_since[child_id] = now;
+  GLOBAL_DATA->outstanding[child_id] += delta;
+  if (GLOBAL_DATA->outstanding[child_id] == 0 && delta < 0) {
+    GLOBAL_DATA->busy_time[child_id] += now - GLOBAL_DATA->busy_since[child_id];
+  }
+}
+
+/* XDS runs its own MAXIMUM_NUMBER_OF_PROCESSORS threads on the same cores.
+   Every ADAPT_PERIOD, look at how busy the active children were: if
+   readers had to wait for frames while the children had work nearly all
+   the time, activate one more; if they were mostly idle, retire one.
+   Retired children sleep in their ring and leave their core to XDS.
+   Call with pool_lock held. */
+void adapt_children(void) {
+  double now = plugin_now();
+  double elapsed = now - GLOBAL_DATA->adapt_start;
+  if (elapsed < ADAPT_PERIOD) return;
+
+  double busy = 0;
+  for (int i = 0; i < GLOBAL_DATA->nchild; i++) {
+    if (GLOBAL_DATA->outstanding[i] > 0) {
+      GLOBAL_DATA->busy_time[i] += now - GLOBAL_DATA->busy_since[i];
+      GLOBAL_DATA->busy_since[i] = now;
+    }
+    if (i < GLOBAL_DATA->nactive) busy += GLOBAL_DATA->busy_time[i];
+    GLOBAL_DATA->busy_time[i] = 0;
+  }
+  double utilization = busy / (elapsed * GLOBAL_DATA->nactive);
+  long waits = GLOBAL_DATA->nlate + GLOBAL_DATA->nmiss;
+
+  if (GLOBAL_DATA->adapt) {
+    if (utilization > 0.75 && waits > GLOBAL_DATA->adapt_waits && GLOBAL_DATA->nactive < GLOBAL_DATA->nchild) {
+      GLOBAL_DATA->nactive++;
+    } else if (utilization < 0.25 && GLOBAL_DATA->nactive > 1) {
+      GLOBAL_DATA->nactive--;
+    }
+    if (GLOBAL_DATA->nactive < GLOBAL_DATA->nactive_min) GLOBAL_DATA->nactive_min = GLOBAL_DATA->nactive;
+    if (GLOBAL_DATA->nactive > GLOBAL_DATA->nactive_max) GLOBAL_DATA->nactive_max = GLOBAL_DATA->nactive;
+  }
+  GLOBAL_DATA->adapt_start = now;
+  GLOBAL_DATA->adapt_waits = waits;
+}
+
+/* Record the result of a slot and wake up whoever waits for it: only the
+   callers of this frame, and callers looking for a slot if nobody holds
+   this one. Call with pool_lock held. */
+void complete_slot(int slot, int retval) {
+  struct Slot *s = &GLOBAL_DATA->slots[slot];
+  s->state = SLOT_READY;
+  s->retval = retval;
+  if (retval != 0 && s->refs == 0) s->state = SLOT_FREE; // nobody wants a failed prefetch
+  if (s->refs > 0) {
+    pthread_cond_broadcast(&s->ready);
+  } else {
+    pthread_cond_broadcast(&GLOBAL_DATA->pool_cond);
+  }
+}
+
+/* Drop a reference to a slot that is no longer PENDING.
+   Call with pool_lock held. */
+void release_slot(struct Slot *s) {
+  s->refs--;
+  if (s->refs == 0) {
+    if (s->retval != 0) s->state = SLOT_FREE; // try again next time
+    pthread_cond_broadcast(&GLOBAL_DATA->pool_cond);
+  }
+}
+
+/* Receives the replies of one child. Replies come in the order of the
+   requests, but several requests can be outstanding. */
+void *proxy_loop(void *arg) {
+  int child_id = (int)(long)arg;
+  shm_channel *ch = GLOBAL_DATA->channels[child_id];
+  shm_msg msg;
+
+  while (shm_ring_pop(&ch->done, &msg, child_alive, &GLOBAL_DATA->pids[child_id]) == 0) {
+    if (msg.frame == INVALID) return NULL;
+    if (msg.retval == 0) {
+      latency_hist *h = GLOBAL_DATA->child_hist[child_id];
+      latency_hist_record(&h[STAGE_DISPATCH], msg.queue_ns);
+      latency_hist_record(&h[STAGE_READ], msg.read_ns);
+      latency_hist_record(&h[STAGE_DECODE], msg.decode_ns);
+      latency_hist_record(&h[STAGE_MASK], msg.mask_ns);
+    }
+    // Hand the frame over first and keep it in the frame cache while the
+    // callers copy it out; our reference keeps the slot from being reused.
+    int keep = msg.retval == 0 && GLOBAL_DATA->cache.map != NULL;
+    struct Slot *s = &GLOBAL_DATA->slots[msg.slot];
+    pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+    child_queue(child_id, -1);
+    if (s->state != SLOT_PENDING || s->frame != msg.frame || s->child != child_id) {
+      // The slot was failed and taken for another frame meanwhile
+      fprintf(stderr, "PLUGIN WARNING: dropped a stale reply of child #%d for frame #%d.\n", child_id, msg.frame);
+      pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+      continue;
+    }
+    complete_slot(msg.slot, msg.retval);
+    if (keep) s->refs++;
+    pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+
+    if (keep) {
+      frame_cache_put(&GLOBAL_DATA->cache, msg.frame, (char *)GLOBAL_DATA->pool + GLOBAL_DATA->frame_bytes * msg.slot);
+      pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+      release_slot(s);
+      pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+    }
+  }
+
+  /* The child died: fail everything it still had to do. Slots still being
+     submitted to it are failed by submit_slot. */
+  fprintf(stderr, "PLUGIN ERROR: child #%d died.\n", child_id);
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  GLOBAL_DATA->dead[child_id] = 1;
+  for (int i = 0; i < GLOBAL_DATA->nslots; i++) {
+    struct Slot *s = &GLOBAL_DATA->slots[i];
+    if (s->state == SLOT_PENDING && s->child == child_id && s->pushed) complete_slot(i, -1);
+  }
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+  return NULL;
+}
+
+/* The active child with the fewest requests in its queue; among those,
+   preferably one that has the data block of frame open already. Falls back
+   to retired children only if all active ones are dead. Returns -1 if all
+   children are dead. Call with pool_lock held. */
+int choose_child(int frame) {
+  int block = GLOBAL_DATA->block_start + (frame - 1) / GLOBAL_DATA->nframesPerDataset;
+  int best = -1, best_other_block = 0;
+
+  for (int i = 0; i < GLOBAL_DATA->nchild; i++) {
+    if (GLOBAL_DATA->dead[i]) continue;
+    if (i >= GLOBAL_DATA->nactive && best >= 0) break;
+    int other_block = GLOBAL_DATA->child_block[i] != block;
+    if (best < 0 || GLOBAL_DATA->outstanding[i] < GLOBAL_DATA->outstanding[best] ||
+        (GLOBAL_DATA->outstanding[i] == GLOBAL_DATA->outstanding[best] && best_other_block && !other_block)) {
+      best = i;
+      best_other_block = other_block;
+    }
+  }
+  return best;
+}
+
+/* Ask a child to decode the frame of a PENDING slot.
+   Returns the child, or -1 if the slot failed. */
+int submit_slot(int slot) {
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  struct Slot *s = &GLOBAL_DATA->slots[slot];
+  int frame = s->frame;
+  adapt_children();
+  int child_id = choose_child(frame);
+  if (child_id < 0) {
+    fprintf(stderr, "PLUGIN ERROR: no child left for frame #%d.\n", frame);
+    complete_slot(slot, -1);
+    pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+    return -1;
+  }
+  s->child = child_id;
+  child_queue(child_id, 1);
+  GLOBAL_DATA->child_block[child_id] = GLOBAL_DATA->block_start + (frame - 1) / GLOBAL_DATA->nframesPerDataset;
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+
+  shm_msg msg = {.frame = frame, .slot = slot, .sent = latency_now()};
+  pthread_mutex_lock(&GLOBAL_DATA->locks[child_id]);
+  int ret = shm_ring_push(&GLOBAL_DATA->channels[child_id]->request, &msg, child_alive, &GLOBAL_DATA->pids[child_id]);
+  pthread_mutex_unlock(&GLOBAL_DATA->locks[child_id]);
+
+  // Until pushed is set, the slot is ours: a dying child's proxy leaves it
+  // alone. Once the request is in the ring, the reply may already have
+  // completed the slot.
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  int ours = s->state == SLOT_PENDING && s->frame == frame && s->child == child_id && !s->pushed;
+  if (ret < 0) {
+    fprintf(stderr, "PLUGIN ERROR: cannot send frame #%d to child #%d.\n", frame, child_id);
+    child_queue(child_id, -1);
+    GLOBAL_DATA->dead[child_id] = 1;
+    if (ours) complete_slot(slot, -1);
+    pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+    return -1;
+  }
+  if (ours) {
+    s->pushed = 1;
+    if (GLOBAL_DATA->dead[child_id]) { // its proxy has given up already
+      complete_slot(slot, -1);
+      child_id = -1;
+    }
+  }
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+  return child_id;
+}
+
+/* Call with pool_lock held */
+int find_slot(int frame) {
+  for (int i = 0; i < GLOBAL_DATA->nslots; i++) {
+    if (GLOBAL_DATA->slots[i].state != SLOT_FREE && GLOBAL_DATA->slots[i].frame == frame) return i;
+  }
+  return -1;
+}
+
+/* Take a slot for frame, evicting the least recently used unused frame.
+   Prefetching does not evict frames that were prefetched and not asked for yet.
+   Returns -1 if there is none. Call with pool_lock held. */
+int alloc_slot(int frame, int for_prefetch) {
+  int best = -1;
+  for (int i = 0; i < GLOBAL_DATA->nslots; i++) {
+    struct Slot *s = &GLOBAL_DATA->slots[i];
+    if (s->state == SLOT_FREE) {
+      best = i;
+      break;
+    }
+    if (s->state != SLOT_READY || s->refs > 0) continue;
+    if (for_prefetch && s->prefetched) continue;
+    if (best < 0 || s->used < GLOBAL_DATA->slots[best].used) best = i;
+  }
+  if (best < 0) return -1;
+
+  struct Slot *s = &GLOBAL_DATA->slots[best];
+  if (s->state == SLOT_READY && s->prefetched) GLOBAL_DATA->nwasted++;
+  s->frame = frame;
+  s->state = SLOT_PENDING;
+  s->child = -1;
+  s->pushed = 0;
+  s->retval = 0;
+  s->refs = 0;
+  s->prefetched = for_prefetch;
+  s->used = ++GLOBAL_DATA->clock;
+  return best;
+}
+
+/* XDS threads ask for frames in nearly increasing order. Once a few
+   requests in a row landed close to the previous one, take slots for the
+   frames that follow. Returns the number of slots in list, to be
+   submitted. Call with pool_lock held. */
+int plan_prefetch(int frame, int *list) {
+  int window = GLOBAL_DATA->nchild;
+  int n = 0;
+
+  if (abs(frame - GLOBAL_DATA->last_frame) <= window) {
+    GLOBAL_DATA->nsequential++;
+  } else {
+    GLOBAL_DATA->nsequential = 0;
+  }
+  GLOBAL_DATA->last_frame = frame;
+  if (GLOBAL_DATA->nsequential < 2) return 0;
+
+  for (int f = frame + 1; f <= frame + GLOBAL_DATA->prefetch && f <= GLOBAL_DATA->nframes; f++) {
+    if (find_slot(f) >= 0 || frame_cache_has(&GLOBAL_DATA->cache, f)) continue;
+    int slot = alloc_slot(f, 1);
+    if (slot < 0) break;
+    list[n++] = slot;
+    GLOBAL_DATA->nprefetch++;
+  }
+  return n;
+}
+
+/* Where the time went. If the workers were busy most of the time and
+   callers spent it waiting in plugin_get_data, the plugin holds XDS back;
+   if the workers idled, XDS is the bottleneck. The histograms are read
+   while they may still be updated, which can only skew a snapshot by the
+   frames in flight. */
+void write_stats(FILE *out) {
+  int nchild = GLOBAL_DATA->nchild;
+  latency_hist *stages = (latency_hist *)calloc(NCHILD_STAGES, sizeof(latency_hist));
+  if (stages == NULL) return;
+  double busy = 0;
+  for (int i = 0; i < nchild; i++) {
+    for (int j = 0; j < NCHILD_STAGES; j++) {
+      latency_hist_merge(&stages[j], &GLOBAL_DATA->child_hist[i][j]);
+      if (j != STAGE_DISPATCH) busy += 1E-9 * GLOBAL_DATA->child_hist[i][j].sum;
+    }
+  }
+  double elapsed = 1E-9 * (latency_now() - GLOBAL_DATA->t_open);
+  const latency_hist *total = &GLOBAL_DATA->total_hist;
+
+  fprintf(out, "{\"frames\": %llu, \"seconds\": %.3f, \"frames_per_second\": %.1f,\n",
+          (unsigned long long)total->count, elapsed, elapsed > 0 ? total->count / elapsed : 0.0);
+  fprintf(out, " \"seconds_in_get_data\": %.3f, \"workers\": %d, \"worker_busy\": %.3f,\n",
+          1E-9 * total->sum, nchild, elapsed > 0 ? busy / (elapsed * nchild) : 0.0);
+  fprintf(out, " \"requests\": {\"frame_cache\": %ld, \"ready\": %ld, \"being_decoded\": %ld, \"not_prefetched\": %ld, "
+          "\"prefetched\": %ld, \"evicted_unused\": %ld},\n",
+          GLOBAL_DATA->ncached, GLOBAL_DATA->nhit, GLOBAL_DATA->nlate, GLOBAL_DATA->nmiss,
+          GLOBAL_DATA->nprefetch, GLOBAL_DATA->nwasted);
+  fprintf(out, " \"stages\": {\n");
+  for (int j = 0; j < NCHILD_STAGES; j++) {
+    fprintf(out, "  \"%s\": ", stage_names[j]);
+    latency_hist_json(&stages[j], out);
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "  \"copy\": ");
+  latency_hist_json(&GLOBAL_DATA->copy_hist, out);
+  fprintf(out, ",\n  \"total\": ");
+  latency_hist_json(total, out);
+  fprintf(out, "\n }\n}\n");
+  free(stages);
+}
+
+/* Replace the PLUGIN_STATS file, so that readers never see half of it */
+void write_stats_file(void) {
+  char tmp[sizeof(GLOBAL_DATA->stats_path) + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", GLOBAL_DATA->stats_path, (int)getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    fprintf(stderr, "PLUGIN WARNING: cannot write %s.\n", tmp);
+    return;
+  }
+  write_stats(f);
+  if (fclose(f) != 0 || rename(tmp, GLOBAL_DATA->stats_path) != 0) {
+    fprintf(stderr, "PLUGIN WARNING: cannot write %s.\n", GLOBAL_DATA->stats_path);
+    unlink(tmp);
+  }
+}
+
+/* Caller side of the telemetry, from plugin_get_data */
+void record_request(uint64_t t_start, uint64_t t_copy) {
+  uint64_t now = latency_now();
+  latency_hist_record_atomic(&GLOBAL_DATA->copy_hist, now - t_copy);
+  latency_hist_record_atomic(&GLOBAL_DATA->total_hist, now - t_start);
+
+  uint64_t due = GLOBAL_DATA->stats_due;
+  if (GLOBAL_DATA->stats_path[0] != '\0' && now >= due &&
+      __sync_bool_compare_and_swap(&GLOBAL_DATA->stats_due, due, now + GLOBAL_DATA->stats_period)) {
+    write_stats_file(); // by one caller at a time
+  }
+}
 
 void plugin_open(const char *filename, int info_array[1024], int *error_flag) {
   register_filters();
@@ -102,8 +656,15 @@ void plugin_open(const char *filename, int info_array[1024], int *error_flag) {
   }
 
   /* Setup global variables */
-  GLOBAL_DATA = (struct GlobalData*)malloc(sizeof(struct GlobalData));
+  GLOBAL_DATA = (struct GlobalData*)calloc(1, sizeof(struct GlobalData));
   strcpy(GLOBAL_DATA->filename, fn);
+  pthread_mutex_init(&GLOBAL_DATA->pool_lock, NULL);
+  pthread_cond_init(&GLOBAL_DATA->pool_cond, NULL);
+  GLOBAL_DATA->t_open = latency_now();
+  char *stats_path = getenv("PLUGIN_STATS"); // Do not free!
+  if (stats_path != NULL) snprintf(GLOBAL_DATA->stats_path, sizeof(GLOBAL_DATA->stats_path), "%s", stats_path);
+  GLOBAL_DATA->stats_period = (uint64_t)env_int("PLUGIN_STATS_PERIOD", DEFAULT_STATS_PERIOD) * 1000000000;
+  GLOBAL_DATA->stats_due = GLOBAL_DATA->t_open + GLOBAL_DATA->stats_period;
 
   GLOBAL_DATA->hdf = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
   if (GLOBAL_DATA->hdf < 0) {
@@ -112,61 +673,111 @@ void plugin_open(const char *filename, int info_array[1024], int *error_flag) {
     return;
   }
 
+  int nx, ny, nbytes, nframes, info[1024], dummy;
+  float qx, qy;
+  plugin_get_header(&nx, &ny, &nbytes, &qx, &qy, &nframes, info, &dummy);
+  GLOBAL_DATA->nframes = nframes;
+  GLOBAL_DATA->last_frame = -MAXCHILD;
+  GLOBAL_DATA->frame_bytes = sizeof(unsigned int) * nx * ny;
+
   /* Decide the number of child */
-  char *env_nchild = getenv("PLUGIN_NCHILD"); // Do not free!
-  if (env_nchild == NULL) {
-    GLOBAL_DATA->nchild = DEFAULT_NCHILD;
-  } else {
-    GLOBAL_DATA->nchild = atoi(env_nchild);
-    if (GLOBAL_DATA->nchild > MAXCHILD) {
-      fprintf(stderr, "PLUGIN WARNING: The maximum number of the child processes is limited to %d.\n", MAXCHILD);
-      GLOBAL_DATA->nchild = MAXCHILD;
+  int ncpu = available_cpus();
+  GLOBAL_DATA->nchild = env_int("PLUGIN_NCHILD", ncpu);
+  if (GLOBAL_DATA->nchild < 1) GLOBAL_DATA->nchild = 1;
+  if (GLOBAL_DATA->nchild > MAXCHILD) {
+    fprintf(stderr, "PLUGIN WARNING: The maximum number of the child processes is limited to %d.\n", MAXCHILD);
+    GLOBAL_DATA->nchild = MAXCHILD;
+  }
+
+  /* Decoded frames kept: at least one per child, plus room to prefetch.
+     By default the pool stays within PLUGIN_POOL_MB; children that would
+     have no frame buffer are not started. */
+  GLOBAL_DATA->nslots = env_int("PLUGIN_NSLOTS", 0);
+  if (GLOBAL_DATA->nslots <= 0) {
+    size_t budget = (size_t)env_int("PLUGIN_POOL_MB", DEFAULT_POOL_MB) << 20;
+    size_t fit = (GLOBAL_DATA->frame_bytes > 0) ? budget / GLOBAL_DATA->frame_bytes : 2;
+    GLOBAL_DATA->nslots = 2 * GLOBAL_DATA->nchild;
+    if ((size_t)GLOBAL_DATA->nslots > fit) GLOBAL_DATA->nslots = (fit > 2) ? (int)fit : 2;
+    if (GLOBAL_DATA->nchild > GLOBAL_DATA->nslots) {
+      fprintf(stderr, "PLUGIN INFO: %d frames of %zu MB fit in PLUGIN_POOL_MB, running %d child processes instead of %d.\n",
+              GLOBAL_DATA->nslots, GLOBAL_DATA->frame_bytes >> 20, GLOBAL_DATA->nslots, GLOBAL_DATA->nchild);
+      GLOBAL_DATA->nchild = GLOBAL_DATA->nslots;
     }
   }
-  fprintf(stderr, "PLUGIN INFO: Running with %d child processes.\n", GLOBAL_DATA->nchild);
+  if (GLOBAL_DATA->nslots < GLOBAL_DATA->nchild) GLOBAL_DATA->nslots = GLOBAL_DATA->nchild;
+  if (GLOBAL_DATA->nslots > MAXSLOTS) GLOBAL_DATA->nslots = MAXSLOTS;
 
-  int nx, ny, nbytes, nframes, info[1024], dummy;
-  float qx, qy;
-  plugin_get_header(&nx, &ny, &nbytes, &qx, &qy, &nframes, info, &dummy);
+  GLOBAL_DATA->adapt = env_int("PLUGIN_ADAPT", 1);
+  GLOBAL_DATA->nactive = GLOBAL_DATA->nactive_min = GLOBAL_DATA->nactive_max = GLOBAL_DATA->nchild;
+  GLOBAL_DATA->adapt_start = plugin_now();
+  fprintf(stderr, "PLUGIN INFO: Running with %d child processes (%d CPUs available)%s.\n", GLOBAL_DATA->nchild, ncpu,
+          GLOBAL_DATA->adapt ? ", retiring idle ones" : "");
+
+  GLOBAL_DATA->prefetch = env_int("PLUGIN_PREFETCH", GLOBAL_DATA->nchild);
+  if (GLOBAL_DATA->prefetch < 0) GLOBAL_DATA->prefetch = 0;
+  fprintf(stderr, "PLUGIN INFO: Keeping %d decoded frames (%zu MB), prefetching %d.\n", GLOBAL_DATA->nslots,
+          (GLOBAL_DATA->frame_bytes * GLOBAL_DATA->nslots) >> 20, GLOBAL_DATA->prefetch);
+
+  char *cache_dir = getenv("PLUGIN_CACHE_DIR"); // Do not free!
+  if (cache_dir != NULL) {
+    size_t limit = (size_t)env_int("PLUGIN_CACHE_MB", DEFAULT_CACHE_MB) << 20;
+    int share = env_int("PLUGIN_CACHE_SHARE", FRAME_CACHE_DEFAULT_SHARE);
+    char *policy_name = getenv("PLUGIN_CACHE_POLICY"); // Do not free!
+    int policy = FRAME_CACHE_KEEP;
+    if (policy_name != NULL && strcmp(policy_name, "fifo") == 0) {
+      policy = FRAME_CACHE_FIFO;
+    } else if (policy_name != NULL && strcmp(policy_name, "keep") != 0) {
+      fprintf(stderr, "PLUGIN WARNING: Unknown PLUGIN_CACHE_POLICY %s, using keep.\n", policy_name);
+    }
+    if (frame_cache_open(&GLOBAL_DATA->cache, cache_dir, fn, sizeof(unsigned int) * nx * ny, nframes, limit,
+                         share, policy) == 0) {
+      fprintf(stderr, "PLUGIN INFO: Caching up to %u decoded frames in %s (%s).\n", GLOBAL_DATA->cache.nslots,
+              GLOBAL_DATA->cache.path, (policy == FRAME_CACHE_FIFO) ? "fifo" : "keep");
+    } else {
+      fprintf(stderr, "PLUGIN WARNING: Cannot cache frames in %s.\n", cache_dir);
+    }
+  }
 
   /* Setup and start child processes */
   int ppid = getpid();
   char child_id[16];
 
+  snprintf(GLOBAL_DATA->mask_name, NAME_MAX, "/plugin%d_mask.shm", ppid);
+  if (share_mask(nx, ny) < 0) {
+    *error_flag = -2;
+    return;
+  }
+
+  if (huge_alloc(&GLOBAL_DATA->pool_buf, GLOBAL_DATA->frame_bytes * GLOBAL_DATA->nslots, 1) < 0) {
+    fprintf(stderr, "PLUGIN ERROR: failed to allocate %d frame buffers.\n", GLOBAL_DATA->nslots);
+    *error_flag = -2;
+    return;
+  }
+  GLOBAL_DATA->pool = (unsigned int *)GLOBAL_DATA->pool_buf.ptr;
+  fprintf(stderr, "PLUGIN INFO: Frame buffers on %s.\n", huge_pages_name(GLOBAL_DATA->pool_buf.kind));
+  char pool_fd[16];
+  snprintf(pool_fd, 16, "%d", GLOBAL_DATA->pool_buf.fd);
+  GLOBAL_DATA->slots = (struct Slot *)calloc(GLOBAL_DATA->nslots, sizeof(struct Slot));
+  GLOBAL_DATA->child_hist = calloc(GLOBAL_DATA->nchild, sizeof(*GLOBAL_DATA->child_hist));
+  if (GLOBAL_DATA->slots == NULL || GLOBAL_DATA->child_hist == NULL) {
+    *error_flag = -2;
+    return;
+  }
+  for (int i = 0; i < GLOBAL_DATA->nslots; i++) pthread_cond_init(&GLOBAL_DATA->slots[i].ready, NULL);
+
   for (int i = 0; i < GLOBAL_DATA->nchild; i++) {
     snprintf(child_id, 16, "%d", i);
     pthread_mutex_init(&GLOBAL_DATA->locks[i], NULL);
 
-    /* setup bi-directional pipes to child process */
-    int pipe1 = pipe(&GLOBAL_DATA->ctop_pipes[i][0]);
-    int pipe2 = pipe(&GLOBAL_DATA->ptoc_pipes[i][0]);
-    if (pipe1 < 0 || pipe2 < 0) {
-      fprintf(stderr, "PLUGIN ERROR: Failed to create pipes for child %d.\n", i);
-      *error_flag = -2;
-      return;
-    }
-
-    /* allocate shared memory and setup memory mapping */
+    /* allocate shared memory for the command rings */
     snprintf(GLOBAL_DATA->shm_names[i], NAME_MAX, "/plugin%d_%d.shm", ppid, i);
-    int shm_fd = shm_open(GLOBAL_DATA->shm_names[i], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (shm_fd == -1) {
-      fprintf(stderr, "PLUGIN ERROR: failed to create shared memory %s.\n", GLOBAL_DATA->shm_names[i]);
-      *error_flag = -2;
-      return;
-    }
-    if (ftruncate(shm_fd, sizeof(unsigned int) * nx * ny) < 0) {
-      fprintf(stderr, "PLUGIN ERROR: failed to set the size of shared memory %s.\n", GLOBAL_DATA->shm_names[i]);
-      *error_flag = -2;
-      return;
-    }
-    GLOBAL_DATA->mapped_bufs[i] = mmap(0, sizeof(unsigned int) * nx * ny, 
-                                          PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    // MAP_HUGETLB | 25 << MAP_HUGE_SHIFT causes SEGV in HDF5 lib
-    if (GLOBAL_DATA->mapped_bufs[i] == NULL) {
-      fprintf(stderr, "PLUGIN ERROR: failed to mmap %s\n", GLOBAL_DATA->shm_names[i]);
+    GLOBAL_DATA->channels[i] = (shm_channel *)create_shm(GLOBAL_DATA->shm_names[i], SHM_CHANNEL_SIZE);
+    if (GLOBAL_DATA->channels[i] == NULL) {
       *error_flag = -2;
       return;
     }
+    shm_ring_init(&GLOBAL_DATA->channels[i]->request);
+    shm_ring_init(&GLOBAL_DATA->channels[i]->done);
 
     /* start child process */
     int pid = fork();
@@ -177,20 +788,15 @@ void plugin_open(const char *filename, int info_array[1024], int *error_flag) {
     }
     if (pid == 0) {
       /* This is a child */
-      dup2(GLOBAL_DATA->ptoc_pipes[i][0], 0); // replace STDIN
-      dup2(GLOBAL_DATA->ctop_pipes[i][1], 1); // replace STDOUT
-      close(GLOBAL_DATA->ctop_pipes[i][0]);
-      close(GLOBAL_DATA->ctop_pipes[i][1]);
-      close(GLOBAL_DATA->ptoc_pipes[i][0]);
-      close(GLOBAL_DATA->ptoc_pipes[i][1]);
-      execlp("plugin-worker", "plugin-worker", fn, GLOBAL_DATA->shm_names[i], child_id, NULL);
+      execlp("plugin-worker", "plugin-worker", fn, GLOBAL_DATA->shm_names[i], child_id, pool_fd,
+             GLOBAL_DATA->mask_name, NULL);
       fprintf(stderr, "PLUGIN CHILD: Failed to launch plugin-worker. Is it in the PATH?\n");
       exit(-1);
-    } else {
-      /* This is the parent */
-      close(GLOBAL_DATA->ctop_pipes[i][1]);
-      close(GLOBAL_DATA->ptoc_pipes[i][0]);
     }
+    /* This is the parent */
+    GLOBAL_DATA->pids[i] = pid;
+    GLOBAL_DATA->child_block[i] = -1;
+    pthread_create(&GLOBAL_DATA->proxies[i], NULL, proxy_loop, (void *)(long)i);
   }
 
   *error_flag = 0;
@@ -327,40 +933,128 @@ void plugin_get_data(int *frame_number, int *nx, int *ny,
     return;
   }
 
-  int child_id = *frame_number % GLOBAL_DATA->nchild;
-  pthread_mutex_lock(&GLOBAL_DATA->locks[child_id]);
-  fprintf(stderr, "PLUGIN PARENT: get_data for frame #%d delegated to child #%d.\n", *frame_number, child_id);
-  if (write(GLOBAL_DATA->ptoc_pipes[child_id][1], frame_number, sizeof(int)) < 0) {
-    fprintf(stderr, "PLUGIN ERROR: cannot write to child #%d for frame #%d.\n", child_id, *frame_number);
-    *error_flag = -1;
+  int frame = *frame_number;
+  int submit[MAXSLOTS + 1], nsubmit = 0;
+  uint64_t t_start = latency_now();
+
+  if (frame_cache_get(&GLOBAL_DATA->cache, frame, data_array)) {
+    __sync_fetch_and_add(&GLOBAL_DATA->ncached, 1);
+    record_request(t_start, t_start);
+    *error_flag = 0;
     return;
   }
 
-  int retval;
-  if (read(GLOBAL_DATA->ctop_pipes[child_id][0], &retval, sizeof(int)) < 0) {
-    fprintf(stderr, "PLUGIN ERROR: cannot read from child #%d for frame #%d.\n", child_id, *frame_number);
-    *error_flag = -1;
-    return;
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  int slot = find_slot(frame);
+  if (slot >= 0) {
+    struct Slot *s = &GLOBAL_DATA->slots[slot];
+    if (s->state == SLOT_READY) {
+      GLOBAL_DATA->nhit++;
+    } else {
+      GLOBAL_DATA->nlate++;
+    }
+    s->prefetched = 0;
+  } else {
+    GLOBAL_DATA->nmiss++;
+    while ((slot = alloc_slot(frame, 0)) < 0) {
+      // every slot is being decoded or copied
+      pthread_cond_wait(&GLOBAL_DATA->pool_cond, &GLOBAL_DATA->pool_lock);
+      if ((slot = find_slot(frame)) >= 0) break; // requested by another thread meanwhile
+    }
+    if (GLOBAL_DATA->slots[slot].state == SLOT_PENDING && GLOBAL_DATA->slots[slot].refs == 0 &&
+        !GLOBAL_DATA->slots[slot].prefetched) {
+      submit[nsubmit++] = slot;
+    }
+  }
+  struct Slot *s = &GLOBAL_DATA->slots[slot];
+  s->refs++;
+  if (GLOBAL_DATA->prefetch > 0) nsubmit += plan_prefetch(frame, submit + nsubmit);
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+
+  // the requested frame, if it has to be decoded, goes first
+  for (int i = 0; i < nsubmit; i++) submit_slot(submit[i]);
+
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  while (s->state == SLOT_PENDING) {
+    pthread_cond_wait(&s->ready, &GLOBAL_DATA->pool_lock);
   }
-//  fprintf(stderr, "PLUGIN PARENT: received %d for frame #%d from child #%d.\n", retval, *frame_number, child_id);
+  int retval = s->retval;
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+
+  // The slot cannot be reused while we hold a reference.
+  uint64_t t_copy = latency_now();
   if (retval == 0) {
-    memcpy(data_array, GLOBAL_DATA->mapped_bufs[child_id], sizeof(unsigned int) * GLOBAL_DATA->dimx * GLOBAL_DATA->dimy);
+    memcpy(data_array, (char *)GLOBAL_DATA->pool + GLOBAL_DATA->frame_bytes * slot, GLOBAL_DATA->frame_bytes);
   }
-  pthread_mutex_unlock(&GLOBAL_DATA->locks[child_id]);
 
+  pthread_mutex_lock(&GLOBAL_DATA->pool_lock);
+  s->used = ++GLOBAL_DATA->clock;
+  release_slot(s);
+  pthread_mutex_unlock(&GLOBAL_DATA->pool_lock);
+
+  if (retval == 0) record_request(t_start, t_copy);
   *error_flag = retval;
   return;
 }
 
 void plugin_close(int *error_flag){
   printf("PLUGIN PARENT: plugin_close called.\n");
+  if (GLOBAL_DATA == NULL) {
+    *error_flag = 0;
+    return;
+  }
+
+  long nrequest = GLOBAL_DATA->ncached + GLOBAL_DATA->nhit + GLOBAL_DATA->nlate + GLOBAL_DATA->nmiss;
+  fprintf(stderr, "PLUGIN INFO: %ld frames requested: %ld from the frame cache, %ld ready (%.1f%%), %ld being decoded, %ld not prefetched.\n",
+          nrequest, GLOBAL_DATA->ncached, GLOBAL_DATA->nhit,
+          nrequest > 0 ? 100.0 * (GLOBAL_DATA->ncached + GLOBAL_DATA->nhit) / nrequest : 0.0,
+          GLOBAL_DATA->nlate, GLOBAL_DATA->nmiss);
+  fprintf(stderr, "PLUGIN INFO: %ld frames prefetched, %ld of them evicted before use.\n",
+          GLOBAL_DATA->nprefetch, GLOBAL_DATA->nwasted);
+  if (GLOBAL_DATA->adapt) {
+    fprintf(stderr, "PLUGIN INFO: %d to %d of %d children took requests, %d at the end.\n",
+            GLOBAL_DATA->nactive_min, GLOBAL_DATA->nactive_max, GLOBAL_DATA->nchild, GLOBAL_DATA->nactive);
+  }
 
   for (int i = 0; i < GLOBAL_DATA->nchild; i++) {
-    int val = INVALID;
-    if (write(GLOBAL_DATA->ptoc_pipes[i][1], &val, sizeof(int)) < 0) {
-      fprintf(stderr, "PLUGIN ERROR: cannot write to child #%d for exit.\n", i);
+    shm_msg msg = {INVALID, 0, 0};
+    pthread_mutex_lock(&GLOBAL_DATA->locks[i]);
+    if (shm_ring_push(&GLOBAL_DATA->channels[i]->request, &msg, child_alive, &GLOBAL_DATA->pids[i]) < 0) {
+      fprintf(stderr, "PLUGIN ERROR: cannot send exit to child #%d.\n", i);
     }
-    munmap(GLOBAL_DATA->mapped_bufs[i], sizeof(unsigned int) * GLOBAL_DATA->dimx * GLOBAL_DATA->dimy);
+    pthread_mutex_unlock(&GLOBAL_DATA->locks[i]);
+  }
+  for (int i = 0; i < GLOBAL_DATA->nchild; i++) {
+    pthread_join(GLOBAL_DATA->proxies[i], NULL);
+    munmap(GLOBAL_DATA->channels[i], SHM_CHANNEL_SIZE);
     shm_unlink(GLOBAL_DATA->shm_names[i]);
   }
+
+  /* The children are gone: the telemetry is final */
+  fprintf(stderr, "PLUGIN INFO: time per frame in each stage:\n");
+  for (int j = 0; j < NCHILD_STAGES; j++) {
+    latency_hist h = {0};
+    for (int i = 0; i < GLOBAL_DATA->nchild; i++) latency_hist_merge(&h, &GLOBAL_DATA->child_hist[i][j]);
+    latency_hist_report(&h, stage_names[j], stderr);
+  }
+  latency_hist_report(&GLOBAL_DATA->copy_hist, "copy", stderr);
+  latency_hist_report(&GLOBAL_DATA->total_hist, "total", stderr);
+  fprintf(stderr, "PLUGIN INFO: latency of plugin_get_data:\n");
+  latency_hist_print(&GLOBAL_DATA->total_hist, stderr);
+  if (GLOBAL_DATA->stats_path[0] != '\0') {
+    write_stats_file();
+  } else {
+    write_stats(stderr);
+  }
+  free(GLOBAL_DATA->child_hist);
+
+  frame_cache_close(&GLOBAL_DATA->cache);
+  huge_free(&GLOBAL_DATA->pool_buf);
+  shm_unlink(GLOBAL_DATA->mask_name);
+  for (int i = 0; i < GLOBAL_DATA->nslots; i++) pthread_cond_destroy(&GLOBAL_DATA->slots[i].ready);
+  free(GLOBAL_DATA->slots);
+  free(GLOBAL_DATA);
+  GLOBAL_DATA = NULL;
+
+  *error_flag = 0;
 }
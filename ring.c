@@ -0,0 +1,111 @@
+/*
+ Bounded blocking ring buffer. See ring.h.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring.h"
+
+double ring_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+/* Must be called with the lock held, before count changes. */
+static void ring_account(ring *r) {
+  double t = ring_now();
+  r->occupancy_integral += r->count * (t - r->t_last);
+  r->t_last = t;
+}
+
+int ring_init(ring *r, int capacity) {
+  r->items = (void **)malloc(sizeof(void *) * capacity);
+  if (r->items == NULL) return -1;
+  r->capacity = capacity;
+  r->head = 0;
+  r->count = 0;
+  r->closed = 0;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->not_full, NULL);
+  pthread_cond_init(&r->not_empty, NULL);
+
+  r->t_start = r->t_last = ring_now();
+  r->occupancy_integral = 0;
+  r->push_wait = r->pop_wait = 0;
+  r->npush = 0;
+  return 0;
+}
+
+void ring_destroy(ring *r) {
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->not_full);
+  pthread_cond_destroy(&r->not_empty);
+  free(r->items);
+  r->items = NULL;
+}
+
+int ring_push(ring *r, void *item) {
+  pthread_mutex_lock(&r->lock);
+  if (r->count == r->capacity && !r->closed) {
+    double t0 = ring_now();
+    while (r->count == r->capacity && !r->closed) {
+      pthread_cond_wait(&r->not_full, &r->lock);
+    }
+    r->push_wait += ring_now() - t0;
+  }
+  if (r->closed) {
+    pthread_mutex_unlock(&r->lock);
+    return -1;
+  }
+  ring_account(r);
+  r->items[(r->head + r->count) % r->capacity] = item;
+  r->count++;
+  r->npush++;
+  pthread_cond_signal(&r->not_empty);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+void *ring_pop(ring *r) {
+  void *item = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  if (r->count == 0 && !r->closed) {
+    double t0 = ring_now();
+    while (r->count == 0 && !r->closed) {
+      pthread_cond_wait(&r->not_empty, &r->lock);
+    }
+    r->pop_wait += ring_now() - t0;
+  }
+  if (r->count > 0) {
+    ring_account(r);
+    item = r->items[r->head];
+    r->head = (r->head + 1) % r->capacity;
+    r->count--;
+    pthread_cond_signal(&r->not_full);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return item;
+}
+
+void ring_close(ring *r) {
+  pthread_mutex_lock(&r->lock);
+  ring_account(r);
+  r->closed = 1;
+  pthread_cond_broadcast(&r->not_empty);
+  pthread_cond_broadcast(&r->not_full);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void ring_report(ring *r, const char *name, FILE *out) {
+  pthread_mutex_lock(&r->lock);
+  ring_account(r);
+  double elapsed = r->t_last - r->t_start;
+  double mean = (elapsed > 0) ? r->occupancy_integral / elapsed : 0;
+  fprintf(out, " %-16s mean occupancy %5.1f / %d (%3.0f%%), producer blocked %.2f s, consumers blocked %.2f s\n",
+          name, mean, r->capacity, 100 * mean / r->capacity, r->push_wait, r->pop_wait);
+  pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,51 @@
+/*
+ Bounded blocking ring buffer connecting the stages of the converter.
+
+ Producers block in ring_push() while the ring is full and consumers block
+ in ring_pop() while it is empty. Every ring keeps track of how full it
+ was over time and how long both sides were blocked, so that the slowest
+ stage of a pipeline can be identified with ring_report().
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+typedef struct ring {
+  void **items;
+  int capacity;
+  int head;  // index of the oldest item
+  int count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+
+  // statistics, protected by lock
+  double t_start, t_last;
+  double occupancy_integral; // sum of count * dt
+  double push_wait, pop_wait; // seconds spent blocked
+  long npush;
+} ring;
+
+/* Monotonic clock in seconds */
+double ring_now(void);
+
+int ring_init(ring *r, int capacity);
+void ring_destroy(ring *r);
+
+/* Block while full. Returns 0, or -1 if the ring has been closed. */
+int ring_push(ring *r, void *item);
+
+/* Block while empty. Returns NULL once the ring is closed and drained. */
+void *ring_pop(ring *r);
+
+/* No more items will be pushed. Wakes up all waiting consumers. */
+void ring_close(ring *r);
+
+/* One line summary: mean occupancy and time both sides spent blocked. */
+void ring_report(ring *r, const char *name, FILE *out);
+
+#endif // RING_H
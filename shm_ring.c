@@ -0,0 +1,98 @@
+/*
+ Request and completion rings in shared memory. See shm_ring.h.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+
+// Iterations to spin before sleeping: a few tens of microseconds, longer
+// than a wake up through the kernel costs. Spinning only helps if the
+// other side can run at the same time, so not at all on a single CPU.
+#define SHM_RING_SPIN 20000
+static int spin_limit = -1;
+
+// How often a sleeping side checks that its peer is still there
+#define SHM_RING_POLL_NS 100000000
+
+/* Not FUTEX_PRIVATE: the word is shared between processes. */
+static void futex_wait(uint32_t *addr, uint32_t val) {
+  struct timespec ts = {0, SHM_RING_POLL_NS};
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* Wait until *word differs from val. *waiting tells the other side that a
+ * futex_wake is needed. Returns 0, or -1 if the peer died. */
+static int wait_change(uint32_t *word, uint32_t val, uint32_t *waiting,
+                       shm_peer_alive_fn alive, void *arg) {
+  if (spin_limit < 0) {
+    cpu_set_t cpus;
+    int ncpu = (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ? CPU_COUNT(&cpus) : 1;
+    spin_limit = (ncpu > 1) ? SHM_RING_SPIN : 0;
+  }
+  for (int i = 0; i < spin_limit; i++) {
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) return 0;
+    cpu_relax();
+  }
+
+  while (1) {
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != val) break;
+    futex_wait(word, val);
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) break;
+    if (alive != NULL && !alive(arg)) {
+      __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+      return -1;
+    }
+  }
+  __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Publish a new value of *word and wake up the other side if it sleeps */
+static void publish(uint32_t *word, uint32_t val, uint32_t *waiting) {
+  __atomic_store_n(word, val, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) futex_wake(word);
+}
+
+void shm_ring_init(shm_ring *r) {
+  memset(r, 0, sizeof(shm_ring));
+}
+
+int shm_ring_push(shm_ring *r, const shm_msg *m, shm_peer_alive_fn alive, void *arg) {
+  uint32_t tail = r->tail; // only we write it
+  uint32_t head;
+  while (tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == SHM_RING_SIZE) {
+    if (wait_change(&r->head, head, &r->push_waiting, alive, arg) < 0) return -1;
+  }
+  r->msgs[tail % SHM_RING_SIZE] = *m;
+  publish(&r->tail, tail + 1, &r->pop_waiting);
+  return 0;
+}
+
+int shm_ring_pop(shm_ring *r, shm_msg *m, shm_peer_alive_fn alive, void *arg) {
+  uint32_t head = r->head; // only we write it
+  while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+    if (wait_change(&r->tail, head, &r->pop_waiting, alive, arg) < 0) return -1;
+  }
+  *m = r->msgs[head % SHM_RING_SIZE];
+  publish(&r->head, head + 1, &r->push_waiting);
+  return 0;
+}
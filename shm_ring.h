@@ -0,0 +1,64 @@
+/*
+ Request and completion rings between the XDS plugin and its workers.
+
+ The rings of a worker live in its own shared memory segment, which holds
+ nothing else; decoded pixels go to the slot pool shared by all workers.
+ Handing a frame number and a slot to a worker and getting the return
+ code back is then a couple of loads and stores instead of a write() and
+ a read() on a pipe. Each ring has a single producer and a single
+ consumer. A side that finds nothing to do spins for a short while and
+ only then sleeps on a futex; the other side enters the kernel to wake
+ it up only if it actually went to sleep.
+*/
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+
+#define SHM_RING_SIZE 16 // messages, a power of two
+
+typedef struct shm_msg {
+  int32_t frame;
+  int32_t slot;   // frame buffer to decode into
+  int32_t retval;
+  // telemetry, in ns: the worker times the stages of each request
+  uint32_t queue_ns;   // from sent until the worker took it
+  uint32_t read_ns;    // fetching the chunk
+  uint32_t decode_ns;  // decompressing it
+  uint32_t mask_ns;    // widening and masking into the frame buffer
+  uint64_t sent;       // latency_now() when the request was pushed
+} shm_msg;
+
+typedef struct shm_ring {
+  // head is written by the consumer and tail by the producer only.
+  // Both are futex words, on separate cache lines.
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t pop_waiting;
+  uint32_t tail __attribute__((aligned(64)));
+  uint32_t push_waiting;
+  shm_msg msgs[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shm_ring;
+
+/* Everything the parent and one worker share apart from the pixels */
+typedef struct shm_channel {
+  shm_ring request; // parent -> worker
+  shm_ring done;    // worker -> parent
+} shm_channel;
+
+/* Size of a worker's segment: the channel, in whole pages */
+#define SHM_CHANNEL_SIZE ((sizeof(shm_channel) + 4095) & ~(size_t)4095)
+
+/* Called while waiting, every now and then. Returns 0 once the other
+ * side is known to be gone, making push and pop give up. */
+typedef int (*shm_peer_alive_fn)(void *arg);
+
+void shm_ring_init(shm_ring *r);
+
+/* Wait while the ring is full. Returns 0, or -1 if the peer died. */
+int shm_ring_push(shm_ring *r, const shm_msg *m, shm_peer_alive_fn alive, void *arg);
+
+/* Wait while the ring is empty. Returns 0, or -1 if the peer died. */
+int shm_ring_pop(shm_ring *r, shm_msg *m, shm_peer_alive_fn alive, void *arg);
+
+#endif // SHM_RING_H
@@ -0,0 +1,214 @@
+/*
+ Output of all frames into one tar archive. See tar_archive.h.
+*/
+
+#define _GNU_SOURCE // pwritev
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tar_archive.h"
+
+static const char tar_zeros[2 * TAR_BLOCK];
+
+int tar_header(char header[TAR_BLOCK], const char *name, uint64_t size, time_t mtime) {
+  memset(header, 0, TAR_BLOCK);
+
+  // Names longer than 100 characters are split at a '/' into prefix and name.
+  size_t len = strlen(name);
+  if (len <= 100) {
+    memcpy(header, name, len);
+  } else {
+    const char *slash = name + len - 101;
+    while (*slash != '\0' && *slash != '/') slash++;
+    if (*slash == '\0' || slash - name > 155) return -1;
+    memcpy(header + 345, name, slash - name);
+    memcpy(header, slash + 1, len - (slash + 1 - name));
+  }
+  snprintf(header + 100, 8, "%07o", 0644);           // mode
+  snprintf(header + 108, 8, "%07o", 0);              // uid
+  snprintf(header + 116, 8, "%07o", 0);              // gid
+  snprintf(header + 124, 12, "%011llo", (unsigned long long)size);
+  snprintf(header + 136, 12, "%011llo", (unsigned long long)mtime);
+  header[156] = '0';                                  // regular file
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  // Checksum of the header with the checksum field taken as spaces
+  memset(header + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)header[i];
+  snprintf(header + 148, 8, "%06o", sum);
+  header[155] = ' ';
+  return 0;
+}
+
+int tar_archive_open(tar_archive *a, const char *path) {
+  a->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (a->fd < 0) return -1;
+  a->path = strdup(path);
+  if (a->path == NULL) {
+    close(a->fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  a->end = 0;
+  a->mtime = time(NULL);
+  a->failed = 0;
+  a->members = NULL;
+  a->nmembers = a->capacity = 0;
+  pthread_mutex_init(&a->lock, NULL);
+  return 0;
+}
+
+static int write_all(int fd, struct iovec *iov, int niov, uint64_t offset) {
+  size_t total = 0;
+  for (int i = 0; i < niov; i++) total += iov[i].iov_len;
+  size_t done = 0;
+  while (done < total) {
+    // Skip what has been written already
+    struct iovec rest[3];
+    int n = 0;
+    size_t skip = done;
+    for (int i = 0; i < niov; i++) {
+      if (skip >= iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        continue;
+      }
+      rest[n].iov_base = (char *)iov[i].iov_base + skip;
+      rest[n].iov_len = iov[i].iov_len - skip;
+      skip = 0;
+      n++;
+    }
+    ssize_t ret = pwritev(fd, rest, n, offset + done);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+// The space reserved for a member could not be filled in. Left as zeros,
+// it would end the archive for readers, so it becomes a member of the
+// same size that they skip over.
+static void mark_failed(tar_archive *a, const char *name, uint64_t offset, size_t size) {
+  char header[TAR_BLOCK], failed_name[4096];
+  int saved_errno = errno;
+
+  snprintf(failed_name, sizeof(failed_name), "%s.failed", name);
+  if (tar_header(header, failed_name, size, a->mtime) < 0) tar_header(header, "failed", size, a->mtime);
+  struct iovec iov = {header, TAR_BLOCK};
+  if (write_all(a->fd, &iov, 1, offset) < 0) __sync_fetch_and_add(&a->failed, 1);
+  errno = saved_errno;
+}
+
+int tar_archive_append(tar_archive *a, const char *name, const void *data, size_t size) {
+  char header[TAR_BLOCK];
+  while (*name == '/') name++; // members are relative
+
+  if (tar_header(header, name, size, a->mtime) < 0) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  // Claim the index entry first, so that nothing can fail once the
+  // member has been written.
+  char *copy = strdup(name);
+  if (copy == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  pthread_mutex_lock(&a->lock);
+  if (a->nmembers == a->capacity) {
+    size_t capacity = a->capacity ? 2 * a->capacity : 1024;
+    tar_member *p = (tar_member *)realloc(a->members, sizeof(tar_member) * capacity);
+    if (p == NULL) {
+      pthread_mutex_unlock(&a->lock);
+      free(copy);
+      errno = ENOMEM;
+      return -1;
+    }
+    a->members = p;
+    a->capacity = capacity;
+  }
+  size_t slot = a->nmembers++;
+  a->members[slot].name = NULL; // not listed until written
+  pthread_mutex_unlock(&a->lock);
+
+  size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+  uint64_t offset = __sync_fetch_and_add(&a->end, TAR_BLOCK + size + padding);
+
+  struct iovec iov[3] = {
+    {header, TAR_BLOCK},
+    {(void *)data, size},
+    {(void *)tar_zeros, padding}
+  };
+  if (write_all(a->fd, iov, 3, offset) < 0) {
+    mark_failed(a, name, offset, size);
+    free(copy);
+    return -1;
+  }
+
+  // The array may have been moved by another append.
+  pthread_mutex_lock(&a->lock);
+  tar_member *m = &a->members[slot];
+  m->name = copy;
+  m->offset = offset + TAR_BLOCK;
+  m->size = size;
+  pthread_mutex_unlock(&a->lock);
+  return 0;
+}
+
+static int compare_members(const void *a, const void *b) {
+  const char *name_a = ((const tar_member *)a)->name, *name_b = ((const tar_member *)b)->name;
+  if (name_a == NULL || name_b == NULL) return (name_a == NULL) - (name_b == NULL); // failed members last
+  return strcmp(name_a, name_b);
+}
+
+int tar_archive_close(tar_archive *a) {
+  int ret = 0;
+  int failed = a->failed;
+
+  // Two zero blocks end the archive.
+  if (pwrite(a->fd, tar_zeros, sizeof(tar_zeros), a->end) != sizeof(tar_zeros)) ret = -1;
+  if (close(a->fd) < 0) ret = -1;
+
+  qsort(a->members, a->nmembers, sizeof(tar_member), compare_members);
+  size_t len = strlen(a->path);
+  char *index_path = (char *)malloc(len + 5);
+  if (index_path != NULL) {
+    snprintf(index_path, len + 5, "%s.idx", a->path);
+    FILE *fh = fopen(index_path, "w");
+    if (fh == NULL) {
+      ret = -1;
+    } else {
+      fprintf(fh, "# name data_offset size\n");
+      for (size_t i = 0; i < a->nmembers && a->members[i].name != NULL; i++) {
+        fprintf(fh, "%s %llu %llu\n", a->members[i].name,
+                (unsigned long long)a->members[i].offset, (unsigned long long)a->members[i].size);
+      }
+      if (fclose(fh) != 0) ret = -1;
+    }
+    free(index_path);
+  } else {
+    ret = -1;
+  }
+
+  for (size_t i = 0; i < a->nmembers; i++) free(a->members[i].name);
+  free(a->members);
+  free(a->path);
+  a->members = NULL;
+  a->nmembers = a->capacity = 0;
+  pthread_mutex_destroy(&a->lock);
+  if (failed > 0) {
+    errno = EIO; // zero blocks in the middle end the archive early
+    ret = -1;
+  }
+  return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ Output of all frames into one uncompressed tar archive.
+
+ Creating thousands of small files costs more on a parallel file system's
+ metadata server than writing the data. Instead, frames become members of
+ one POSIX ustar archive that most tools can read directly.
+
+ Any number of threads can append at the same time: each reserves the
+ space for its member (header and padded data) by atomically advancing
+ the end of the archive and then writes there with a single pwritev().
+ Members therefore appear in completion order. If a member cannot be
+ written, its reserved space becomes a member named "<name>.failed" so that
+ readers still find the members after it. A sidecar index
+ (archive.idx) lists, sorted by name, where each member's data starts
+ and how long it is, so readers can seek to a frame without scanning.
+*/
+
+#ifndef TAR_ARCHIVE_H
+#define TAR_ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TAR_BLOCK 512
+
+typedef struct tar_member {
+  char *name;
+  uint64_t offset; // of the data, the header is the block before
+  uint64_t size;
+} tar_member;
+
+typedef struct tar_archive {
+  char *path;
+  int fd;
+  uint64_t end;       // next free offset, advanced atomically
+  time_t mtime;
+  int failed;         // reserved space that could not be filled in, set atomically
+
+  pthread_mutex_t lock; // protects the index
+  tar_member *members;
+  size_t nmembers, capacity;
+} tar_archive;
+
+/* Create (or truncate) the archive. Returns 0, or -1 with errno set. */
+int tar_archive_open(tar_archive *a, const char *path);
+
+/* Append a member. Thread safe. Returns 0, or -1 with errno set. */
+int tar_archive_append(tar_archive *a, const char *name, const void *data, size_t size);
+
+/* Write the end of archive marker and the index (path + ".idx").
+ * Returns 0, or -1 with errno set, also when the archive is damaged
+ * because a failed member could not be marked. */
+int tar_archive_close(tar_archive *a);
+
+/* Fill a ustar header for a regular file. Returns -1 if name does not fit. */
+int tar_header(char header[TAR_BLOCK], const char *name, uint64_t size, time_t mtime);
+
+#endif // TAR_ARCHIVE_H
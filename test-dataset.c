@@ -0,0 +1,185 @@
+/*
+ Writes a small synthetic EIGER master file for `make test-writer`.
+
+ The data blocks are stored in the master file itself, one frame per
+ chunk, either bitshuffle/LZ4 (16 bit) or lz4 (32 bit) compressed. Pixels
+ are mostly small counts with spikes, saturated pixels and a pixel mask,
+ so that the byte offset encoder uses every escape width.
+
+ Usage: test-dataset master.h5 16|32
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hdf5.h"
+#include "hdf5_hl.h"
+
+#define XPIXELS 517
+#define YPIXELS 259
+#define NFRAMES_PER_BLOCK 3
+#define NBLOCKS 2
+
+#define BSHUF_H5FILTER 32008
+#define BSHUF_H5_COMPRESS_LZ4 2
+#define LZ4_H5FILTER 32004
+
+extern const H5Z_class2_t H5Z_LZ4;
+extern const H5Z_class2_t bshuf_H5Filter;
+
+static void write_double(hid_t file, const char *path, double v)
+{
+  hsize_t one = 1;
+  H5LTmake_dataset_double(file, path, 0, &one, &v);
+}
+
+static void write_int(hid_t file, const char *path, int v)
+{
+  hsize_t one = 1;
+  H5LTmake_dataset_int(file, path, 0, &one, &v);
+}
+
+static int write_block(hid_t data_group, int block, int bits, unsigned int *seed)
+{
+  size_t npixels = (size_t)XPIXELS * YPIXELS, elem_size = bits / 8;
+  uint32_t saturated = (bits == 32) ? UINT32_MAX : (1U << bits) - 1;
+  hsize_t dims[3] = {NFRAMES_PER_BLOCK, YPIXELS, XPIXELS};
+  hsize_t chunk[3] = {1, YPIXELS, XPIXELS};
+  char name[20];
+  int ret = -1;
+
+  hid_t space = H5Screate_simple(3, dims, NULL);
+  hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+  H5Pset_chunk(dcpl, 3, chunk);
+  if (bits == 16)
+  {
+    unsigned int cd_values[5] = {0, 0, (unsigned int)elem_size, 0, BSHUF_H5_COMPRESS_LZ4};
+    H5Pset_filter(dcpl, BSHUF_H5FILTER, H5Z_FLAG_MANDATORY, 5, cd_values);
+  }
+  else
+  {
+    H5Pset_filter(dcpl, LZ4_H5FILTER, H5Z_FLAG_MANDATORY, 0, NULL);
+  }
+  snprintf(name, sizeof(name), "data_%06d", block);
+  hid_t data = H5Dcreate2(data_group, name, (bits == 16) ? H5T_STD_U16LE : H5T_STD_U32LE,
+                          space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+  void *pixels = malloc(npixels * NFRAMES_PER_BLOCK * elem_size);
+  if (data < 0 || pixels == NULL)
+    goto done;
+  for (size_t i = 0; i < npixels * NFRAMES_PER_BLOCK; i++)
+  {
+    uint32_t v = (rand_r(seed) % 64 == 0) ? rand_r(seed) % 1000 : rand_r(seed) % 4;
+    if (rand_r(seed) % 512 == 0)
+      v = rand_r(seed) % 60000; // 2 byte deltas
+    if (bits == 32 && rand_r(seed) % 512 == 0)
+      v = 0x7ffffff0U + rand_r(seed) % 8; // 4 and 8 byte deltas
+    if (rand_r(seed) % 4096 == 0)
+      v = saturated;
+    if (bits == 32 && i % 1024 == 0)
+      v = saturated; // -1 and then INT32_MAX: an 8 byte delta
+    if (bits == 32 && i % 1024 == 1)
+      v = INT32_MAX;
+    if (bits == 16)
+    {
+      uint16_t v16 = (uint16_t)v;
+      memcpy((char *)pixels + 2 * i, &v16, 2);
+    }
+    else
+    {
+      memcpy((char *)pixels + 4 * i, &v, 4);
+    }
+  }
+  if (H5Dwrite(data, (bits == 16) ? H5T_NATIVE_UINT16 : H5T_NATIVE_UINT32,
+               H5S_ALL, H5S_ALL, H5P_DEFAULT, pixels) >= 0)
+    ret = 0;
+
+done:
+  free(pixels);
+  if (data >= 0)
+    H5Dclose(data);
+  H5Pclose(dcpl);
+  H5Sclose(space);
+  return ret;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3 || (atoi(argv[2]) != 16 && atoi(argv[2]) != 32))
+  {
+    fprintf(stderr, "Usage: %s master.h5 16|32\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int bits = atoi(argv[2]);
+  int nframes = NFRAMES_PER_BLOCK * NBLOCKS;
+  unsigned int seed = 1;
+
+  H5Zregister(&H5Z_LZ4);
+  H5Zregister(&bshuf_H5Filter);
+
+  hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+  H5Pset_create_intermediate_group(lcpl, 1);
+  hid_t file = H5Fcreate(argv[1], H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  if (file < 0)
+  {
+    fprintf(stderr, "failed to create %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  H5Gclose(H5Gcreate2(file, "/entry/instrument/detector/detectorSpecific", lcpl, H5P_DEFAULT, H5P_DEFAULT));
+  H5Gclose(H5Gcreate2(file, "/entry/sample/goniometer", lcpl, H5P_DEFAULT, H5P_DEFAULT));
+  H5Gclose(H5Gcreate2(file, "/entry/sample/beam", lcpl, H5P_DEFAULT, H5P_DEFAULT));
+
+  H5LTmake_dataset_string(file, "/entry/instrument/detector/description", "Dectris EIGER 16M (synthetic)");
+  H5LTmake_dataset_string(file, "/entry/instrument/detector/detector_number", "E-32-0000");
+  H5LTmake_dataset_string(file, "/entry/instrument/detector/detectorSpecific/software_version", "1.8.0");
+  write_int(file, "/entry/instrument/detector/detectorSpecific/nimages", nframes);
+  write_int(file, "/entry/instrument/detector/detectorSpecific/ntrigger", 1);
+  write_int(file, "/entry/instrument/detector/bit_depth_image", bits);
+  write_int(file, "/entry/instrument/detector/detectorSpecific/saturation_value", 50000);
+  write_double(file, "/entry/instrument/detector/sensor_thickness", 450E-6);
+  write_int(file, "/entry/instrument/detector/detectorSpecific/x_pixels_in_detector", XPIXELS);
+  write_int(file, "/entry/instrument/detector/detectorSpecific/y_pixels_in_detector", YPIXELS);
+  write_int(file, "/entry/instrument/detector/beam_center_x", XPIXELS / 2);
+  write_int(file, "/entry/instrument/detector/beam_center_y", YPIXELS / 2);
+  write_double(file, "/entry/instrument/detector/count_time", 0.0099999);
+  write_double(file, "/entry/instrument/detector/frame_time", 0.01);
+  write_double(file, "/entry/instrument/detector/x_pixel_size", 75E-6);
+  write_double(file, "/entry/instrument/detector/distance", 0.2);
+  write_double(file, "/entry/sample/beam/incident_wavelength", 0.979);
+  write_double(file, "/entry/sample/goniometer/omega_range_average", 0.1);
+
+  hsize_t nangles = nframes;
+  double angles[NFRAMES_PER_BLOCK * NBLOCKS];
+  for (int i = 0; i < nframes; i++)
+    angles[i] = 10 + 0.1 * i;
+  H5LTmake_dataset_double(file, "/entry/sample/goniometer/omega", 1, &nangles, angles);
+
+  // Module gaps (1), a dead pixel (2) and a hot pixel (16)
+  hsize_t mask_dims[2] = {YPIXELS, XPIXELS};
+  int *mask = calloc((size_t)XPIXELS * YPIXELS, sizeof(int));
+  if (mask == NULL)
+    return EXIT_FAILURE;
+  for (int y = 0; y < YPIXELS; y++)
+    for (int x = 250; x < 260; x++)
+      mask[y * XPIXELS + x] = 1;
+  mask[1000] = 2;
+  mask[XPIXELS * YPIXELS - 1] = 16;
+  H5LTmake_dataset_int(file, "/entry/instrument/detector/detectorSpecific/pixel_mask", 2, mask_dims, mask);
+  free(mask);
+
+  hid_t data_group = H5Gcreate2(file, "/entry/data", lcpl, H5P_DEFAULT, H5P_DEFAULT);
+  int ret = 0;
+  for (int block = 1; block <= NBLOCKS && ret == 0; block++)
+    ret = write_block(data_group, block, bits, &seed);
+  H5Gclose(data_group);
+  H5Pclose(lcpl);
+  H5Fclose(file);
+  if (ret < 0)
+  {
+    fprintf(stderr, "failed to write the data blocks of %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}